@@ -0,0 +1,359 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SOCKET "coloring.sock"
+#define LINE_SIZE 4096
+#define MAX_CONNECTIONS 32
+
+typedef struct {
+    int fd;
+    char buffer[LINE_SIZE];
+    size_t start;
+    size_t end;
+} Connection;
+
+typedef struct {
+    const char* socket_path;
+    const char* format;
+    const char* out_dir;
+    const char* palette;
+    const char* min_area;
+    const char* close_ink;
+    const char* color_tolerance;
+    const char* simplify;
+    bool rle;
+    bool send_inline;
+    int connections;
+} Options;
+
+void print_usage();
+int connect_socket(const char* path);
+bool send_all(int fd, const void* data, size_t size);
+bool read_line(Connection* conn, char* line, size_t size);
+bool read_bytes(Connection* conn, void* data, size_t size);
+bool read_file(const char* path, unsigned char** data, size_t* size);
+bool output_path(const Options* options, const char* input, char* path, size_t path_size);
+bool append_field(char* request, size_t size, const char* key, const char* value);
+bool submit_job(Connection* conn, const Options* options, const char* input);
+int run_connection(const Options* options, char** inputs, int input_count, int first, int step);
+
+int main(int argc, char* argv[]) {
+    Options options = {DEFAULT_SOCKET, "bmp", ".", NULL, NULL, NULL, NULL, NULL, true, false, 1};
+    char** inputs = malloc((size_t)argc * sizeof(char*));
+    int input_count = 0;
+    if (!inputs) return 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            options.format = argv[++i];
+        } else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+            options.out_dir = argv[++i];
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+            options.palette = argv[++i];
+        } else if (strcmp(argv[i], "--min-area") == 0 && i + 1 < argc) {
+            options.min_area = argv[++i];
+        } else if (strcmp(argv[i], "--close-ink") == 0 && i + 1 < argc) {
+            options.close_ink = argv[++i];
+        } else if (strcmp(argv[i], "--color-tolerance") == 0 && i + 1 < argc) {
+            options.color_tolerance = argv[++i];
+        } else if (strcmp(argv[i], "--simplify") == 0 && i + 1 < argc) {
+            options.simplify = argv[++i];
+        } else if (strcmp(argv[i], "--no-rle") == 0) {
+            options.rle = false;
+        } else if (strcmp(argv[i], "--inline") == 0) {
+            options.send_inline = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.connections = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            print_usage();
+            free(inputs);
+            return 1;
+        } else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+
+    if (input_count == 0 || options.connections < 1 || options.connections > MAX_CONNECTIONS ||
+        (strcmp(options.format, "bmp") != 0 && strcmp(options.format, "cmap") != 0 && strcmp(options.format, "svg") != 0 &&
+         strcmp(options.format, "geojson") != 0 && strcmp(options.format, "none") != 0)) {
+        print_usage();
+        free(inputs);
+        return 1;
+    }
+
+    /* Each connection is its own process and takes every n-th map, so the daemon sees n clients at once. */
+    int connections = options.connections < input_count ? options.connections : input_count;
+    int failures = 0;
+    if (connections == 1) {
+        failures = run_connection(&options, inputs, input_count, 0, 1);
+    } else {
+        for (int c = 0; c < connections; c++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                exit(run_connection(&options, inputs, input_count, c, connections) ? 1 : 0);
+            }
+            if (pid < 0) {
+                fprintf(stderr, "fork failed: %s\n", strerror(errno));
+                failures++;
+            }
+        }
+        int status;
+        while (wait(&status) > 0) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
+        }
+    }
+
+    free(inputs);
+    return failures ? 1 : 0;
+}
+
+void print_usage() {
+    fprintf(stderr, "Usage: client [--socket PATH] [--format bmp|cmap|svg|geojson|none] [--out-dir DIR] [--no-rle]\n");
+    fprintf(stderr, "              [--palette FILE] [--min-area PIXELS] [--close-ink RADIUS] [--color-tolerance N]\n");
+    fprintf(stderr, "              [--simplify PIXELS] [--inline] [-j CONNECTIONS] MAP...\n");
+    fprintf(stderr, "Submits each MAP to a daemon started with ./main --daemon PATH (default %s).\n", DEFAULT_SOCKET);
+    fprintf(stderr, "With --inline the image is sent over the socket and the result comes back the same way,\n");
+    fprintf(stderr, "otherwise the daemon reads and writes the files itself. Options left out keep the daemon's.\n");
+}
+
+int connect_socket(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool send_all(int fd, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool read_line(Connection* conn, char* line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        while (conn->start < conn->end) {
+            char c = conn->buffer[conn->start++];
+            if (c == '\n') {
+                line[length] = '\0';
+                return true;
+            }
+            if (length + 1 < size) line[length++] = c;
+        }
+
+        ssize_t got = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        conn->start = 0;
+        conn->end = (size_t)got;
+    }
+}
+
+bool read_bytes(Connection* conn, void* data, size_t size) {
+    unsigned char* out = data;
+    size_t buffered = conn->end - conn->start;
+    if (buffered > size) buffered = size;
+    memcpy(out, conn->buffer + conn->start, buffered);
+    conn->start += buffered;
+
+    size_t done = buffered;
+    while (done < size) {
+        ssize_t got = recv(conn->fd, out + done, size - done, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        done += (size_t)got;
+    }
+    return true;
+}
+
+bool read_file(const char* path, unsigned char** data, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    bool ok = fseek(file, 0, SEEK_END) == 0;
+    long length = ok ? ftell(file) : -1;
+    ok = length > 0 && fseek(file, 0, SEEK_SET) == 0;
+    *data = ok ? malloc((size_t)length) : NULL;
+    ok = *data && fread(*data, 1, (size_t)length, file) == (size_t)length;
+    fclose(file);
+
+    if (!ok) {
+        free(*data);
+        *data = NULL;
+        return false;
+    }
+    *size = (size_t)length;
+    return true;
+}
+
+/* DIR/<input name without extension>-colored.<format>, made absolute unless the result comes back inline. */
+bool output_path(const Options* options, const char* input, char* path, size_t path_size) {
+    const char* base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    const char* dot = strrchr(base, '.');
+    int base_length = dot ? (int)(dot - base) : (int)strlen(base);
+
+    char dir[4096];
+    if (options->send_inline) {
+        snprintf(dir, sizeof(dir), "%s", options->out_dir);
+    } else if (!realpath(options->out_dir, dir)) {
+        return false;
+    }
+    return snprintf(path, path_size, "%s/%.*s-colored.%s", dir, base_length, base, options->format) < (int)path_size;
+}
+
+/*
+ * Appends " key=value" to the request, quoting the value and escaping quotes
+ * and backslashes so paths with spaces survive. Fails on a line break, which
+ * would end the request early, or when the line gets too long for the daemon.
+ */
+bool append_field(char* request, size_t size, const char* key, const char* value) {
+    size_t used = strlen(request);
+    if (strpbrk(value, "\r\n")) return false;
+    int written = snprintf(request + used, size - used, " %s=\"", key);
+    if (written < 0 || (size_t)written >= size - used) return false;
+    used += (size_t)written;
+    for (const char* c = value; *c; c++) {
+        if (used + 3 >= size) return false;
+        if (*c == '"' || *c == '\\') request[used++] = '\\';
+        request[used++] = *c;
+    }
+    if (used + 2 >= size) return false;
+    request[used++] = '"';
+    request[used] = '\0';
+    return true;
+}
+
+/* Sends one COLOR request and prints the streamed reply until OK or ERROR. */
+bool submit_job(Connection* conn, const Options* options, const char* input) {
+    bool want_output = strcmp(options->format, "none") != 0;
+    char output[4096] = "";
+    if (want_output && !output_path(options, input, output, sizeof(output))) {
+        fprintf(stderr, "%s: bad output directory %s\n", input, options->out_dir);
+        return false;
+    }
+
+    /* The daemon reads the request as one line of at most LINE_SIZE bytes, newline included. */
+    char request[LINE_SIZE - 1];
+    snprintf(request, sizeof(request), "COLOR format=%s rle=%d", options->format, options->rle);
+    bool fits = true;
+    char palette[4096];
+    if (options->palette) {
+        if (!realpath(options->palette, palette)) {
+            fprintf(stderr, "%s: %s\n", options->palette, strerror(errno));
+            return false;
+        }
+        fits = append_field(request, sizeof(request), "palette", palette);
+    }
+    if (options->min_area) fits = fits && append_field(request, sizeof(request), "min_area", options->min_area);
+    if (options->close_ink) fits = fits && append_field(request, sizeof(request), "close_ink", options->close_ink);
+    if (options->color_tolerance) {
+        fits = fits && append_field(request, sizeof(request), "color_tolerance", options->color_tolerance);
+    }
+    if (options->simplify) fits = fits && append_field(request, sizeof(request), "simplify", options->simplify);
+
+    unsigned char* data = NULL;
+    size_t size = 0;
+    if (options->send_inline) {
+        if (!read_file(input, &data, &size)) {
+            fprintf(stderr, "%s: cannot read the file\n", input);
+            return false;
+        }
+        char length[32];
+        snprintf(length, sizeof(length), "%zu", size);
+        fits = fits && append_field(request, sizeof(request), "size", length);
+        if (want_output) fits = fits && append_field(request, sizeof(request), "output", "-");
+    } else {
+        char absolute[4096];
+        if (!realpath(input, absolute)) {
+            fprintf(stderr, "%s: %s\n", input, strerror(errno));
+            return false;
+        }
+        fits = fits && append_field(request, sizeof(request), "input", absolute);
+        if (want_output) fits = fits && append_field(request, sizeof(request), "output", output);
+    }
+    if (!fits) {
+        fprintf(stderr, "%s: a path or option has a line break or the request is too long\n", input);
+        free(data);
+        return false;
+    }
+    strcat(request, "\n");
+
+    bool ok = send_all(conn->fd, request, strlen(request)) && (!data || send_all(conn->fd, data, size));
+    free(data);
+    if (!ok) {
+        fprintf(stderr, "%s: the daemon closed the connection\n", input);
+        return false;
+    }
+
+    char line[LINE_SIZE];
+    bool saved = true;
+    while (read_line(conn, line, sizeof(line))) {
+        unsigned long long length;
+        if (sscanf(line, "DATA %llu", &length) == 1) {
+            unsigned char* result = malloc(length ? (size_t)length : 1);
+            if (!result || !read_bytes(conn, result, (size_t)length)) {
+                free(result);
+                break;
+            }
+            FILE* file = fopen(output, "wb");
+            bool written = file && fwrite(result, 1, (size_t)length, file) == (size_t)length;
+            if (file && fclose(file) != 0) written = false;
+            free(result);
+            printf("%s: %s %s (%llu bytes)\n", input, written ? "wrote" : "FAILED to write", output, length);
+            if (!written) saved = false;
+            continue;
+        }
+
+        printf("%s: %s\n", input, line);
+        if (strncmp(line, "OK ", 3) == 0) return saved;
+        if (strncmp(line, "ERROR ", 6) == 0) return false;
+    }
+    fprintf(stderr, "%s: the daemon closed the connection\n", input);
+    return false;
+}
+
+/* Submits inputs first, first + step, ... over one connection; returns the number of failed jobs. */
+int run_connection(const Options* options, char** inputs, int input_count, int first, int step) {
+    Connection conn;
+    conn.fd = connect_socket(options->socket_path);
+    conn.start = conn.end = 0;
+    if (conn.fd < 0) return input_count;
+
+    int failures = 0;
+    for (int i = first; i < input_count; i += step) {
+        if (!submit_job(&conn, options, inputs[i])) failures++;
+    }
+    close(conn.fd);
+    return failures;
+}
@@ -1,22 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 
 #define MAX_REGIONS 1000
+#ifndef MAX_COLORS
 #define MAX_COLORS 4
+#endif
+#if MAX_COLORS != 4 && MAX_COLORS != 8 && MAX_COLORS != 16 && MAX_COLORS != 32 && MAX_COLORS != 64
+#error "MAX_COLORS must be 4, 8, 16, 32 or 64"
+#endif
 #define WINDOW_WIDTH 1200
 #define WINDOW_HEIGHT 800
 #define MENU_HEIGHT 100
+#define INK_THRESHOLD 50
+
+#define MAP_EXPORT_MAGIC "CMAP"
+#define MAP_EXPORT_VERSION 1
+#define MAP_EXPORT_ALIGN 64
+#define MAP_EXPORT_FLAG_RLE 0x1u
+#define MAP_EXPORT_FLAG_COLORED 0x2u
+
+#define MAP_CACHE_DEFAULT_DIR "cache"
+#define MAP_CACHE_DEFAULT_LIMIT (256ull * 1024 * 1024)
+/* Part of the cache key; bump it when the labels change without a format change. */
+#define MAP_CACHE_REVISION 1
+
+#define PREFETCH_SLOTS 5
+#define PREFETCH_RADIUS 2
+#define PREFETCH_DEFAULT_LIMIT (512ull * 1024 * 1024)
+
+#define TILE_SIZE 256
+#define TILE_CACHE_SIZE 192
+#define MAX_LOD_LEVELS 16
+#define MIN_VIEW_SCALE (1.0 / 256)
+#define MAX_VIEW_SCALE 32.0
+
+#define PREVIEW_MIN_PIXELS (2000 * 1000)
+#define PREVIEW_TARGET_PIXELS (1024 * 1024)
+#define PREVIEW_MAX_FACTOR 8
+
+#define FRAME_BUDGET_NS (10ull * 1000000)
+#define COLORING_MIN_RATE 10.0
+#define COLORING_TARGET_MS 5000
+#define LOADING_REDRAW_MS 100
+#define REPLAY_CHECKPOINT_INTERVAL 64
+#define REPLAY_MAX_CHECKPOINTS 32
+#define REPLAY_MAX_SPEED 64.0
+
+#define COLOR_LOG_MAGIC "CLOG"
+#define COLOR_LOG_VERSION 2
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+#define LOG_FILE "log.txt"
+#define LOG_BUFFER_SIZE (1u << 20)
+#define LOG_RECORD_ALIGN 32u
+#define LOG_FLUSH_INTERVAL 100
+
+#define PROFILE_MAX_EVENTS 65536
+#define PROFILE_MAX_STAGES 64
+#define PROFILE_MAX_THREADS 16
+#define PROFILE_COUNTERS 2
+
+#define MEM_MAX_WATCHES 32
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define STACK_INITIAL_CAPACITY 1024
+
+#define EDIT_PENDING -2
+#define RECOLOR_STEPS 16
+#define REGION_SPECK -3
+#define MERGE_MAX_CANDIDATES 16
+#define TERRITORY_RADIUS 8
+#define LINK_RIGHT 1
+#define LINK_DOWN 2
+#define LINK_INK 4
+#define BRUSH_MAX_SIZE 64
+
+#define VALIDATE_MAX_THREADS 16
+#define VECTOR_DEFAULT_TOLERANCE 1.0
+#define VECTOR_KEEP 1
+#define VECTOR_DECIDED 2
+
+#define CHECK_GOLDEN_FILE "golden-%d%s.txt"
+#define CHECK_BASELINE_FILE "baseline%s.txt"
+#define CHECK_DEFAULT_MARGIN 25.0
+#define CHECK_MIN_SLACK_NS 200000ull
+#define CHECK_EDITS 48
+
+#define DAEMON_DEFAULT_WORKERS 4
+#define DAEMON_MAX_WORKERS 8
+#define DAEMON_QUEUE_SIZE 16
+#define DAEMON_BACKLOG 64
+#define DAEMON_LINE_SIZE 4096
+#define DAEMON_MAX_PAYLOAD (512ull * 1024 * 1024)
+#define JOB_MAX_STAGES 32
+
+#define LOG_RECORD_EMPTY 0
+#define LOG_RECORD_READY 1
+#define LOG_RECORD_PADDING 2
+
+/* Calls below LOG_MIN_LEVEL compile to nothing, arguments included. */
+#define log_at(level, ...) do { if ((level) >= LOG_MIN_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
 
 typedef enum{
     MAIN_MENU, GAME_SCREEN, SETTINGS_SCREEN
 }Status_menu;
 
+/* One bit per palette color, sized to the palette chosen at compile time. */
+#if MAX_COLORS <= 32
+typedef uint32_t ColorSet;
+#define COLOR_SET_CTZ __builtin_ctz
+#else
+typedef uint64_t ColorSet;
+#define COLOR_SET_CTZ __builtin_ctzll
+#endif
+
+typedef struct {
+    SDL_Color colors[MAX_COLORS];
+    int size;
+    ColorSet mask;
+} Palette;
+
+/*
+ * Everything a map is processed and written with besides the image.
+ * map_options holds the command line's; a daemon job fills its own from the
+ * request and points its map at it, so jobs never touch the shared one.
+ */
+typedef struct {
+    int min_region_area;
+    int ink_close_radius;
+    int color_tolerance;
+    double vector_tolerance;
+    bool rle;
+    Palette palette;
+} MapOptions;
+
 typedef struct NeighborNode {
     int region_id;
     struct NeighborNode* next;
@@ -26,14 +185,38 @@ typedef struct {
     int id;
     int color;
     int pixel_count;
+    int min_x, min_y, max_x, max_y;
     NeighborNode* neighbors;
     bool is_colored;
 } Region;
 
-typedef struct StackNode {
+typedef struct {
     int x, y;
-    struct StackNode* next;
-} StackNode;
+} StackItem;
+
+typedef struct {
+    StackItem* items;
+    size_t count;
+    size_t capacity;
+} PixelStack;
+
+/*
+ * Bump allocator for everything that lives as long as a map, such as the
+ * neighbor lists. Chunks are never freed one allocation at a time; the whole
+ * arena goes away with the map, or is reset so the next map reuses its
+ * chunks from the spare list.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* head;
+    ArenaChunk* spare;
+    size_t reserved;
+} Arena;
 
 typedef struct {
     SDL_Surface* surface;
@@ -44,168 +227,896 @@ typedef struct {
     int height;
     unsigned int* pixels;
     int* reg_map; 
+    int colors_used;
+    int preview_scale;
+    SDL_atomic_t* progress;
+    Arena arena;
+    int* chain_queue;        // Kempe chain scratch, MAX_REGIONS entries, allocated on first use
+    unsigned char* in_chain;
+    const MapOptions* options;  // NULL for map_options
 } Map;
 
+/*
+ * Log messages are queued in a ring of LOG_BUFFER_SIZE bytes. Producers
+ * reserve a record by advancing log_head with a CAS, fill it in and mark it
+ * ready; the flusher thread writes records in order from log_tail and zeroes
+ * them before handing the space back. A record that would straddle the end
+ * of the ring is preceded by a padding record.
+ */
+typedef struct {
+    uint32_t size;
+    SDL_atomic_t state;
+    int64_t seconds;
+    int32_t level;
+    int32_t length;
+} LogRecord;
+
+typedef enum {
+    MEM_SURFACE, MEM_ORIGINAL_SURFACE, MEM_DECODE, MEM_REG_MAP, MEM_VISITED,
+    MEM_REGIONS, MEM_ARENA, MEM_STACK, MEM_EXPORT, MEM_TILES, MEM_CLEANUP, MEM_DAEMON, MEM_VECTOR, MEM_REPLAY, MEM_ADJACENCY, MEM_SEGMENT, MEM_SUBSYSTEMS
+} MemSubsystem;
+
+/* Prefix of every tracked heap block, keeps the payload 16-byte aligned. */
+typedef struct {
+    uint64_t size;
+    uint32_t subsystem;
+    uint32_t reserved;
+} MemHeader;
+
+typedef struct {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t counters[PROFILE_COUNTERS];
+    int mem_watch;
+    uint64_t mem_start;
+} ProfileScope;
+
+/*
+ * Memory watches of one thread. total is what the thread allocated minus
+ * what it freed, so stages running at the same time on other threads, such
+ * as parallel daemon jobs, do not raise each other's peaks.
+ */
+typedef struct {
+    int64_t total;
+    int64_t watch_start[MEM_MAX_WATCHES];
+    int64_t watch_peak[MEM_MAX_WATCHES];
+    uint64_t watch_base[MEM_MAX_WATCHES];
+    bool watch_used[MEM_MAX_WATCHES];
+    int watch_limit;
+} MemThread;
+
+typedef struct {
+    const char* name;
+    int thread;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t counters[PROFILE_COUNTERS];
+    uint64_t peak_bytes;
+} ProfileEvent;
+
+typedef struct {
+    const char* name;
+    int thread;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t counters[PROFILE_COUNTERS];
+    uint64_t peak_bytes;
+    uint64_t peak_delta_bytes;
+} ProfileStage;
+
+typedef struct {
+    long long unlabeled;
+    long long ink_labeled;
+    long long bad_colors;
+    long long conflicts;
+    long long asymmetric;
+    long long bad_edges;
+    long long edges;
+} ValidateResult;
+
+typedef struct {
+    const Map* map;
+    int first_row, last_row;
+    int first_region, last_region;
+    ValidateResult result;
+} ValidateJob;
+
+typedef struct {
+    int width;
+    int height;
+    int regions;
+    long long edges;
+    long long conflicts;
+    uint64_t labels;
+    uint64_t graph;
+    uint64_t colors;
+} MapDigest;
+
+/* One line of golden.txt (digest) or baseline.txt (stage and best_ns). */
+typedef struct {
+    char map[256];
+    char stage[32];
+    MapDigest digest;
+    uint64_t best_ns;
+} CheckEntry;
+
+typedef struct {
+    SDL_threadID id;
+    char name[32];
+    int counter_fds[PROFILE_COUNTERS];
+} ProfileThread;
+
+/* Stage times of the daemon job running on the current thread, filled in by profile_end. */
+typedef struct {
+    const char* name;
+    int count;
+    uint64_t total_ns;
+} JobStage;
+
+typedef struct {
+    JobStage stages[JOB_MAX_STAGES];
+    int count;
+} JobStats;
+
+typedef struct {
+    int fd;
+    char buffer[DAEMON_LINE_SIZE];
+    size_t start, end;
+} DaemonConnection;
+
+/* The inline image buffer and the arena are kept between jobs so warm workers do not reallocate them. */
+typedef struct {
+    SDL_Thread* thread;
+    int index;
+    int fd;
+    unsigned char* payload;
+    size_t payload_capacity;
+    Arena arena;
+} DaemonWorker;
+
+/*
+ * Binary export of a processed map (.cmap). Every section starts on a
+ * MAP_EXPORT_ALIGN boundary so a consumer can mmap the file and use the
+ * arrays in place:
+ *
+ *   MapExportHeader
+ *   labels        int32_t[width * height], -1 for ink pixels, or with
+ *                 MAP_EXPORT_FLAG_RLE: uint64_t row_start[height + 1]
+ *                 (run index of each row) followed by MapExportRun[]
+ *   regions       MapExportRegion[reg_count]
+ *   adj_offsets   uint32_t[reg_count + 1] (CSR row pointers)
+ *   adj_ids       int32_t[edge_count], sorted per region
+ *
+ * All values are little-endian.
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t flags;
+    int32_t width;
+    int32_t height;
+    int32_t reg_count;
+    int32_t reserved;
+    uint64_t labels_offset;
+    uint64_t labels_size;
+    uint64_t run_count;
+    uint64_t regions_offset;
+    uint64_t adj_offsets_offset;
+    uint64_t adj_ids_offset;
+    uint64_t edge_count;
+    uint64_t file_size;
+} MapExportHeader;
+
+typedef struct {
+    int32_t label;
+    int32_t length;
+} MapExportRun;
+
+typedef struct {
+    int32_t pixel_count;
+    int32_t min_x, min_y, max_x, max_y;
+    int32_t color;
+    uint32_t argb;
+    int32_t reserved;
+} MapExportRegion;
+
+typedef struct {
+    int index;
+    Map map;
+    Map preview;
+    bool preview_ready;
+    bool loading;
+    bool ready;
+    bool failed;
+    unsigned int last_used;
+    SDL_atomic_t progress;
+} MapSlot;
+
+typedef struct {
+    SDL_Surface* levels[MAX_LOD_LEVELS];
+    int level_count;
+    int tiles_x[MAX_LOD_LEVELS];
+    int tiles_y[MAX_LOD_LEVELS];
+    unsigned int* versions[MAX_LOD_LEVELS];
+    bool* stale[MAX_LOD_LEVELS];
+} TilePyramid;
+
+typedef struct {
+    SDL_Texture* texture;
+    int level;
+    int tx, ty;
+    unsigned int version;
+    unsigned int last_used;
+} TileTexture;
+
+typedef struct {
+    char name[64];
+    unsigned long long size;
+    struct timespec mtime;
+} CacheEntry;
+
+/* One color change of a recorded coloring: -1 as color uncolors, -1 as previous means it was uncolored. */
+typedef struct {
+    int32_t region;
+    int16_t color;
+    int16_t previous;
+} ColorEvent;
+
+typedef struct {
+    ColorEvent* events;
+    int count;
+    int capacity;
+    int position;
+    const Region* regions;
+    int reg_count;
+    int colors_used;
+    uint64_t compute_ns;
+    int16_t* checkpoints;
+    int checkpoint_count;
+    int checkpoint_interval;
+    int16_t* painted;
+} ColorLog;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int32_t reg_count;
+    int32_t event_count;
+    int32_t colors_used;
+    int32_t palette_size;
+    uint64_t compute_ns;
+    uint64_t map_hash;
+} ColorLogHeader;
+
+typedef struct {
+    int region;
+    size_t start;
+    int count;
+    int parent;
+    int probe_x, probe_y;
+    long long area2;
+} VectorRing;
+
+typedef struct {
+    int32_t* points;
+    size_t point_count;
+    size_t point_capacity;
+    VectorRing* rings;
+    int ring_count;
+    int ring_capacity;
+} VectorMap;
+
+typedef struct {
+    const char* filename;
+    const char* description;
+    SDL_Texture** texture;
+    SDL_Surface* surface;
+} BackgroundAsset;
+
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
 TTF_Font* font = NULL;
+bool font_failed = false;
 SDL_Texture* m_m_bg = NULL;
 SDL_Texture* set_bg = NULL;
+BackgroundAsset backgrounds[] = {
+    {"background/ds3.png", "main menu background", &m_m_bg, NULL},
+    {"background/cat.png", "settings background", &set_bg, NULL}
+};
+SDL_Thread* background_thread = NULL;
+SDL_atomic_t backgrounds_decoded;
+int backgrounds_uploaded = 0;
+Uint32 background_event = (Uint32)-1;
+SDL_SpinLock image_init_lock = 0;
+bool image_decoders_ready = false;
 Map current_map;
 bool is_coloring = false;
 bool realtime_coloring = false;
 int curr_map_index = 0;
 char map_files[51][256];
 int total_maps = 0;
-int curr_color_region = 0;
-unsigned int start_total_time = 0, start_alg_time = 0, end_alg_time = 0;
+ColorLog color_log;
+bool color_log_recording = false;
+bool replay_paused = false;
+double replay_speed = 1.0;
+uint64_t replay_origin_ns = 0;
+int replay_origin_position = 0;
+uint64_t start_total_time = 0, start_alg_time = 0, end_alg_time = 0;
 int color_used_final = 0;
 Status_menu screen = MAIN_MENU;
+bool cache_enabled = true;
+char cache_dir[256] = MAP_CACHE_DEFAULT_DIR;
+unsigned long long cache_limit = MAP_CACHE_DEFAULT_LIMIT;
+
+MapSlot map_slots[PREFETCH_SLOTS];
+SDL_Thread* loader_thread = NULL;
+SDL_mutex* loader_mutex = NULL;
+SDL_cond* loader_cond = NULL;
+bool loader_quit = false;
+int loaded_map_index = -1;
+int pending_map_index = -1;
+/* curr_map_index as published to the loader thread; both sides hold loader_mutex. */
+int loader_focus_index = 0;
+unsigned long long prefetch_limit = PREFETCH_DEFAULT_LIMIT;
+bool preview_enabled = true;
+
+char* log_buffer = NULL;
+SDL_atomic_t log_head;
+SDL_atomic_t log_tail;
+SDL_atomic_t log_dropped;
+SDL_atomic_t log_quit;
+SDL_Thread* log_thread = NULL;
+SDL_sem* log_wakeup = NULL;
+FILE* log_file = NULL;
+const char* log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+ProfileEvent* profile_events = NULL;
+int profile_event_count = 0;
+int profile_dropped = 0;
+ProfileStage profile_stages[PROFILE_MAX_STAGES];
+int profile_stage_count = 0;
+ProfileThread profile_threads[PROFILE_MAX_THREADS];
+int profile_thread_count = 0;
+SDL_mutex* profile_mutex = NULL;
+uint64_t profile_origin_ns = 0;
+bool perf_counters_enabled = false;
+const char* profile_counter_names[PROFILE_COUNTERS] = {"cycles", "cache_misses"};
+
+SDL_SpinLock mem_lock = 0;
+uint64_t mem_current[MEM_SUBSYSTEMS];
+uint64_t mem_peak[MEM_SUBSYSTEMS];
+uint64_t mem_allocations[MEM_SUBSYSTEMS];
+uint64_t mem_total = 0;
+uint64_t mem_total_peak = 0;
+SDL_TLSID mem_thread_tls = 0;
+const char* mem_subsystem_names[MEM_SUBSYSTEMS] = {
+    "surface", "original_surface", "decode", "reg_map", "visited",
+    "regions", "arena", "stack", "export", "tiles", "cleanup", "daemon", "vector", "replay", "adjacency", "segment"
+};
 
-SDL_Color colors[MAX_COLORS] = {
-    {255, 0, 0, 255},
-    {0, 255, 0, 255},
-    {0, 0, 255, 255},
-    {255, 255, 0, 255} 
+TilePyramid tile_pyramid;
+TileTexture tile_cache[TILE_CACHE_SIZE];
+unsigned int tile_clock = 0;
+bool view_fit = true;
+double view_scale = 1.0;
+double view_x = 0.0, view_y = 0.0;
+bool view_dragging = false;
+bool brush_mode = false;
+int brush_size = 8;
+int brush_button = 0;
+int brush_last_x = 0, brush_last_y = 0;
+
+MapOptions map_options = {
+    0, 0, -1, VECTOR_DEFAULT_TOLERANCE, false,
+    {{{255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}, {255, 255, 0, 255}}, MAX_COLORS, 0}
 };
+const char* palette_filename = NULL;
+
+SDL_TLSID job_stats_tls = 0;
+SDL_mutex* daemon_mutex = NULL;
+SDL_cond* daemon_cond = NULL;
+int daemon_queue[DAEMON_QUEUE_SIZE];
+int daemon_queue_head = 0;
+int daemon_queue_count = 0;
+bool daemon_quit = false;
+SDL_atomic_t daemon_signal;
+SDL_atomic_t daemon_jobs;
 
 bool init_SDL();
-bool load_backgrounds();
+void init_image_decoders();
+bool load_font();
+void start_background_loader();
+int background_loader_thread(void* data);
+bool poll_backgrounds();
+void stop_background_loader();
 void timing_results(char* map_name);
-void log_message(char* message);
-void log_format(char* format, ...);
+bool start_logger();
+void stop_logger();
+int log_flusher_thread(void* data);
+void log_write(int level, const char* format, ...);
+void log_push(int level, time_t seconds, const char* text, int length);
+void log_print(FILE* file, const char* stamp, int level, const char* text, int length);
+void log_timestamp(time_t seconds, char* stamp, size_t size);
+uint64_t now_ns();
+void start_profiler(bool counters);
+void stop_profiler();
+void profile_thread(const char* name);
+ProfileThread* profile_current_thread();
+void open_perf_counters(ProfileThread* thread);
+void read_perf_counters(const ProfileThread* thread, uint64_t* values);
+ProfileScope profile_begin(const char* name);
+void profile_end(const ProfileScope* scope);
+void report_profile_stages(FILE* file);
+void reset_profile_stages();
+int compare_names(const void* a, const void* b);
+char** list_map_files(const char* dir, int* count);
+void free_names(char** names, int count);
+const ProfileStage* find_main_stage(const char* name);
+bool run_benchmark(const char* dir, int runs);
+bool validate_map(const Map* map, ValidateResult* result);
+int validate_worker(void* data);
+uint64_t map_label_hash(const Map* map);
+void map_digest(const Map* map, MapDigest* digest);
+bool read_check_file(const char* filename, CheckEntry** entries, int* count);
+const CheckEntry* find_check_entry(const CheckEntry* entries, int count, const char* map, const char* stage);
+bool run_check(const char* dir, int runs, double margin, bool update_golden, bool save_baseline);
+bool check_map_edits(const char* name, uint64_t seed);
+int daemon_signal_thread(void* data);
+bool run_daemon(const char* socket_path, int worker_count);
+int daemon_worker(void* data);
+void serve_connection(DaemonWorker* worker, int fd);
+bool next_job_field(char** cursor, char** key, char** value);
+bool run_job(DaemonWorker* worker, DaemonConnection* conn, char* request);
+void daemon_free_map(DaemonWorker* worker, Map* map);
+void job_stats_add(JobStats* stats, const char* name, uint64_t duration_ns);
+bool daemon_read_line(DaemonConnection* conn, char* line, size_t size);
+bool daemon_read_bytes(DaemonConnection* conn, void* data, size_t size);
+bool daemon_send(DaemonConnection* conn, const void* data, size_t size);
+bool daemon_reply(DaemonConnection* conn, const char* format, ...);
+bool daemon_send_file(DaemonConnection* conn, int fd);
+bool write_profile_summary(const char* filename);
+void mem_update(MemSubsystem subsystem, int64_t delta);
+void* mem_alloc(MemSubsystem subsystem, size_t size);
+void* mem_calloc(MemSubsystem subsystem, size_t count, size_t size);
+void mem_free(void* ptr);
+void* mem_realloc(MemSubsystem subsystem, void* ptr, size_t size);
+SDL_Surface* mem_track_surface(MemSubsystem subsystem, SDL_Surface* surface);
+void mem_free_surface(MemSubsystem subsystem, SDL_Surface* surface);
+MemThread* mem_current_thread();
+int mem_watch_begin(uint64_t* current);
+uint64_t mem_watch_end(int watch);
+void report_memory(FILE* file);
+bool write_chrome_trace(const char* filename);
 void cleanup();
 bool load_map_files();
 bool load_map(const char* filename);
-void find_regions();
-void build_adjacency_graph();
-int greedy_coloring();
+bool process_map(Map* map, const char* filename, SDL_atomic_t* progress);
+bool process_map_buffer(Map* map, const void* data, size_t size);
+bool decode_map(Map* map, const char* filename);
+SDL_Surface* decode_image(const char* filename);
+bool decode_map_buffer(Map* map, const void* data, size_t size);
+bool init_map_surfaces(Map* map, SDL_Surface* loaded_surface);
+bool segment_map(Map* map, const char* cache_path);
+void free_map(Map* map);
+bool find_regions(Map* map);
+void close_ink_mask(Map* map);
+unsigned char* build_color_links(const Map* map);
+void mark_ink_row(const unsigned int* row, unsigned char* out, int count);
+void color_join_row(const unsigned int* a, const unsigned int* b, unsigned char* out, int count, unsigned char bit, int tolerance);
+bool pixels_join(unsigned int a, unsigned int b, int tolerance);
+void filter_mask_line(const unsigned char* in, unsigned char* out, int length, size_t stride, int radius, bool grow);
+bool merge_small_regions(Map* map, const PixelStack* specks);
+void paint_cleared_ink(Map* map);
+void build_adjacency_graph(Map* map);
+int* build_territories(const Map* map, int x0, int y0, int x1, int y1);
+long long add_territory_edges(Map* map, const int* territory, int stride, int x0, int y0, int x1, int y1);
+int greedy_coloring(Map* map);
+int kempe_free_color(Map* map, int region_id);
+void init_palette(Palette* palette);
+void set_palette_size(Palette* palette, int size);
+bool load_palette(const char* filename, Palette* palette);
+const MapOptions* map_options_of(const Map* map);
+int first_free_color(ColorSet used, ColorSet mask);
+void apply_palette();
+bool edit_map_rect(int x, int y, int w, int h, bool ink);
+bool fill_edit_component(Map* map, int x, int y, int id, PixelStack* stack);
+void unlink_neighbor(Region* region, int neighbor_id);
+void move_region(Map* map, int from, int to);
+void rebuild_region_adjacency(Map* map, const int* ids, int count);
+int pick_region_color(Map* map, int region_id);
+int try_region_color(Map* map, int region_id);
+bool recolor_edit_regions(Map* map, const int* ids, int count, int window_count);
+void brush_stroke(int from_x, int from_y, int to_x, int to_y, bool ink);
 void render_map();
 void render_settings();
 void show_main_menu();
 void render_menu();
 void render_text(const char* text, int x, int y, SDL_Color color);
-bool is_black_pixel(unsigned int pixel);
-void color_region_pixels(int region_id, SDL_Color color);
-void save_colored_map(const char* filename);
+bool is_black_pixel(const Map* map, unsigned int pixel);
+void color_region_pixels(Map* map, int region_id, SDL_Color color);
+void restore_region_pixels(int region_id);
+bool save_colored_map(const Map* map, const char* filename);
 void reset_map_colors();
-bool step_coloring();
-void push(StackNode** top, int x, int y);
-bool pop(StackNode** top, int* x, int* y);
-void flood_fill_iterative(int start_x, int start_y, int region_id, unsigned int* visited);
-bool add_neighbor(Region* region, int neighbor_id);
+int record_coloring();
+void record_color_event(int region_id, int previous, int color);
+bool build_color_checkpoints();
+void clear_color_log();
+bool color_log_valid();
+void show_region_color(int region_id, int color);
+void seek_replay(int target);
+void start_replay();
+void pause_replay(bool paused);
+double coloring_rate();
+bool advance_replay();
+int replay_wait_ms();
+bool save_color_log(const char* filename);
+bool load_color_log(const char* filename);
+bool stack_push(PixelStack* stack, int x, int y);
+bool stack_pop(PixelStack* stack, int* x, int* y);
+void* arena_alloc(Arena* arena, size_t size);
+void arena_reset(Arena* arena);
+void arena_release(Arena* arena);
+bool flood_fill_iterative(Map* map, int start_x, int start_y, int region_id, unsigned int* visited, PixelStack* stack);
+bool flood_fill_links(Map* map, int start_x, int start_y, int region_id, unsigned int* visited, const unsigned char* links, PixelStack* stack);
+bool add_neighbor(Arena* arena, Region* region, int neighbor_id);
+bool export_map(const Map* map, const char* filename, bool rle);
+bool is_map_export(const char* filename);
+bool load_map_export(Map* map, const char* filename);
+bool read_map_export(Map* map, const char* filename, bool with_surface);
+bool export_section_fits(uint64_t offset, uint64_t align, uint64_t count, uint64_t element_size, uint64_t file_size);
+bool write_export_padding(FILE* file, uint64_t* position, uint64_t offset);
+int compare_ints(const void* a, const void* b);
+bool vector_is_geojson(const char* filename);
+bool export_vector(const Map* map, const char* filename, bool geojson, double tolerance);
+void free_vector_map(VectorMap* vector);
+int trace_label(const Map* map, int x, int y);
+bool add_vector_point(VectorMap* vector, int x, int y);
+bool trace_map_boundaries(const Map* map, VectorMap* vector);
+bool ring_contains_pixel(const VectorMap* vector, const VectorRing* ring, int x, int y);
+void assign_vector_holes(VectorMap* vector);
+double point_segment_distance2(const int32_t* p, const int32_t* a, const int32_t* b);
+bool vector_node(const Map* map, int x, int y);
+void simplify_chain(const int32_t* p, int first, int last, double limit, int* spans, unsigned char* marks, int stride);
+int expand_vector_ring(const Map* map, const VectorMap* vector, const VectorRing* ring, int32_t* chain, int* offset);
+bool simplify_vector_map(const Map* map, VectorMap* vector, double tolerance);
+void write_svg_ring(FILE* file, const VectorMap* vector, const VectorRing* ring);
+void write_geojson_ring(FILE* file, const VectorMap* vector, const VectorRing* ring);
+bool write_vector_map(const Map* map, const VectorMap* vector, const char* filename, bool geojson);
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed);
+bool map_cache_key(const char* filename, const MapOptions* options, char* path, size_t path_size);
+bool map_cache_key_data(const void* data, size_t size, const MapOptions* options, char* path, size_t path_size);
+void map_cache_store(const Map* map, const char* path);
+void map_cache_evict();
+int compare_cache_entries(const void* a, const void* b);
+bool start_map_loader();
+void stop_map_loader();
+int map_loader_thread(void* data);
+int next_prefetch_index();
+MapSlot* find_map_slot(int index);
+MapSlot* claim_map_slot();
+void trim_map_slots();
+size_t map_memory_bytes(const Map* map);
+void stash_current_map(const MapSlot* keep);
+void take_map_slot(MapSlot* slot);
+void switch_map(int index);
+void poll_pending_map();
+int pending_map_progress();
+int preview_factor(int width, int height);
+SDL_Surface* downsample_surface(SDL_Surface* source, int factor);
+Uint32 read_surface_pixel(const SDL_Surface* surface, const Uint8* row, int x);
+bool build_preview_map(Map* preview, SDL_Surface* source, int factor);
+bool process_map_progressive(MapSlot* slot, const char* filename);
+void reset_tile_view();
+void free_tile_pyramid();
+bool ensure_tile_pyramid();
+void mark_tiles_dirty(int x, int y, int w, int h);
+void update_tile_pixels(int level, int tx, int ty);
+SDL_Texture* get_tile_texture(int level, int tx, int ty);
+void render_map_tiles(const SDL_Rect* viewport);
+void fit_view(const SDL_Rect* viewport);
+void zoom_view(const SDL_Rect* viewport, double factor, int screen_x, int screen_y);
 
 int main(int argc, char* argv[]) {
-    FILE* log_file = fopen("log.txt", "w");
-    if (log_file) {
-        fclose(log_file);
+    /*
+     * SIGINT and SIGTERM start out blocked so every thread, the log flusher
+     * included, inherits the mask. The daemon takes them with sigwait; the
+     * other modes unblock them again once the options are known.
+     */
+    sigset_t stop_signals, startup_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &startup_mask);
+    mem_thread_tls = SDL_TLSCreate();
+    start_logger();
+    init_palette(&map_options.palette);
+
+    const char* positional[2] = {NULL, NULL};
+    int positional_count = 0;
+    const char* export_filename = NULL;
+    const char* vector_filename = NULL;
+    const char* record_filename = NULL;
+    const char* replay_filename = NULL;
+    const char* profile_filename = NULL;
+    const char* trace_filename = NULL;
+    bool perf_counters = false;
+    const char* bench_dir = NULL;
+    int bench_runs = 3;
+    bool bench_ok = true;
+    const char* check_dir = NULL;
+    double check_margin = CHECK_DEFAULT_MARGIN;
+    bool update_golden = false;
+    bool save_baseline = false;
+    const char* daemon_socket = NULL;
+    int daemon_workers = DAEMON_DEFAULT_WORKERS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_filename = argv[++i];
+        } else if (strcmp(argv[i], "--rle") == 0) {
+            map_options.rle = true;
+        } else if (strcmp(argv[i], "--vector") == 0 && i + 1 < argc) {
+            vector_filename = argv[++i];
+        } else if (strcmp(argv[i], "--simplify") == 0 && i + 1 < argc) {
+            map_options.vector_tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_filename = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_filename = argv[++i];
+        } else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+            replay_speed = atof(argv[++i]);
+            if (!(replay_speed >= 1.0 / REPLAY_MAX_SPEED)) replay_speed = 1.0 / REPLAY_MAX_SPEED;
+            if (replay_speed > REPLAY_MAX_SPEED) replay_speed = REPLAY_MAX_SPEED;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            snprintf(cache_dir, sizeof(cache_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_limit = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            cache_enabled = false;
+        } else if (strcmp(argv[i], "--prefetch-size") == 0 && i + 1 < argc) {
+            prefetch_limit = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--no-preview") == 0) {
+            preview_enabled = false;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_filename = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_filename = argv[++i];
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf_counters = true;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_dir = argv[++i];
+        } else if (strcmp(argv[i], "--bench-runs") == 0 && i + 1 < argc) {
+            bench_runs = atoi(argv[++i]);
+            if (bench_runs < 1) bench_runs = 1;
+        } else if (strcmp(argv[i], "--min-area") == 0 && i + 1 < argc) {
+            map_options.min_region_area = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--close-ink") == 0 && i + 1 < argc) {
+            map_options.ink_close_radius = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--color-tolerance") == 0 && i + 1 < argc) {
+            map_options.color_tolerance = atoi(argv[++i]);
+            if (map_options.color_tolerance > 255) map_options.color_tolerance = 255;
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+            palette_filename = argv[++i];
+        } else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc) {
+            check_dir = argv[++i];
+        } else if (strcmp(argv[i], "--check-margin") == 0 && i + 1 < argc) {
+            check_margin = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--update-golden") == 0) {
+            update_golden = true;
+        } else if (strcmp(argv[i], "--save-baseline") == 0) {
+            save_baseline = true;
+        } else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc) {
+            daemon_socket = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            daemon_workers = atoi(argv[++i]);
+            if (daemon_workers < 1) daemon_workers = 1;
+            if (daemon_workers > DAEMON_MAX_WORKERS) daemon_workers = DAEMON_MAX_WORKERS;
+        } else if (positional_count < 2) {
+            positional[positional_count++] = argv[i];
+        }
+    }
+    if (!daemon_socket) {
+        pthread_sigmask(SIG_SETMASK, &startup_mask, NULL);
     }
+    start_profiler(perf_counters);
+    start_total_time = now_ns();
 
-    if(argc == 3){
+    if (palette_filename) {
+        load_palette(palette_filename, &map_options.palette);
+    }
+
+    if (bench_dir || check_dir || daemon_socket) {
+        init_image_decoders();
+        if (daemon_socket) {
+            bench_ok = run_daemon(daemon_socket, daemon_workers);
+        } else if (bench_dir) {
+            bench_ok = run_benchmark(bench_dir, bench_runs);
+        } else {
+            bench_ok = run_check(check_dir, bench_runs, check_margin, update_golden, save_baseline);
+        }
+        free_map(&current_map);
+        IMG_Quit();
+    }else if(positional_count == 2){
         printf("=== The map coloring program ===\n");
-        printf("INPUT_FN  - name of the BMP input file\n");
+        printf("INPUT_FN  - name of the BMP (or .cmap) input file\n");
         printf("OUTPUT_FN - the name of the output file for the colored map\n");
-
-        const char* input_filename = argv[1];
-        const char* output_filename = argv[2];
+        printf("--export FILE - also write the label map and region graph to FILE (.cmap)\n");
+        printf("--rle         - run-length encode the label map in the export\n");
+        printf("--vector FILE - also write the colored regions as polygons to FILE (.svg, or .geojson)\n");
+        printf("--record FILE - save the coloring as an event log (.clog) for replay\n");
+        printf("--replay FILE - animate a saved coloring log instead of coloring the map\n");
+        printf("--replay-speed X - play the animation X times faster (default 1)\n");
+        printf("--simplify PX - polygon simplification tolerance for --vector (default %.1f, 0 keeps every corner)\n", VECTOR_DEFAULT_TOLERANCE);
+        printf("--cache-dir DIR / --cache-size MB / --no-cache - segmentation cache (default: %s, %llu MB)\n", MAP_CACHE_DEFAULT_DIR, MAP_CACHE_DEFAULT_LIMIT / (1024 * 1024));
+        printf("--profile FILE / --trace FILE - write per-stage timings as JSON / as a Chrome trace\n");
+        printf("--perf-counters - attach cycle and cache-miss counters to each stage (Linux)\n");
+        printf("--min-area PX - merge regions smaller than PX pixels into a neighbor (or the ink)\n");
+        printf("--close-ink R - close gaps and specks up to about 2R pixels in the ink before labeling\n");
+        printf("--color-tolerance T - also split regions where neighboring colors differ by more than T (0-255) on a channel\n");
+        printf("--palette FILE - colors to use, one \"#RRGGBB\" or \"R G B\" per line (up to %d)\n", MAX_COLORS);
+        printf("--bench DIR [--bench-runs N] - time every map in DIR and write bench.csv/bench.json there\n");
+        printf("--check DIR [--check-margin PCT] [--update-golden] [--save-baseline] - validate and compare with golden/baseline files\n");
+        printf("--daemon SOCKET [--workers N] - serve coloring jobs on a Unix socket (see ./client)\n");
+
+        const char* input_filename = positional[0];
+        const char* output_filename = positional[1];
 
         printf("Input file: %s\n", input_filename);
         printf("Output file: %s\n", output_filename);
 
         if (!init_SDL()) {
-            log_message("Initialization error SDL!\n");
+            log_error("Initialization error SDL!");
             return 1;
         }
 
-        log_message("Uploading a map...\n");
+        log_info("Uploading a map...");
         if (!load_map(input_filename)) {
-            log_format("File upload error %s!\n", input_filename);
+            log_error("File upload error %s!", input_filename);
             cleanup();
             return 1;
         }
-        log_format("The map has been uploaded successfully (%dx%d pixels)\n\n", current_map.width, current_map.height);
-
-        log_message("Search for areas...\n");
-        find_regions();
-        log_format("Areas found: %d\n\n", current_map.reg_count);
+        log_info("The map has been uploaded successfully (%dx%d pixels)", current_map.width, current_map.height);
 
-        build_adjacency_graph();
+        log_info("Areas found: %d", current_map.reg_count);
 
         bool quit = false;
 
-        start_total_time = SDL_GetTicks();
-        start_alg_time = SDL_GetTicks();
+        reset_map_colors();
+        start_total_time = now_ns();
+        start_alg_time = now_ns();
+        if (replay_filename) {
+            if (!load_color_log(replay_filename)) {
+                cleanup();
+                return 1;
+            }
+            color_used_final = color_log.colors_used;
+        } else {
+            color_used_final = record_coloring();
+        }
+        end_alg_time = now_ns();
+        if (record_filename) {
+            save_color_log(record_filename);
+        }
+        start_replay();
 
+        bool coloring_done = false;
         SDL_Event event;
         while (!quit) {
-            while (SDL_PollEvent(&event)) {
+            bool have_event = SDL_WaitEventTimeout(&event, coloring_done ? -1 : replay_wait_ms());
+            while (have_event) {
                 if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
                     quit = true;
                 }
+                have_event = SDL_PollEvent(&event);
             }
 
-            
-            if (!step_coloring()) {
-                log_message("Coloring progress: 100%%\n");
-                color_used_final = greedy_coloring();
-                end_alg_time = SDL_GetTicks();
+            if (!coloring_done && !advance_replay()) {
+                log_info("Coloring progress: 100%%");
+                coloring_done = true;
             }
 
-            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, current_map.surface);
+            SDL_Rect viewport = {0, 0, WINDOW_WIDTH, WINDOW_HEIGHT};
             SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            render_map_tiles(&viewport);
             SDL_RenderPresent(renderer);
-            SDL_DestroyTexture(texture);
-
-            SDL_Delay(50);
         }
 
-        save_colored_map(output_filename);
+        save_colored_map(&current_map, output_filename);
+        if (export_filename) {
+            ProfileScope export_scope = profile_begin("export");
+            export_map(&current_map, export_filename, map_options.rle);
+            profile_end(&export_scope);
+        }
+        if (vector_filename) {
+            export_vector(&current_map, vector_filename, vector_is_geojson(vector_filename), map_options.vector_tolerance);
+        }
 
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
 
-        double total_time = (SDL_GetTicks() - start_total_time) / 1000.0;
-        double coloring_time = (end_alg_time - start_alg_time) / 1000.0;
+        double total_time = (now_ns() - start_total_time) / 1e9;
+        double coloring_time = end_alg_time > start_alg_time ? (end_alg_time - start_alg_time) / 1e9 : 0.0;
 
         printf("\n=== RESULTS ===\n");
         printf("Number of colors: %d\n", color_used_final);
-        printf("Total working time: %.3f сек\n", total_time);
-        printf("Operating time of the coloring algorithm: %.3f сек\n", coloring_time);
+        printf("Total working time: %.6f сек\n", total_time);
+        printf("Operating time of the coloring algorithm: %.6f сек\n", coloring_time);
+        report_profile_stages(stdout);
+        report_memory(stdout);
         printf("The result is saved to a file: %s\n", output_filename);
+        if (export_filename) {
+            printf("Map data exported to: %s\n", export_filename);
+        }
+        if (vector_filename) {
+            printf("Polygons exported to: %s\n", vector_filename);
+        }
 
         cleanup();
 
     }else{
+        /*
+         * Only the window and the renderer are created before the first
+         * frame. Backgrounds decode on their own thread, the first map on
+         * the loader thread, and the font opens when text is first drawn.
+         */
+        ProfileScope first_frame_scope = profile_begin("first_frame");
+        bool first_frame = true;
+
         if (!init_SDL()) {
-            log_message("ERROR: Failed to initialize SDL!\n");
+            log_error("Failed to initialize SDL!");
             return 1;
         }
 
-        if (!load_backgrounds()) {
-            log_message("WARNING: Failed to load background images!\n");
-        }
+        start_background_loader();
 
         if (!load_map_files()) {
-            log_message("ERROR: Failed to load map files!\n");
+            log_error("Failed to load map files!");
             cleanup();
             return 1;
         }
 
         if (total_maps > 0) {
-            log_format("[LOG] Attempting to load map: %s\n", map_files[0]);
-            if (!load_map(map_files[0])) {
-                log_message("WARNING: Failed to load map\n");
+            log_debug("Attempting to load map: %s", map_files[0]);
+            pending_map_index = 0;
+        }
+
+        if (!start_map_loader()) {
+            log_warn("Failed to start background map loader, maps will not be prefetched");
+            pending_map_index = -1;
+            if (total_maps > 0) {
+                switch_map(0);
             }
         }
+
         bool quit = false;
-        unsigned int last_step_time = 0;
-        unsigned int STEP_DELAY = 100;
+        bool redraw = true;
 
         while (!quit) {
+            /*
+             * Sleep until an event arrives, the next region of an animated
+             * coloring is due, or a pending map may have made progress.
+             */
+            int wait_ms = -1;
+            if (redraw) {
+                wait_ms = 0;
+            } else if (screen == GAME_SCREEN && realtime_coloring && is_coloring) {
+                wait_ms = replay_wait_ms();
+            } else if (pending_map_index >= 0) {
+                wait_ms = LOADING_REDRAW_MS;
+            }
 
             SDL_Event e;
-            while (SDL_PollEvent(&e)) {
+            bool have_event = SDL_WaitEventTimeout(&e, wait_ms);
+            if (pending_map_index >= 0) {
+                redraw = true;
+            }
+            while (have_event) {
+                if (e.type != SDL_MOUSEMOTION || screen == MAIN_MENU || view_dragging || brush_button) {
+                    redraw = true;
+                }
                 if (e.type == SDL_QUIT) {
                     quit = true;
                 }
@@ -219,8 +1130,8 @@ int main(int argc, char* argv[]) {
                             if (mouse_X >= WINDOW_WIDTH/2 - 100 && mouse_X <= WINDOW_WIDTH/2 + 100) {
                                 if (mouse_Y >= 220 && mouse_Y < 270) {
                                     screen = GAME_SCREEN;
-                                    if (total_maps > 0 && current_map.reg_count == 0) {
-                                        load_map(map_files[0]);
+                                    if (total_maps > 0 && current_map.reg_count == 0 && pending_map_index < 0) {
+                                        switch_map(curr_map_index);
                                     }
                                 }
                                 else if (mouse_Y >= 290 && mouse_Y < 340) {
@@ -241,86 +1152,204 @@ int main(int argc, char* argv[]) {
                         break;
 
                     case GAME_SCREEN:
+                        if (e.type == SDL_MOUSEWHEEL) {
+                            SDL_Rect viewport = {50, MENU_HEIGHT + 50, WINDOW_WIDTH - 100, WINDOW_HEIGHT - MENU_HEIGHT - 100};
+                            int mouse_X, mouse_Y;
+                            SDL_GetMouseState(&mouse_X, &mouse_Y);
+                            zoom_view(&viewport, e.wheel.y > 0 ? 1.25 : 0.8, mouse_X, mouse_Y);
+                        }
+                        if (e.type == SDL_MOUSEBUTTONDOWN && brush_mode && e.button.y > MENU_HEIGHT &&
+                            (e.button.button == SDL_BUTTON_LEFT || e.button.button == SDL_BUTTON_RIGHT)) {
+                            brush_button = e.button.button;
+                            brush_last_x = e.button.x;
+                            brush_last_y = e.button.y;
+                            brush_stroke(e.button.x, e.button.y, e.button.x, e.button.y, brush_button == SDL_BUTTON_LEFT);
+                        } else if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT && e.button.y > MENU_HEIGHT) {
+                            view_dragging = true;
+                        }
+                        if (e.type == SDL_MOUSEBUTTONUP && e.button.button == brush_button) {
+                            brush_button = 0;
+                        }
+                        if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_LEFT) {
+                            view_dragging = false;
+                        }
+                        if (e.type == SDL_MOUSEMOTION && brush_button) {
+                            brush_stroke(brush_last_x, brush_last_y, e.motion.x, e.motion.y, brush_button == SDL_BUTTON_LEFT);
+                            brush_last_x = e.motion.x;
+                            brush_last_y = e.motion.y;
+                        }
+                        if (e.type == SDL_MOUSEMOTION && view_dragging) {
+                            view_fit = false;
+                            view_x -= e.motion.xrel / view_scale;
+                            view_y -= e.motion.yrel / view_scale;
+                        }
                         if (e.type == SDL_KEYDOWN) {
+                            SDL_Rect viewport = {50, MENU_HEIGHT + 50, WINDOW_WIDTH - 100, WINDOW_HEIGHT - MENU_HEIGHT - 100};
                             switch (e.key.keysym.sym) {
+                                case SDLK_EQUALS:
+                                case SDLK_PLUS:
+                                case SDLK_KP_PLUS:
+                                    zoom_view(&viewport, 1.25, viewport.x + viewport.w / 2, viewport.y + viewport.h / 2);
+                                    break;
+                                case SDLK_MINUS:
+                                case SDLK_KP_MINUS:
+                                    zoom_view(&viewport, 0.8, viewport.x + viewport.w / 2, viewport.y + viewport.h / 2);
+                                    break;
+                                case SDLK_0:
+                                    view_fit = true;
+                                    break;
                                 case SDLK_ESCAPE:
                                     screen = MAIN_MENU;
                                     break;
                                 case SDLK_LEFT:
                                     if (curr_map_index > 0 && !is_coloring) {
                                         curr_map_index--;
-                                        load_map(map_files[curr_map_index]);
+                                        switch_map(curr_map_index);
                                     }
                                     break;
                                 case SDLK_RIGHT:
                                     if (curr_map_index < total_maps - 1 && !is_coloring) {
                                         curr_map_index++;
-                                        load_map(map_files[curr_map_index]);
+                                        switch_map(curr_map_index);
                                     }
                                     break;
                                 case SDLK_SPACE:
-                                    if (!is_coloring && current_map.reg_count > 0) {
+                                    if (is_coloring && realtime_coloring) {
+                                        pause_replay(!replay_paused);
+                                    } else if (!is_coloring && current_map.reg_count > 0 && pending_map_index < 0) {
                                         is_coloring = true;
                                         realtime_coloring = true;
-                                        curr_color_region = 0;
                                     
-                                        start_total_time = SDL_GetTicks();
+                                        start_total_time = now_ns();
                                         reset_map_colors();
-                                        start_alg_time = SDL_GetTicks();
+                                        start_alg_time = now_ns();
+                                        color_used_final = record_coloring();
+                                        end_alg_time = now_ns();
+                                        timing_results(map_files[curr_map_index]);
+                                        start_replay();
+                                    }
+                                    break;
+                                case SDLK_UP:
+                                case SDLK_DOWN:
+                                    if (is_coloring && realtime_coloring) {
+                                        double speed = e.key.keysym.sym == SDLK_UP ? replay_speed * 2 : replay_speed / 2;
+                                        if (speed >= 1.0 / REPLAY_MAX_SPEED && speed <= REPLAY_MAX_SPEED) {
+                                            replay_speed = speed;
+                                            pause_replay(replay_paused);
+                                        }
+                                    }
+                                    break;
+                                case SDLK_COMMA:
+                                case SDLK_PERIOD:
+                                case SDLK_HOME:
+                                case SDLK_END:
+                                    if (color_log_valid() && pending_map_index < 0 && (!is_coloring || realtime_coloring)) {
+                                        /* Scrubbing pauses the replay, and reopens a finished one. */
+                                        SDL_Keycode key = e.key.keysym.sym;
+                                        int target = key == SDLK_HOME ? 0 : key == SDLK_END ? color_log.count :
+                                                     color_log.position + (key == SDLK_PERIOD ? 1 : -1);
+                                        is_coloring = true;
+                                        realtime_coloring = true;
+                                        pause_replay(true);
+                                        seek_replay(target);
+                                    }
+                                    break;
+                                case SDLK_l:
+                                    if (color_log_valid()) {
+                                        char log_name[256];
+                                        sprintf(log_name, "output_maps/coloring_%d.clog", curr_map_index + 1);
+                                        save_color_log(log_name);
                                     }
                                     break;
                                 case SDLK_i:
-                                    if (!is_coloring && current_map.reg_count > 0) {
+                                    if (!is_coloring && current_map.reg_count > 0 && pending_map_index < 0) {
                                         is_coloring = true;
                                         realtime_coloring = false;
-                                        curr_color_region = 0;
+                                        clear_color_log();
 
-                                        start_total_time = SDL_GetTicks();
+                                        start_total_time = now_ns();
                                         reset_map_colors();
-                                        start_alg_time = SDL_GetTicks();
+                                        start_alg_time = now_ns();
 
-                                        color_used_final = greedy_coloring();
-                                        end_alg_time = SDL_GetTicks();
+                                        color_used_final = greedy_coloring(&current_map);
+                                        end_alg_time = now_ns();
                                         is_coloring = false;
 
                                         timing_results(map_files[curr_map_index]);
                                     }
                                     break;
                                 case SDLK_r:
-                                    if (!is_coloring) {
+                                    if (!is_coloring && pending_map_index < 0) {
                                         reset_map_colors();
-                                        curr_color_region = 0;
+                                        clear_color_log();
                                     }
                                     break;
                                 case SDLK_s:
-                                    if (current_map.reg_count > 0 && !is_coloring) {
+                                    if (current_map.reg_count > 0 && !is_coloring && pending_map_index < 0) {
                                         char output_filename[256];
                                         sprintf(output_filename, "output_maps/colored_map_%d.bmp", curr_map_index + 1);
-                                        save_colored_map(output_filename);
+                                        save_colored_map(&current_map, output_filename);
+                                    }
+                                    break;
+                                case SDLK_b:
+                                    brush_mode = !brush_mode;
+                                    brush_button = 0;
+                                    view_dragging = false;
+                                    break;
+                                case SDLK_LEFTBRACKET:
+                                    brush_size = SDL_max(brush_size / 2, 1);
+                                    break;
+                                case SDLK_RIGHTBRACKET:
+                                    brush_size = SDL_min(brush_size * 2, BRUSH_MAX_SIZE);
+                                    break;
+                                case SDLK_p:
+                                    if (palette_filename && !is_coloring && pending_map_index < 0 && load_palette(palette_filename, &map_options.palette)) {
+                                        apply_palette();
+                                    }
+                                    break;
+                                case SDLK_e:
+                                    if (current_map.reg_count > 0 && !is_coloring && pending_map_index < 0) {
+                                        char export_name[256];
+                                        sprintf(export_name, "output_maps/colored_map_%d.cmap", curr_map_index + 1);
+                                        ProfileScope export_scope = profile_begin("export");
+                                        export_map(&current_map, export_name, true);
+                                        profile_end(&export_scope);
+                                    }
+                                    break;
+                                case SDLK_v:
+                                    if (current_map.reg_count > 0 && !is_coloring && pending_map_index < 0) {
+                                        char vector_name[256];
+                                        sprintf(vector_name, "output_maps/colored_map_%d.svg", curr_map_index + 1);
+                                        export_vector(&current_map, vector_name, false, map_options.vector_tolerance);
                                     }
                                     break;
                             }
                         }
                         break;
                 }
+                have_event = SDL_PollEvent(&e);
             }
 
-            if (screen == GAME_SCREEN && realtime_coloring && is_coloring) {
-                unsigned int current_time = SDL_GetTicks();
-                if (current_time - last_step_time >= STEP_DELAY) {
-                    if (!step_coloring()) {
-                        log_message("Coloring progress: 100%%\n");
-                        end_alg_time = SDL_GetTicks();
+            poll_pending_map();
+            if (poll_backgrounds()) {
+                redraw = true;
+            }
 
-                        is_coloring = false;
-                        realtime_coloring = false;
+            if (screen == GAME_SCREEN && realtime_coloring && is_coloring) {
+                if (!advance_replay() && !replay_paused) {
+                    log_info("Coloring progress: 100%%");
 
-                        timing_results(map_files[curr_map_index]);
-                    }
-                    last_step_time = current_time;
+                    is_coloring = false;
+                    realtime_coloring = false;
                 }
+                redraw = true;
             }
-        
+
+            if (!redraw) {
+                continue;
+            }
+            redraw = false;
+
             SDL_SetRenderDrawColor(renderer, 230, 230, 230, 255); 
             SDL_RenderClear(renderer);
 
@@ -338,807 +1367,6016 @@ int main(int argc, char* argv[]) {
             }
 
             SDL_RenderPresent(renderer);
-            SDL_Delay(16); 
-            
+
+            if (first_frame) {
+                profile_end(&first_frame_scope);
+                first_frame = false;
+                log_info("Time to first frame: %.1f ms", (now_ns() - profile_origin_ns) / 1e6);
+            }
         }
-        double total_time = (SDL_GetTicks() - start_total_time) / 1000.0;
-        log_format("Total working time: %.3f сек\n", total_time);
+        double total_time = (now_ns() - start_total_time) / 1e9;
+        log_info("Total working time: %.6f сек", total_time);
 
         cleanup();
 
     }
+
+    if (profile_filename) {
+        write_profile_summary(profile_filename);
+    }
+    if (trace_filename) {
+        write_chrome_trace(trace_filename);
+    }
+    stop_profiler();
     
-    return 0;
+    return bench_ok ? 0 : 1;
 }
 
 bool init_SDL() {
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        log_format("  ERROR: SDL could not initialize! SDL Error: %s\n", SDL_GetError());
+        log_error("SDL could not initialize! SDL Error: %s", SDL_GetError());
         
         return false;
     }
-    log_message("[LOG]   SDL Video initialized OK\n");
-
-    
-    int img_flags = IMG_INIT_PNG | IMG_INIT_JPG;
-    if (!(IMG_Init(img_flags) & img_flags)) {
-        log_format("  WARNING: SDL_image could not initialize! IMG Error: %s\n", IMG_GetError());
-        log_message("  Program will work with BMP files only\n");
-        
-    } else {
-        log_message("[LOG]   SDL_image initialized OK\n");
-    }
-
-    if (TTF_Init() == -1) {
-        log_format("  WARNING: SDL_ttf could not initialize! TTF Error: %s\n", TTF_GetError());
-    } else {
-        log_message("[LOG]   SDL_ttf initialized OK\n");
-    }
+    log_debug("SDL Video initialized OK");
     
     window = SDL_CreateWindow("Map Coloring", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_BORDERLESS);
     SDL_WarpMouseInWindow(window, 10, 10);
     if (window == NULL) {
-        log_format("  ERROR: Window could not be created! SDL Error: %s\n", SDL_GetError());
+        log_error("Window could not be created! SDL Error: %s", SDL_GetError());
         
         return false;
     }
-    log_message("[LOG]   Window created OK\n");
+    log_debug("Window created OK");
     
     renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (renderer == NULL) {
-        log_message("  WARNING: Hardware accelerated renderer could not be created! Trying software...\n");
+        log_warn("Hardware accelerated renderer could not be created! Trying software...");
         
         renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
         if (renderer == NULL) {
-            log_format("  ERROR: Renderer could not be created! SDL Error: %s\n", SDL_GetError());
+            log_error("Renderer could not be created! SDL Error: %s", SDL_GetError());
             
             return false;
         }
-        log_message("[LOG]   Software renderer created OK\n");
+        log_debug("Software renderer created OK");
         
     } else {
-        log_message("[LOG]   Hardware accelerated renderer created OK\n");
+        log_debug("Hardware accelerated renderer created OK");
         
     }
     
+    return true;
+}
+
+/*
+ * The PNG and JPG decoders load on first use. IMG_Init is not thread safe and
+ * the map loader and the background loader may both get here first.
+ */
+void init_image_decoders() {
+    SDL_AtomicLock(&image_init_lock);
+    if (!image_decoders_ready) {
+        int img_flags = IMG_INIT_PNG | IMG_INIT_JPG;
+        if (!(IMG_Init(img_flags) & img_flags)) {
+            log_warn("SDL_image could not initialize! IMG Error: %s", IMG_GetError());
+            log_warn("Program will work with BMP files only");
+        } else {
+            log_debug("SDL_image initialized OK");
+        }
+        image_decoders_ready = true;
+    }
+    SDL_AtomicUnlock(&image_init_lock);
+}
+
+/* Opens the font the first time text is drawn. A missing font is reported once and text is skipped. */
+bool load_font() {
+    if (font || font_failed) return font != NULL;
+
+    ProfileScope scope = profile_begin("font");
+    if (!TTF_WasInit() && TTF_Init() == -1) {
+        log_warn("SDL_ttf could not initialize! TTF Error: %s", TTF_GetError());
+        font_failed = true;
+        profile_end(&scope);
+        return false;
+    }
+    log_debug("SDL_ttf initialized OK");
+
     char temp[256];
     char* basePath = SDL_GetBasePath();
-    sprintf(temp, "%sfonts/ttf/arial.ttf", basePath);
+    snprintf(temp, sizeof(temp), "%sfonts/ttf/arial.ttf", basePath ? basePath : "");
+    SDL_free(basePath);
     font = TTF_OpenFont(temp, 16);
     if (!font) {
-        log_message("[LOG]   System font not found, trying local font...\n");
+        log_debug("System font not found, trying local font...");
         
         font = TTF_OpenFont("arial.ttf", 16);
         if (font == NULL) {
-            log_format("Error SDL : %s.\n", TTF_GetError());
-            return false;
+            log_error("Error SDL : %s.", TTF_GetError());
+            font_failed = true;
         } else {
-            log_message("[LOG]   Font loaded OK (local)\n");
+            log_debug("Font loaded OK (local)");
         }
     } else {
-        log_message("[LOG]   Font loaded OK\n");
+        log_debug("Font loaded OK");
     }
-    
-    return true;
+    profile_end(&scope);
+
+    return font != NULL;
 }
 
-bool load_backgrounds() {
-    SDL_Surface* bg_surface = IMG_Load("background/ds3.png");
-    if (!bg_surface) {
-        log_message("Failed to load main menu background!\n");
-        return false;
+void start_background_loader() {
+    background_event = SDL_RegisterEvents(1);
+    SDL_AtomicSet(&backgrounds_decoded, 0);
+    backgrounds_uploaded = 0;
+
+    background_thread = SDL_CreateThread(background_loader_thread, "backgrounds", NULL);
+    if (!background_thread) {
+        log_warn("Failed to create background loader thread: %s", SDL_GetError());
+        background_loader_thread(NULL);
     }
-    m_m_bg = SDL_CreateTextureFromSurface(renderer, bg_surface);
-    SDL_FreeSurface(bg_surface);
+}
 
-    bg_surface = IMG_Load("background/cat.png");
-    if (!bg_surface) {
-        log_message("Failed to load settings background!\n");
-        return false;
+/*
+ * Decodes the background images in the order they are shown. Textures can
+ * only be created on the render thread, so each surface is handed over
+ * through backgrounds_decoded and an event wakes the main loop to upload it.
+ */
+int background_loader_thread(void* data) {
+    (void)data;
+    if (background_thread) {
+        profile_thread("backgrounds");
+    }
+    init_image_decoders();
+
+    int count = (int)(sizeof(backgrounds) / sizeof(backgrounds[0]));
+    for (int i = 0; i < count; i++) {
+        ProfileScope scope = profile_begin("background");
+        backgrounds[i].surface = IMG_Load(backgrounds[i].filename);
+        profile_end(&scope);
+        if (!backgrounds[i].surface) {
+            log_warn("Failed to load %s: %s", backgrounds[i].description, IMG_GetError());
+        }
+        SDL_AtomicAdd(&backgrounds_decoded, 1);
+
+        if (background_event != (Uint32)-1) {
+            SDL_Event event;
+            memset(&event, 0, sizeof(event));
+            event.type = background_event;
+            SDL_PushEvent(&event);
+        }
+    }
+    return 0;
+}
+
+/* Uploads backgrounds that finished decoding since the last call; returns true if any did. */
+bool poll_backgrounds() {
+    int decoded = SDL_AtomicGet(&backgrounds_decoded);
+    if (backgrounds_uploaded == decoded) return false;
+
+    for (; backgrounds_uploaded < decoded; backgrounds_uploaded++) {
+        BackgroundAsset* asset = &backgrounds[backgrounds_uploaded];
+        if (!asset->surface) continue;
+        *asset->texture = SDL_CreateTextureFromSurface(renderer, asset->surface);
+        SDL_FreeSurface(asset->surface);
+        asset->surface = NULL;
     }
-    set_bg = SDL_CreateTextureFromSurface(renderer, bg_surface);
-    SDL_FreeSurface(bg_surface);
 
+    if (decoded == (int)(sizeof(backgrounds) / sizeof(backgrounds[0]))) {
+        log_info("Backgrounds ready after %.1f ms", (now_ns() - profile_origin_ns) / 1e6);
+    }
     return true;
 }
 
-void timing_results(char* map_name) {
-    double coloring_time = (end_alg_time - start_alg_time) / 1000.0;
+void stop_background_loader() {
+    if (background_thread) {
+        SDL_WaitThread(background_thread, NULL);
+        background_thread = NULL;
+    }
 
-    log_format("=== RESULTS for %s ===\n", map_name);
-    log_format("Number of colors: %d\n", color_used_final);
-    log_format("Operating time of the coloring algorithm: %.3f сек\n", coloring_time);
+    int count = (int)(sizeof(backgrounds) / sizeof(backgrounds[0]));
+    for (int i = 0; i < count; i++) {
+        if (backgrounds[i].surface) {
+            SDL_FreeSurface(backgrounds[i].surface);
+            backgrounds[i].surface = NULL;
+        }
+    }
 }
 
-void log_message(char* message) {
-    if (!message) return;
+void timing_results(char* map_name) {
+    double coloring_time = end_alg_time > start_alg_time ? (end_alg_time - start_alg_time) / 1e9 : 0.0;
+
+    log_info("=== RESULTS for %s ===", map_name);
+    log_info("Number of colors: %d", color_used_final);
+    log_info("Operating time of the coloring algorithm: %.6f сек", coloring_time);
+    report_profile_stages(NULL);
+    report_memory(NULL);
+}
 
-    FILE* log_file = fopen("log.txt", "a");
+bool start_logger() {
+    log_file = fopen(LOG_FILE, "w");
     if (!log_file) {
-        return;
+        return false;
     }
-
-    time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    char time_tamp[20];
-    strftime(time_tamp, sizeof(time_tamp), "%Y-%m-%d %H:%M:%S", tm_info);
-    fprintf(log_file, "%s - %s\n", time_tamp, message);
-    
-    fclose(log_file);
+    setvbuf(log_file, NULL, _IOFBF, 64 * 1024);
+    atexit(stop_logger);
+
+    log_buffer = calloc(LOG_BUFFER_SIZE, 1);
+    log_wakeup = SDL_CreateSemaphore(0);
+    SDL_AtomicSet(&log_head, 0);
+    SDL_AtomicSet(&log_tail, 0);
+    SDL_AtomicSet(&log_dropped, 0);
+    SDL_AtomicSet(&log_quit, 0);
+    if (log_buffer && log_wakeup) {
+        log_thread = SDL_CreateThread(log_flusher_thread, "log_flusher", NULL);
+    }
+    if (!log_thread) {
+        free(log_buffer);
+        log_buffer = NULL;
+        if (log_wakeup) {
+            SDL_DestroySemaphore(log_wakeup);
+            log_wakeup = NULL;
+        }
+        return false;
+    }
+    return true;
 }
 
-void log_format(char* format, ...) {
-    char buffer[256];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
-    va_end(args);
-    
-    log_message(buffer);
+void stop_logger() {
+    if (log_thread) {
+        SDL_AtomicSet(&log_quit, 1);
+        SDL_SemPost(log_wakeup);
+        SDL_WaitThread(log_thread, NULL);
+        log_thread = NULL;
+        free(log_buffer);
+        log_buffer = NULL;
+        SDL_DestroySemaphore(log_wakeup);
+        log_wakeup = NULL;
+    }
+    if (log_file) {
+        fclose(log_file);
+        log_file = NULL;
+    }
 }
 
-void cleanup() {
-    if (current_map.surface) {
-        SDL_FreeSurface(current_map.surface);
+int log_flusher_thread(void* data) {
+    (void)data;
+    char stamp[32];
+    time_t stamp_seconds = (time_t)-1;
+
+    for (;;) {
+        unsigned int tail = (unsigned int)SDL_AtomicGet(&log_tail);
+        unsigned int head = (unsigned int)SDL_AtomicGet(&log_head);
+
+        if (tail == head) {
+            int dropped = SDL_AtomicSet(&log_dropped, 0);
+            if (dropped > 0) {
+                char text[64];
+                int length = snprintf(text, sizeof(text), "%d log messages dropped, buffer full", dropped);
+                stamp_seconds = time(NULL);
+                log_timestamp(stamp_seconds, stamp, sizeof(stamp));
+                log_print(log_file, stamp, LOG_LEVEL_WARN, text, length);
+            }
+            fflush(log_file);
+            if (SDL_AtomicGet(&log_quit)) {
+                break;
+            }
+            SDL_SemWaitTimeout(log_wakeup, LOG_FLUSH_INTERVAL);
+            continue;
+        }
+
+        LogRecord* record = (LogRecord*)(log_buffer + (tail & (LOG_BUFFER_SIZE - 1)));
+        int state = SDL_AtomicGet(&record->state);
+        if (state == LOG_RECORD_EMPTY) {
+            SDL_Delay(0);
+            continue;
+        }
+
+        uint32_t size = record->size;
+        if (state == LOG_RECORD_READY) {
+            if (record->seconds != (int64_t)stamp_seconds) {
+                stamp_seconds = (time_t)record->seconds;
+                log_timestamp(stamp_seconds, stamp, sizeof(stamp));
+            }
+            log_print(log_file, stamp, record->level, (const char*)(record + 1), record->length);
+        }
+        memset(record, 0, size);
+        SDL_AtomicSet(&log_tail, (int)(tail + size));
     }
+    return 0;
+}
+
+void log_write(int level, const char* format, ...) {
+    char stack_text[512];
+    char* text = stack_text;
+    va_list args;
 
-    if (current_map.original_surface) {
-        SDL_FreeSurface(current_map.original_surface);
+    va_start(args, format);
+    int length = vsnprintf(stack_text, sizeof(stack_text), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
     }
 
-    for (int i = 0; i < current_map.reg_count; i++) {
-        NeighborNode* current = current_map.regions[i].neighbors;
-        while (current) {
-            NeighborNode* temp = current;
-            current = current->next;
-            free(temp);
+    if ((size_t)length >= sizeof(stack_text)) {
+        text = malloc((size_t)length + 1);
+        if (text) {
+            va_start(args, format);
+            vsnprintf(text, (size_t)length + 1, format, args);
+            va_end(args);
+        } else {
+            text = stack_text;
+            length = sizeof(stack_text) - 1;
         }
     }
 
-    if (current_map.reg_map) {
-        free(current_map.reg_map);
+    while (length > 0 && text[length - 1] == '\n') {
+        length--;
     }
+    log_push(level, time(NULL), text, length);
 
-    if (font) {
-        TTF_CloseFont(font);
+    if (text != stack_text) {
+        free(text);
     }
+}
 
-    if (m_m_bg) {
-        SDL_DestroyTexture(m_m_bg);
+void log_push(int level, time_t seconds, const char* text, int length) {
+    /* Only the flusher writes log_file while it runs, so an oversized line is cut to fit a record and flagged. */
+    const int max_length = (int)(LOG_BUFFER_SIZE / 2 - sizeof(LogRecord));
+    int cut = 0;
+    if (log_buffer && length > max_length) {
+        cut = length;
+        length = max_length;
+    }
+    uint32_t size = (sizeof(LogRecord) + (uint32_t)length + LOG_RECORD_ALIGN - 1) & ~(LOG_RECORD_ALIGN - 1);
+
+    if (!log_buffer) {
+        char stamp[32];
+        log_timestamp(seconds, stamp, sizeof(stamp));
+        if (log_file) {
+            log_print(log_file, stamp, level, text, length);
+            return;
+        }
+        FILE* file = fopen(LOG_FILE, "a");
+        if (file) {
+            log_print(file, stamp, level, text, length);
+            fclose(file);
+        }
+        return;
     }
 
-    if (set_bg) {
-        SDL_DestroyTexture(set_bg);
+    unsigned int head, offset, reserved;
+    for (;;) {
+        head = (unsigned int)SDL_AtomicGet(&log_head);
+        unsigned int tail = (unsigned int)SDL_AtomicGet(&log_tail);
+        offset = head & (LOG_BUFFER_SIZE - 1);
+        unsigned int contiguous = LOG_BUFFER_SIZE - offset;
+        reserved = size <= contiguous ? size : contiguous + size;
+
+        if (head - tail + reserved > LOG_BUFFER_SIZE) {
+            SDL_AtomicAdd(&log_dropped, 1);
+            SDL_SemPost(log_wakeup);
+            return;
+        }
+        if (SDL_AtomicCAS(&log_head, (int)head, (int)(head + reserved))) {
+            if (head - tail + reserved > LOG_BUFFER_SIZE / 2) {
+                SDL_SemPost(log_wakeup);
+            }
+            break;
+        }
     }
 
-    if (renderer) {
-        SDL_DestroyRenderer(renderer);
+    if (reserved != size) {
+        LogRecord* padding = (LogRecord*)(log_buffer + offset);
+        padding->size = reserved - size;
+        SDL_AtomicSet(&padding->state, LOG_RECORD_PADDING);
+        offset = 0;
     }
 
-    if (window) {
-        SDL_DestroyWindow(window);
+    LogRecord* record = (LogRecord*)(log_buffer + offset);
+    record->size = size;
+    record->seconds = (int64_t)seconds;
+    record->level = level;
+    record->length = length;
+    memcpy(record + 1, text, (size_t)length);
+    SDL_AtomicSet(&record->state, LOG_RECORD_READY);
+
+    if (level >= LOG_LEVEL_ERROR) {
+        SDL_SemPost(log_wakeup);
     }
+    if (cut > 0) {
+        char note[64];
+        log_push(LOG_LEVEL_WARN, seconds, note, snprintf(note, sizeof(note), "Previous message cut from %d bytes", cut));
+    }
+}
 
-    TTF_Quit();
-    IMG_Quit();
-    SDL_Quit();
+void log_print(FILE* file, const char* stamp, int level, const char* text, int length) {
+    fprintf(file, "%s - %-5s ", stamp, log_level_names[level]);
+    fwrite(text, 1, (size_t)length, file);
+    fputc('\n', file);
 }
 
-bool load_map_files() {
+void log_timestamp(time_t seconds, char* stamp, size_t size) {
+    struct tm tm_info;
+    localtime_r(&seconds, &tm_info);
+    strftime(stamp, size, "%Y-%m-%d %H:%M:%S", &tm_info);
+}
 
-    const char* test_files[] = {
-        "maps/map1.bmp", "maps/map2.bmp", "maps/map3.bmp",
-        "maps/map4.bmp", "maps/map5.bmp", "maps/map6.bmp",
-        "maps/map7.bmp", "maps/map8.bmp", "maps/map9.bmp",
-        "maps/map10.bmp", "maps/map11.bmp", "maps/map12.bmp",
-        "maps/map13.bmp", "maps/map14.bmp", "maps/map15.bmp",
-        "maps/map16.bmp", "maps/map17.bmp", "maps/map18.bmp",
-        "maps/map19.bmp", "maps/map20.bmp", "maps/map21.bmp",
-        "maps/map22.bmp", "maps/map23.bmp", "maps/map24.bmp",
-        "maps/map25.bmp", "maps/map26.bmp", "maps/map27.bmp",
-        "maps/map28.bmp", "maps/map29.bmp", "maps/map30.bmp"
-    };
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    total_maps = sizeof(test_files) / sizeof(test_files[0]);
-    for (int i = 0; i < total_maps; i++) {
-        strcpy(map_files[i], test_files[i]);
+void start_profiler(bool counters) {
+    profile_mutex = SDL_CreateMutex();
+    profile_events = malloc(PROFILE_MAX_EVENTS * sizeof(ProfileEvent));
+    profile_origin_ns = now_ns();
+#ifdef __linux__
+    perf_counters_enabled = counters;
+#else
+    if (counters) {
+        log_warn("Hardware counters are only supported on Linux");
     }
-
-    return true;
+#endif
+    profile_thread("main");
 }
 
-bool load_map(const char* filename) {
-    log_format("  Loading map: %s\n", filename);
-    
-    if (current_map.surface) {
-        SDL_FreeSurface(current_map.surface);
-        current_map.surface = NULL;
-    }
-    if (current_map.original_surface) {
-        SDL_FreeSurface(current_map.original_surface);
-        current_map.original_surface = NULL;
-    }
-    if (current_map.regions) {
-        for (int i = 0; i < current_map.reg_count; i++) {
-            if (current_map.regions[i].neighbors) {
-                free(current_map.regions[i].neighbors);
-                current_map.regions[i].neighbors = NULL;
+void stop_profiler() {
+    for (int i = 0; i < profile_thread_count; i++) {
+        for (int c = 0; c < PROFILE_COUNTERS; c++) {
+            if (profile_threads[i].counter_fds[c] >= 0) {
+                close(profile_threads[i].counter_fds[c]);
             }
         }
-        free(current_map.regions);
-        current_map.regions = NULL;
     }
-    if (current_map.reg_map) {
-        free(current_map.reg_map);
-        current_map.reg_map = NULL;
+    profile_thread_count = 0;
+    free(profile_events);
+    profile_events = NULL;
+    if (profile_mutex) {
+        SDL_DestroyMutex(profile_mutex);
+        profile_mutex = NULL;
     }
+}
 
-    memset(&current_map, 0, sizeof(Map));
+void profile_thread(const char* name) {
+    if (!profile_mutex) return;
 
-    SDL_Surface* loaded_surface = NULL;
-    loaded_surface = IMG_Load(filename);
-    
-    if (!loaded_surface) {
-        log_format("SDL_image failed: %s. Attempting to load as BMP via SDL_LoadBMP: %s\n", IMG_GetError(), filename);
-        loaded_surface = SDL_LoadBMP(filename);
-        if (loaded_surface) {
-            log_message("Image loaded successfully as BMP\n");
-        }
+    SDL_LockMutex(profile_mutex);
+    ProfileThread* thread = profile_current_thread();
+    if (thread) {
+        snprintf(thread->name, sizeof(thread->name), "%s", name);
     }
+    SDL_UnlockMutex(profile_mutex);
+}
 
-    current_map.surface = SDL_ConvertSurfaceFormat(loaded_surface, SDL_PIXELFORMAT_ARGB8888, 0);
-    SDL_FreeSurface(loaded_surface); 
-    if (!current_map.surface) {
-        log_format("ERROR: Failed to convert loaded surface to ARGB8888! SDL Error: %s\n", SDL_GetError());
-        return false;
+ProfileThread* profile_current_thread() {
+    SDL_threadID id = SDL_ThreadID();
+    for (int i = 0; i < profile_thread_count; i++) {
+        if (profile_threads[i].id == id) {
+            return &profile_threads[i];
+        }
     }
-    
-
-    if (!current_map.surface) {
-        log_message("ERROR: Failed to create or load any surface!\n");
-        return false;
+    if (profile_thread_count >= PROFILE_MAX_THREADS) {
+        return NULL;
     }
 
-    current_map.original_surface = SDL_ConvertSurface(current_map.surface, current_map.surface->format, 0);
-    if (!current_map.original_surface) {
-        log_format("ERROR: Failed to create original_surface copy! SDL Error: %s\n", SDL_GetError());
-        SDL_FreeSurface(current_map.surface);
-        current_map.surface = NULL;
-        return false;
+    ProfileThread* thread = &profile_threads[profile_thread_count];
+    thread->id = id;
+    snprintf(thread->name, sizeof(thread->name), "thread %d", profile_thread_count);
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        thread->counter_fds[c] = -1;
     }
+    open_perf_counters(thread);
+    profile_thread_count++;
+    return thread;
+}
 
-    current_map.width = current_map.surface->w;
-    current_map.height = current_map.surface->h;
-    current_map.pixels = (unsigned int*)current_map.surface->pixels;
-    current_map.reg_map = malloc(current_map.width * current_map.height * sizeof(int));
-    if (!current_map.reg_map) {
-        log_format("    ERROR: Failed to allocate memory for reg_map! Map dimensions: %dx%d\n", current_map.width, current_map.height);
-        if (current_map.surface) {
-            SDL_FreeSurface(current_map.surface);
-            current_map.surface = NULL;
+void open_perf_counters(ProfileThread* thread) {
+#ifdef __linux__
+    if (!perf_counters_enabled) return;
+
+    uint64_t configs[PROFILE_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES};
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        thread->counter_fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (thread->counter_fds[c] < 0) {
+            log_warn("perf_event_open failed for %s: %s, hardware counters disabled", profile_counter_names[c], strerror(errno));
+            for (int k = 0; k < c; k++) {
+                close(thread->counter_fds[k]);
+                thread->counter_fds[k] = -1;
+            }
+            perf_counters_enabled = false;
+            return;
         }
-        if (current_map.original_surface) {
-            SDL_FreeSurface(current_map.original_surface);
-            current_map.original_surface = NULL;
+    }
+#else
+    (void)thread;
+#endif
+}
+
+void read_perf_counters(const ProfileThread* thread, uint64_t* values) {
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        values[c] = 0;
+        if (thread && thread->counter_fds[c] >= 0 && read(thread->counter_fds[c], &values[c], sizeof(uint64_t)) != sizeof(uint64_t)) {
+            values[c] = 0;
         }
-        return false;
     }
-    
-    for (int i = 0; i < current_map.width * current_map.height; i++) {
-        current_map.reg_map[i] = -1;
+}
+
+ProfileScope profile_begin(const char* name) {
+    ProfileScope scope;
+    scope.name = name;
+    memset(scope.counters, 0, sizeof(scope.counters));
+    scope.mem_watch = mem_watch_begin(&scope.mem_start);
+
+    if (perf_counters_enabled && profile_mutex) {
+        SDL_LockMutex(profile_mutex);
+        read_perf_counters(profile_current_thread(), scope.counters);
+        SDL_UnlockMutex(profile_mutex);
     }
+    scope.start_ns = now_ns();
+    return scope;
+}
 
-    current_map.regions = calloc(MAX_REGIONS, sizeof(Region));
-    if (!current_map.regions) {
-        log_message("ERROR: Failed to allocate memory for regions!\n");
-        if (current_map.surface) {
-            SDL_FreeSurface(current_map.surface);
-            current_map.surface = NULL;
+void profile_end(const ProfileScope* scope) {
+    uint64_t end_ns = now_ns();
+    uint64_t peak_bytes = mem_watch_end(scope->mem_watch);
+    uint64_t peak_delta = peak_bytes > scope->mem_start ? peak_bytes - scope->mem_start : 0;
+    if (job_stats_tls) {
+        JobStats* stats = SDL_TLSGet(job_stats_tls);
+        if (stats) job_stats_add(stats, scope->name, end_ns - scope->start_ns);
+    }
+    if (!profile_mutex) return;
+
+    SDL_LockMutex(profile_mutex);
+    ProfileThread* thread = profile_current_thread();
+    int thread_index = thread ? (int)(thread - profile_threads) : -1;
+    uint64_t duration = end_ns - scope->start_ns;
+    uint64_t counters[PROFILE_COUNTERS] = {0};
+    if (perf_counters_enabled) {
+        read_perf_counters(thread, counters);
+        for (int c = 0; c < PROFILE_COUNTERS; c++) {
+            counters[c] -= scope->counters[c];
         }
-        if (current_map.original_surface) {
-            SDL_FreeSurface(current_map.original_surface);
-            current_map.original_surface = NULL;
+    }
+
+    ProfileStage* stage = NULL;
+    for (int i = 0; i < profile_stage_count; i++) {
+        if (profile_stages[i].thread == thread_index && strcmp(profile_stages[i].name, scope->name) == 0) {
+            stage = &profile_stages[i];
+            break;
         }
-        if (current_map.reg_map) {
-            free(current_map.reg_map);
-            current_map.reg_map = NULL;
+    }
+    if (!stage && profile_stage_count < PROFILE_MAX_STAGES) {
+        stage = &profile_stages[profile_stage_count++];
+        memset(stage, 0, sizeof(ProfileStage));
+        stage->name = scope->name;
+        stage->thread = thread_index;
+        stage->min_ns = UINT64_MAX;
+    }
+    if (stage) {
+        stage->count++;
+        stage->total_ns += duration;
+        if (duration < stage->min_ns) stage->min_ns = duration;
+        if (duration > stage->max_ns) stage->max_ns = duration;
+        for (int c = 0; c < PROFILE_COUNTERS; c++) {
+            stage->counters[c] += counters[c];
         }
-        return false;
+        if (peak_bytes > stage->peak_bytes) stage->peak_bytes = peak_bytes;
+        if (peak_delta > stage->peak_delta_bytes) stage->peak_delta_bytes = peak_delta;
     }
 
-    find_regions();
-    log_format("Found %d regions\n", current_map.reg_count);
-    
-    build_adjacency_graph();
-
-    return true;
+    if (profile_events && profile_event_count < PROFILE_MAX_EVENTS) {
+        ProfileEvent* event = &profile_events[profile_event_count++];
+        event->name = scope->name;
+        event->thread = thread_index;
+        event->start_ns = scope->start_ns - profile_origin_ns;
+        event->duration_ns = duration;
+        memcpy(event->counters, counters, sizeof(counters));
+        event->peak_bytes = peak_bytes;
+    } else {
+        profile_dropped++;
+    }
+    SDL_UnlockMutex(profile_mutex);
 }
 
-void reset_map_colors() {
-    if (current_map.original_surface && current_map.surface) {
-        SDL_BlitSurface(current_map.original_surface, NULL, current_map.surface, NULL);
-        
-        for (int i = 0; i < current_map.reg_count; i++) {
-            current_map.regions[i].color = -1;
-            current_map.regions[i].is_colored = false;
+void report_profile_stages(FILE* file) {
+    if (!profile_mutex) return;
+
+    SDL_LockMutex(profile_mutex);
+    for (int i = 0; i < profile_stage_count; i++) {
+        const ProfileStage* stage = &profile_stages[i];
+        const char* thread = stage->thread >= 0 ? profile_threads[stage->thread].name : "unknown";
+        double total_ms = stage->total_ns / 1e6;
+        double max_ms = stage->max_ns / 1e6;
+        if (file) {
+            fprintf(file, "  %-16s %-8s %6llu x %12.3f ms (max %.3f ms), peak %.1f MB (+%.1f MB)\n", stage->name, thread, (unsigned long long)stage->count, total_ms, max_ms, stage->peak_bytes / 1048576.0, stage->peak_delta_bytes / 1048576.0);
+        } else {
+            log_info("  %-16s %-8s %6llu x %12.3f ms (max %.3f ms), peak %.1f MB (+%.1f MB)", stage->name, thread, (unsigned long long)stage->count, total_ms, max_ms, stage->peak_bytes / 1048576.0, stage->peak_delta_bytes / 1048576.0);
         }
     }
+    SDL_UnlockMutex(profile_mutex);
+}
 
-    color_used_final = 0;
+void reset_profile_stages() {
+    if (!profile_mutex) return;
+
+    SDL_LockMutex(profile_mutex);
+    profile_stage_count = 0;
+    SDL_UnlockMutex(profile_mutex);
 }
 
-bool step_coloring() {
-    if (curr_color_region >= current_map.reg_count) {
-        return false;
+int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+char** list_map_files(const char* dir, int* count) {
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        log_error("Failed to open map directory %s", dir);
+        return NULL;
+    }
+
+    char** names = NULL;
+    int capacity = 0;
+    *count = 0;
+    struct dirent* item;
+    while ((item = readdir(handle)) != NULL) {
+        size_t len = strlen(item->d_name);
+        if (item->d_name[0] == '.' || len < 4 || strcmp(item->d_name + len - 4, ".bmp") != 0) continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char** grown = realloc(names, capacity * sizeof(char*));
+            if (!grown) break;
+            names = grown;
+        }
+        names[*count] = malloc(len + 1);
+        if (!names[*count]) break;
+        memcpy(names[(*count)++], item->d_name, len + 1);
     }
+    closedir(handle);
 
-    bool used_colors[MAX_COLORS] = {false};
+    if (!names) {
+        names = malloc(sizeof(char*));
+        if (!names) return NULL;
+    }
+    qsort(names, *count, sizeof(char*), compare_names);
+    return names;
+}
 
-    NeighborNode* neighbor = current_map.regions[curr_color_region].neighbors;
-    while (neighbor) {
-        int neighbor_id = neighbor->region_id;
+void free_names(char** names, int count) {
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
 
-        if (current_map.regions[neighbor_id].color != -1) {
-            used_colors[current_map.regions[neighbor_id].color] = true;
+/* Callers hold profile_mutex. The main thread is always registered first. */
+const ProfileStage* find_main_stage(const char* name) {
+    for (int i = 0; i < profile_stage_count; i++) {
+        if (profile_stages[i].thread == 0 && strcmp(profile_stages[i].name, name) == 0) {
+            return &profile_stages[i];
         }
+    }
+    return NULL;
+}
 
-        neighbor = neighbor->next;
+/*
+ * Runs the pipeline on every .bmp in dir runs times with the cache off and
+ * writes the best and mean time of each stage with its throughput to
+ * dir/bench.csv and dir/bench.json.
+ */
+bool run_benchmark(const char* dir, int runs) {
+    const char* stages[] = {"decode", "find_regions", "build_adjacency", "coloring", "save", "export"};
+    const int stage_total = sizeof(stages) / sizeof(stages[0]);
+
+    int count = 0;
+    char** names = list_map_files(dir, &count);
+    if (!names) return false;
+
+    char path[512], csv_path[512], json_path[512], save_path[512], export_path[512];
+    snprintf(csv_path, sizeof(csv_path), "%s/bench.csv", dir);
+    snprintf(json_path, sizeof(json_path), "%s/bench.json", dir);
+    snprintf(save_path, sizeof(save_path), "%s/.bench_out.bmp", dir);
+    snprintf(export_path, sizeof(export_path), "%s/.bench_out.cmap", dir);
+
+    FILE* csv = fopen(csv_path, "w");
+    FILE* json = fopen(json_path, "w");
+    if (!csv || !json) {
+        log_error("Failed to create benchmark results in %s", dir);
+        if (csv) fclose(csv);
+        if (json) fclose(json);
+        free_names(names, count);
+        return false;
     }
 
-    for (int color = 0; color < MAX_COLORS; color++) {
-        if (!used_colors[color]) {
-            current_map.regions[curr_color_region].color = color;
-            current_map.regions[curr_color_region].is_colored = true;
+    bool saved_cache = cache_enabled;
+    cache_enabled = false;
+
+    fprintf(csv, "map,width,height,megapixels,regions,region_limit_hit,edges,peak_bytes,stage,best_ns,mean_ns,mp_per_s,regions_per_s,edges_per_s\n");
+    fprintf(json, "{\"runs\": %d, \"results\": [", runs);
+    printf("%-32s %6s %-16s %12s %10s %12s %12s\n", "map", "MP", "stage", "best ms", "MP/s", "regions/s", "edges/s");
+
+    int written = 0;
+    for (int m = 0; m < count; m++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[m]);
+        reset_profile_stages();
+
+        uint64_t mem_start;
+        int watch = mem_watch_begin(&mem_start);
+        bool loaded = true;
+        for (int r = 0; r < runs && loaded; r++) {
+            loaded = load_map(path);
+            if (!loaded) break;
+            color_used_final = greedy_coloring(&current_map);
+            save_colored_map(&current_map, save_path);
+            ProfileScope export_scope = profile_begin("export");
+            export_map(&current_map, export_path, true);
+            profile_end(&export_scope);
+        }
+        uint64_t peak_bytes = mem_watch_end(watch);
 
-            if (color > color_used_final) {
-                color_used_final = color;
-            }
-            break;
+        if (!loaded) {
+            log_warn("Skipping %s in benchmark, it could not be loaded", path);
+            continue;
         }
-    }
 
-    color_region_pixels(curr_color_region, colors[current_map.regions[curr_color_region].color]);
+        long long edges = 0;
+        for (int i = 0; i < current_map.reg_count; i++) {
+            for (NeighborNode* node = current_map.regions[i].neighbors; node; node = node->next) {
+                edges++;
+            }
+        }
+        edges /= 2;
 
-    curr_color_region++;
+        double megapixels = (double)current_map.width * current_map.height / 1e6;
+        bool limit_hit = current_map.reg_count >= MAX_REGIONS;
+        if (limit_hit) {
+            log_warn("%s has more than %d regions, only the first %d were labeled", names[m], MAX_REGIONS, MAX_REGIONS);
+        }
 
-    if (curr_color_region >= current_map.reg_count) {
-        color_used_final++; 
-        return false; 
+        fprintf(json, "%s\n  {\"map\": \"%s\", \"width\": %d, \"height\": %d, \"regions\": %d, \"region_limit_hit\": %s, \"edges\": %lld, \"peak_bytes\": %llu, \"stages\": [",
+                written++ ? "," : "", names[m], current_map.width, current_map.height, current_map.reg_count,
+                limit_hit ? "true" : "false", edges, (unsigned long long)peak_bytes);
+
+        SDL_LockMutex(profile_mutex);
+        int listed = 0;
+        for (int s = 0; s < stage_total; s++) {
+            const ProfileStage* stage = find_main_stage(stages[s]);
+            if (!stage || stage->count == 0) continue;
+
+            double best_s = SDL_max(stage->min_ns, 1) / 1e9;
+            double mean_ns = (double)stage->total_ns / stage->count;
+            double mp_rate = megapixels / best_s;
+            double region_rate = current_map.reg_count / best_s;
+            double edge_rate = edges / best_s;
+
+            fprintf(csv, "%s,%d,%d,%.3f,%d,%d,%lld,%llu,%s,%llu,%.0f,%.3f,%.1f,%.1f\n",
+                    names[m], current_map.width, current_map.height, megapixels, current_map.reg_count, limit_hit,
+                    edges, (unsigned long long)peak_bytes, stages[s], (unsigned long long)stage->min_ns, mean_ns,
+                    mp_rate, region_rate, edge_rate);
+            fprintf(json, "%s\n    {\"name\": \"%s\", \"best_ns\": %llu, \"mean_ns\": %.0f, \"mp_per_s\": %.3f, \"regions_per_s\": %.1f, \"edges_per_s\": %.1f}",
+                    listed++ ? "," : "", stages[s], (unsigned long long)stage->min_ns, mean_ns, mp_rate, region_rate, edge_rate);
+            printf("%-32s %6.1f %-16s %12.3f %10.1f %12.0f %12.0f\n", names[m], megapixels, stages[s],
+                   stage->min_ns / 1e6, mp_rate, region_rate, edge_rate);
+        }
+        SDL_UnlockMutex(profile_mutex);
+        fprintf(json, "\n  ]}");
     }
+    fprintf(json, "\n]}\n");
 
-    return true;
-}
+    bool ok = !ferror(csv) && !ferror(json);
+    if (fclose(csv) != 0) ok = false;
+    if (fclose(json) != 0) ok = false;
+    remove(save_path);
+    remove(export_path);
+    cache_enabled = saved_cache;
 
-bool is_black_pixel(unsigned int pixel) {//--------new
-    SDL_Color color;
-    SDL_GetRGB(pixel, current_map.surface->format, &color.r, &color.g, &color.b);
-    int brightness = (color.r + color.g + color.b) / 3;
-    return brightness < 50;
+    free_names(names, count);
+
+    if (ok) {
+        log_info("Benchmarked %d maps, results in %s and %s", written, csv_path, json_path);
+        printf("Results: %s, %s\n", csv_path, json_path);
+    } else {
+        log_error("Failed to write benchmark results to %s", dir);
+    }
+    return ok;
 }
 
-void find_regions() {
-    log_format("[LOG]   Map dimensions: %dx%d\n", current_map.width, current_map.height);
 
-    unsigned int* visited = calloc(current_map.width * current_map.height, sizeof(unsigned int));
-    if (!visited) {
-        log_message("[LOG]   ERROR: Failed to allocate memory for visited array!\n");
-        return;
+/*
+ * Checks a segmented and colored map in parallel. Pixel rows and regions are
+ * split into one band per thread; each worker counts its own violations so
+ * nothing is shared until the results are summed. Color conflicts are counted
+ * rather than treated as invalid labels; run_check fails any map that has one.
+ */
+bool validate_map(const Map* map, ValidateResult* result) {
+    memset(result, 0, sizeof(*result));
+    if (!map->reg_map || !map->regions || !map->original_surface) {
+        log_error("Map is not segmented, nothing to validate");
+        return false;
     }
 
-    current_map.reg_count = 0;
-
-    for (int y = 0; y < current_map.height && current_map.reg_count < MAX_REGIONS; y++) {
-        for (int x = 0; x < current_map.width && current_map.reg_count < MAX_REGIONS; x++) {
-            int index = y * current_map.width + x;
+    int threads = SDL_GetCPUCount();
+    if (threads < 1) threads = 1;
+    if (threads > VALIDATE_MAX_THREADS) threads = VALIDATE_MAX_THREADS;
+
+    ValidateJob jobs[VALIDATE_MAX_THREADS];
+    SDL_Thread* workers[VALIDATE_MAX_THREADS];
+    for (int t = 0; t < threads; t++) {
+        memset(&jobs[t], 0, sizeof(ValidateJob));
+        jobs[t].map = map;
+        jobs[t].first_row = (int)((long long)map->height * t / threads);
+        jobs[t].last_row = (int)((long long)map->height * (t + 1) / threads);
+        jobs[t].first_region = (int)((long long)map->reg_count * t / threads);
+        jobs[t].last_region = (int)((long long)map->reg_count * (t + 1) / threads);
+        workers[t] = t > 0 ? SDL_CreateThread(validate_worker, "validate", &jobs[t]) : NULL;
+        if (t > 0 && !workers[t]) {
+            validate_worker(&jobs[t]);
+        }
+    }
+    validate_worker(&jobs[0]);
+
+    for (int t = 0; t < threads; t++) {
+        if (workers[t]) SDL_WaitThread(workers[t], NULL);
+        result->unlabeled += jobs[t].result.unlabeled;
+        result->ink_labeled += jobs[t].result.ink_labeled;
+        result->bad_colors += jobs[t].result.bad_colors;
+        result->conflicts += jobs[t].result.conflicts;
+        result->asymmetric += jobs[t].result.asymmetric;
+        result->bad_edges += jobs[t].result.bad_edges;
+        result->edges += jobs[t].result.edges;
+    }
+    result->edges /= 2;
 
-            if (!visited[index] && !is_black_pixel(current_map.pixels[index])) {
+    return result->unlabeled == 0 && result->ink_labeled == 0 && result->bad_colors == 0 &&
+           result->asymmetric == 0 && result->bad_edges == 0;
+}
 
-                int region_id = current_map.reg_count;
+int validate_worker(void* data) {
+    ValidateJob* job = data;
+    const Map* map = job->map;
+    const SDL_Surface* original = map->original_surface;
+
+    for (int y = job->first_row; y < job->last_row; y++) {
+        const unsigned int* row = (const unsigned int*)((const Uint8*)original->pixels + (size_t)y * original->pitch);
+        const int* labels = map->reg_map + (size_t)y * map->width;
+        for (int x = 0; x < map->width; x++) {
+            if (is_black_pixel(map, row[x])) {
+                if (labels[x] != -1) job->result.ink_labeled++;
+            } else if (labels[x] < 0 || labels[x] >= map->reg_count) {
+                job->result.unlabeled++;
+            }
+        }
+    }
 
-                current_map.regions[region_id].id = region_id;
-                current_map.regions[region_id].color = -1;
-                current_map.regions[region_id].is_colored = false;
+    for (int i = job->first_region; i < job->last_region; i++) {
+        const Region* region = &map->regions[i];
+        if (!region->is_colored || region->color < 0 || region->color >= map_options_of(map)->palette.size) {
+            job->result.bad_colors++;
+        }
 
-                current_map.regions[region_id].neighbors = NULL;
+        for (NeighborNode* node = region->neighbors; node; node = node->next) {
+            int other = node->region_id;
+            job->result.edges++;
+            if (other < 0 || other >= map->reg_count || other == i) {
+                job->result.bad_edges++;
+                continue;
+            }
+            if (other > i && region->is_colored && region->color == map->regions[other].color) {
+                job->result.conflicts++;
+            }
 
-                current_map.regions[region_id].pixel_count = 0;
+            bool mirrored = false;
+            for (NeighborNode* back = map->regions[other].neighbors; back; back = back->next) {
+                if (back->region_id == i) {
+                    mirrored = true;
+                    break;
+                }
+            }
+            if (!mirrored) job->result.asymmetric++;
+        }
+    }
+    return 0;
+}
 
-                flood_fill_iterative(x, y, region_id, visited);
+uint64_t map_label_hash(const Map* map) {
+    return hash_bytes(map->reg_map, (size_t)map->width * map->height * sizeof(int), 0);
+}
 
-                current_map.reg_count++;
+/* Neighbor lists are hashed in sorted order so the digest does not depend on insertion order. */
+void map_digest(const Map* map, MapDigest* digest) {
+    memset(digest, 0, sizeof(*digest));
+    digest->width = map->width;
+    digest->height = map->height;
+    digest->regions = map->reg_count;
+    digest->labels = map_label_hash(map);
+
+    int* neighbor_ids = NULL;
+    int capacity = 0;
+    uint64_t graph = 0, colors = 0;
+    for (int i = 0; i < map->reg_count; i++) {
+        int degree = 0;
+        for (NeighborNode* node = map->regions[i].neighbors; node; node = node->next) {
+            if (degree == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                int* grown = realloc(neighbor_ids, capacity * sizeof(int));
+                if (!grown) break;
+                neighbor_ids = grown;
             }
+            neighbor_ids[degree++] = node->region_id;
         }
+        if (degree > 0) {
+            qsort(neighbor_ids, degree, sizeof(int), compare_ints);
+        }
+        graph = hash_bytes(neighbor_ids, (size_t)degree * sizeof(int), graph ^ (uint64_t)i);
+        digest->edges += degree;
+
+        int color = map->regions[i].color;
+        colors = hash_bytes(&color, sizeof(color), colors);
     }
+    free(neighbor_ids);
 
-    free(visited);
+    digest->edges /= 2;
+    digest->graph = graph;
+    digest->colors = colors;
 }
 
-void push(StackNode** top, int x, int y) {
-    StackNode* new_node = malloc(sizeof(StackNode));
-    if (!new_node) {
-        return;
+bool read_check_file(const char* filename, CheckEntry** entries, int* count) {
+    *entries = NULL;
+    *count = 0;
+
+    FILE* file = fopen(filename, "r");
+    if (!file) return false;
+
+    int capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CheckEntry* grown = realloc(*entries, capacity * sizeof(CheckEntry));
+            if (!grown) break;
+            *entries = grown;
+        }
+
+        CheckEntry* entry = &(*entries)[*count];
+        memset(entry, 0, sizeof(CheckEntry));
+        unsigned long long labels, graph, colors, value;
+        if (sscanf(line, "%255s %d %d %d %lld %lld %llx %llx %llx", entry->map, &entry->digest.width, &entry->digest.height,
+                   &entry->digest.regions, &entry->digest.edges, &entry->digest.conflicts, &labels, &graph, &colors) == 9) {
+            entry->digest.labels = labels;
+            entry->digest.graph = graph;
+            entry->digest.colors = colors;
+            (*count)++;
+        } else if (sscanf(line, "%255s %31s %llu", entry->map, entry->stage, &value) == 3) {
+            entry->best_ns = value;
+            (*count)++;
+        } else {
+            log_warn("Ignoring malformed line in %s: %s", filename, line);
+        }
     }
-    new_node->x = x;
-    new_node->y = y;
-    new_node->next = *top;
-    *top = new_node;
+    fclose(file);
+    return true;
 }
 
-bool pop(StackNode** top, int* x, int* y) {
-    if (*top == NULL) return false;
-    StackNode* temp = *top;
-    *x = temp->x;
-    *y = temp->y;
-    *top = temp->next;
-    free(temp);
-    return true;
+const CheckEntry* find_check_entry(const CheckEntry* entries, int count, const char* map, const char* stage) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].map, map) == 0 && (!stage || strcmp(entries[i].stage, stage) == 0)) {
+            return &entries[i];
+        }
+    }
+    return NULL;
 }
 
-void flood_fill_iterative(int start_x, int start_y, int region_id, unsigned int* visited) {//--------new
-    StackNode* stack = NULL;
-    push(&stack, start_x, start_y);
+/*
+ * Runs every .bmp in dir through the pipeline, validates the result and
+ * compares it with dir/golden-N.txt for a palette of N colors. Stage times (best of runs) are compared
+ * with dir/baseline.txt when it exists; a stage fails when it is more than
+ * margin percent slower. The update flags rewrite those files instead.
+ */
+bool run_check(const char* dir, int runs, double margin, bool update_golden, bool save_baseline) {
+    const char* stages[] = {"find_regions", "build_adjacency", "coloring"};
+    const int stage_total = sizeof(stages) / sizeof(stages[0]);
+
+    int count = 0;
+    char** names = list_map_files(dir, &count);
+    if (!names) return false;
+    if (count == 0) {
+        log_error("No maps to check in %s", dir);
+        free_names(names, count);
+        return false;
+    }
 
-    int pixels_processed = 0;
+    /* Each segmentation setting keeps its own golden and baseline files. */
+    char path[512], golden_path[512], baseline_path[512];
+    char golden_name[96], baseline_name[96], cleanup[64] = "";
+    size_t used = 0;
+    const MapOptions* options = &map_options;
+    if (options->min_region_area > 0) used += snprintf(cleanup + used, sizeof(cleanup) - used, "-area%d", options->min_region_area);
+    if (options->ink_close_radius > 0) used += snprintf(cleanup + used, sizeof(cleanup) - used, "-close%d", options->ink_close_radius);
+    if (options->color_tolerance >= 0) snprintf(cleanup + used, sizeof(cleanup) - used, "-tol%d", options->color_tolerance);
+    snprintf(golden_name, sizeof(golden_name), CHECK_GOLDEN_FILE, options->palette.size, cleanup);
+    snprintf(baseline_name, sizeof(baseline_name), CHECK_BASELINE_FILE, cleanup);
+    snprintf(golden_path, sizeof(golden_path), "%s/%s", dir, golden_name);
+    snprintf(baseline_path, sizeof(baseline_path), "%s/%s", dir, baseline_name);
+
+    CheckEntry* golden = NULL;
+    CheckEntry* baseline = NULL;
+    int golden_count = 0, baseline_count = 0;
+    if (!update_golden && !read_check_file(golden_path, &golden, &golden_count)) {
+        log_warn("No golden file %s, run with --update-golden to create it", golden_path);
+    }
+    bool have_baseline = !save_baseline && read_check_file(baseline_path, &baseline, &baseline_count);
 
-    while (stack) {
-        int x, y;
-        if (!pop(&stack, &x, &y)) break;
+    FILE* golden_out = update_golden ? fopen(golden_path, "w") : NULL;
+    FILE* baseline_out = save_baseline ? fopen(baseline_path, "w") : NULL;
+    if ((update_golden && !golden_out) || (save_baseline && !baseline_out)) {
+        log_error("Failed to write check files in %s", dir);
+    }
+    if (golden_out) fprintf(golden_out, "# map width height regions edges conflicts labels graph colors\n");
+    if (baseline_out) fprintf(baseline_out, "# map stage best_ns\n");
 
-        if (x < 0 || x >= current_map.width || y < 0 || y >= current_map.height) continue;
+    bool saved_cache = cache_enabled;
+    cache_enabled = false;
 
-        int index = y * current_map.width + x;
-        if (visited[index] || is_black_pixel(current_map.pixels[index])) continue;
+    int failures = 0;
+    for (int m = 0; m < count; m++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[m]);
+        reset_profile_stages();
 
-        int left = x;
-        while (left >= 0 && !visited[y * current_map.width + left] && !is_black_pixel(current_map.pixels[y * current_map.width + left])) {
-            visited[y * current_map.width + left] = 1;
-            current_map.reg_map[y * current_map.width + left] = region_id;
-            current_map.regions[region_id].pixel_count++;
-            pixels_processed++;
-            left--;
+        bool loaded = true;
+        for (int r = 0; r < runs && loaded; r++) {
+            loaded = load_map(path);
+            if (loaded) color_used_final = greedy_coloring(&current_map);
+        }
+        if (!loaded) {
+            printf("FAIL %s: could not be loaded\n", names[m]);
+            failures++;
+            continue;
         }
-        left++;
 
-        int right = x + 1;
-        while (right < current_map.width && !visited[y * current_map.width + right] && !is_black_pixel(current_map.pixels[y * current_map.width + right])) {
-            visited[y * current_map.width + right] = 1;
-            current_map.reg_map[y * current_map.width + right] = region_id;
-            current_map.regions[region_id].pixel_count++;
-            pixels_processed++;
-            right++;
+        ValidateResult result;
+        ProfileScope validate_scope = profile_begin("validate");
+        bool valid = validate_map(&current_map, &result);
+        profile_end(&validate_scope);
+        if (!valid) {
+            printf("FAIL %s: %lld unlabeled pixels, %lld labeled ink pixels, %lld uncolored regions, "
+                   "%lld one-way edges, %lld invalid edges\n", names[m], result.unlabeled,
+                   result.ink_labeled, result.bad_colors, result.asymmetric, result.bad_edges);
+            if (current_map.reg_count >= MAX_REGIONS) {
+                printf("     %s reached MAX_REGIONS (%d), pixels past the limit stay unlabeled\n", names[m], MAX_REGIONS);
+            }
+            failures++;
         }
 
-        for (int scan_x = left; scan_x < right; scan_x++) {
-            if (y - 1 >= 0 && !visited[(y - 1) * current_map.width + scan_x] && !is_black_pixel(current_map.pixels[(y - 1) * current_map.width + scan_x])) {
-                push(&stack, scan_x, y - 1);
+        MapDigest digest;
+        map_digest(&current_map, &digest);
+        digest.conflicts = result.conflicts;
+        if (golden_out) {
+            fprintf(golden_out, "%s %d %d %d %lld %lld %016llx %016llx %016llx\n", names[m], digest.width, digest.height,
+                    digest.regions, digest.edges, digest.conflicts, (unsigned long long)digest.labels,
+                    (unsigned long long)digest.graph, (unsigned long long)digest.colors);
+        } else if (golden) {
+            const CheckEntry* expected = find_check_entry(golden, golden_count, names[m], NULL);
+            if (!expected) {
+                printf("FAIL %s: no golden entry\n", names[m]);
+                failures++;
+            } else {
+                const MapDigest* want = &expected->digest;
+                bool labels_ok = want->width == digest.width && want->height == digest.height &&
+                                 want->regions == digest.regions && want->labels == digest.labels;
+                bool graph_ok = want->edges == digest.edges && want->graph == digest.graph;
+                bool colors_ok = want->colors == digest.colors;
+                if (!labels_ok || !graph_ok || !colors_ok) {
+                    printf("FAIL %s: differs from golden in%s%s%s (%d regions/%lld edges, expected %d/%lld)\n", names[m],
+                           labels_ok ? "" : " labels", graph_ok ? "" : " graph", colors_ok ? "" : " colors",
+                           digest.regions, digest.edges, want->regions, want->edges);
+                    failures++;
+                }
+            }
+        }
+        if (digest.conflicts > 0) {
+            printf("FAIL %s: %lld adjacent regions share a color\n", names[m], digest.conflicts);
+            failures++;
+        }
+
+        SDL_LockMutex(profile_mutex);
+        for (int s = 0; s < stage_total; s++) {
+            const ProfileStage* stage = find_main_stage(stages[s]);
+            if (!stage || stage->count == 0) continue;
+
+            if (baseline_out) {
+                fprintf(baseline_out, "%s %s %llu\n", names[m], stages[s], (unsigned long long)stage->min_ns);
             }
-            if (y + 1 < current_map.height && !visited[(y + 1) * current_map.width + scan_x] && !is_black_pixel(current_map.pixels[(y + 1) * current_map.width + scan_x])) {
-                push(&stack, scan_x, y + 1);
+
+            const CheckEntry* before = have_baseline ? find_check_entry(baseline, baseline_count, names[m], stages[s]) : NULL;
+            if (!before) {
+                printf("     %-32s %-16s %10.3f ms\n", names[m], stages[s], stage->min_ns / 1e6);
+                continue;
             }
+
+            double change = before->best_ns ? 100.0 * ((double)stage->min_ns - before->best_ns) / before->best_ns : 0.0;
+            bool slower = change > margin && stage->min_ns > before->best_ns + CHECK_MIN_SLACK_NS;
+            printf("%s %-32s %-16s %10.3f ms %+7.1f%%\n", slower ? "SLOW" : "    ", names[m], stages[s],
+                   stage->min_ns / 1e6, change);
+            if (slower) failures++;
         }
+        SDL_UnlockMutex(profile_mutex);
 
-        if (pixels_processed > 100000) break;
+        if (valid) {
+            printf("  ok %s: %d regions, %lld edges, %d colors, %lld conflicts\n", names[m], current_map.reg_count,
+                   result.edges, color_used_final, result.conflicts);
+        }
+
+        /* The brush does not redo the speck cleanup, so its result only matches a fresh load without it. */
+        if (options->min_region_area <= 0 && options->ink_close_radius <= 0 && !check_map_edits(names[m], (uint64_t)m + 1)) {
+            failures++;
+        }
     }
 
-    while (stack) {
-        StackNode* temp = stack;
-        stack = stack->next;
-        free(temp);
+    bool ok = failures == 0;
+    if (golden_out && fclose(golden_out) != 0) ok = false;
+    if (baseline_out && fclose(baseline_out) != 0) ok = false;
+    cache_enabled = saved_cache;
+    free(golden);
+    free(baseline);
+    free_names(names, count);
+
+    if (!have_baseline && !save_baseline) {
+        printf("No timing baseline in %s, run with --save-baseline on this machine to enable the timing check\n", baseline_path);
     }
+    printf("%s: %d maps, %d failures\n", ok ? "PASSED" : "FAILED", count, failures);
+    if (ok) {
+        log_info("Check passed for %d maps in %s", count, dir);
+    } else {
+        log_error("Check failed for %s with %d failures", dir, failures);
+    }
+    return ok;
 }
 
-void build_adjacency_graph() {//--------new
-    if (current_map.reg_count == 0) {
-        log_message("WARNING: No regions found, skipping graph building\n");
-        return;
+/*
+ * Stamps CHECK_EDITS pseudo-random brush rectangles, ink and erase, into
+ * current_map, then segments the edited image from scratch. The labels have
+ * to form the same partition, each region needs the same neighbors as its
+ * fresh counterpart, and no two neighbors may share a color.
+ */
+bool check_map_edits(const char* name, uint64_t seed) {
+    uint64_t state = seed * 0x9e3779b97f4a7c15ull;
+    for (int e = 0; e < CHECK_EDITS; e++) {
+        int r[5];
+        for (int k = 0; k < 5; k++) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            r[k] = (int)(state >> 33);
+        }
+        int size = 1 + r[2] % 48;
+        edit_map_rect(r[0] % current_map.width, r[1] % current_map.height, size, 1 + r[3] % 48, r[4] & 1);
     }
 
-    long long added_number_regions = 0;
+    ValidateResult result;
+    bool valid = validate_map(&current_map, &result);
 
-    const int width  = current_map.width;
-    const int height = current_map.height;
-    const int* map   = current_map.reg_map;
+    Map fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    SDL_Surface* original = current_map.original_surface;
+    if (!init_map_surfaces(&fresh, mem_track_surface(MEM_DECODE, SDL_ConvertSurface(original, original->format, 0))) ||
+        !segment_map(&fresh, NULL)) {
+        printf("FAIL %s: the edited map could not be segmented again\n", name);
+        free_map(&fresh);
+        return false;
+    }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int r1 = map[y * width + x];
-            if (r1 == -1) continue;
-
-            int scan_x = x + 1;
-            while (scan_x < width) {
-                int r2 = map[y * width + scan_x];
-                if (r2 == r1) break;
-                if (r2 != -1) {
-                    if (r1 < current_map.reg_count && r2 < current_map.reg_count) {
-                        if (add_neighbor(&current_map.regions[r1], r2)) added_number_regions++;
-                        if (add_neighbor(&current_map.regions[r2], r1)) added_number_regions++;
-                    }
-                    break;
-                }
-                scan_x++;
-            }
+    int to_fresh[MAX_REGIONS], to_edited[MAX_REGIONS];
+    for (int i = 0; i < MAX_REGIONS; i++) to_fresh[i] = to_edited[i] = -1;
+    long long pixels = 0, lists = 0;
+    for (size_t i = 0; i < (size_t)fresh.width * fresh.height; i++) {
+        int a = current_map.reg_map[i], b = fresh.reg_map[i];
+        if (a < 0 || b < 0) {
+            if ((a < 0) != (b < 0)) pixels++;
+        } else if (to_fresh[a] < 0 && to_edited[b] < 0) {
+            to_fresh[a] = b;
+            to_edited[b] = a;
+        } else if (to_fresh[a] != b || to_edited[b] != a) {
+            pixels++;
+        }
+    }
 
-            int scan_y = y + 1;
-            while (scan_y < height) {
-                int r2 = map[scan_y * width + x];
-                if (r2 == r1) break;
-                if (r2 != -1) {
-                    if (r1 < current_map.reg_count && r2 < current_map.reg_count) {
-                        if (add_neighbor(&current_map.regions[r1], r2)) added_number_regions++;
-                        if (add_neighbor(&current_map.regions[r2], r1)) added_number_regions++;
-                    }
-                    break;
-                }
-                scan_y++;
+    for (int i = 0; i < current_map.reg_count; i++) {
+        if (to_fresh[i] < 0) {
+            lists++;
+            continue;
+        }
+        int degree = 0, fresh_degree = 0;
+        bool same = true;
+        for (NeighborNode* node = current_map.regions[i].neighbors; node; node = node->next) {
+            bool found = false;
+            for (NeighborNode* other = fresh.regions[to_fresh[i]].neighbors; other && !found; other = other->next) {
+                found = other->region_id == to_fresh[node->region_id];
             }
+            same = same && found;
+            degree++;
         }
+        for (NeighborNode* other = fresh.regions[to_fresh[i]].neighbors; other; other = other->next) fresh_degree++;
+        if (!same || degree != fresh_degree) lists++;
     }
+    bool regions_match = current_map.reg_count == fresh.reg_count;
+    free_map(&fresh);
 
-    log_format("Added adjacencies: %lld\n", added_number_regions);
+    if (!valid || !regions_match || pixels > 0 || lists > 0 || result.conflicts > 0) {
+        printf("FAIL %s: after %d edits %lld pixels are labeled differently from a fresh load, %lld neighbor lists differ, "
+               "%lld adjacent regions share a color%s\n", name, CHECK_EDITS, pixels, lists, result.conflicts,
+               valid ? "" : ", and the map does not validate");
+        return false;
+    }
+    printf("  ok %s: %d edits match a fresh load, %d regions, %d colors\n", name, CHECK_EDITS, current_map.reg_count,
+           color_used_final);
+    return true;
 }
 
+/* Takes SIGINT or SIGTERM, which every thread keeps blocked in daemon mode, and wakes the accept loop. */
+int daemon_signal_thread(void* data) {
+    int wake_fd = *(int*)data;
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    int sig = SIGTERM;
+    sigwait(&stop_signals, &sig);
+    SDL_AtomicSet(&daemon_signal, sig);
+    char byte = 1;
+    if (write(wake_fd, &byte, 1) != 1) {
+        log_warn("Failed to wake the daemon: %s", strerror(errno));
+    }
+    return 0;
+}
 
-bool add_neighbor(Region* region, int neighbor_id) {
-    if (!region) return false;
+/*
+ * Serves coloring jobs on a Unix domain socket until SIGINT or SIGTERM.
+ * The accepting thread hands connections to a fixed pool of worker threads
+ * through a bounded queue; when the queue is full it stops accepting, so
+ * further clients wait in the listen backlog. Every stage of a job works on
+ * the worker's own Map, so jobs run fully in parallel.
+ * The accept loop polls the socket together with a pipe that the signal
+ * thread writes to, so a stop never depends on which thread the kernel
+ * picks for the signal.
+ */
+bool run_daemon(const char* socket_path, int worker_count) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        log_error("Socket path is too long: %s", socket_path);
+        return false;
+    }
+    strcpy(address.sun_path, socket_path);
 
-    NeighborNode* current = region->neighbors;
-    while (current) {
-        if (current->region_id == neighbor_id) {
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log_error("%s exists and is not a socket", socket_path);
             return false;
         }
-        current = current->next;
+        unlink(socket_path);
     }
 
-    NeighborNode* new_node = malloc(sizeof(NeighborNode));
-    if (!new_node) {
-        log_format("ERROR: Failed to allocate NeighborNode for region %d\n", region->id);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, DAEMON_BACKLOG) != 0) {
+        log_error("Failed to listen on %s: %s", socket_path, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
         return false;
     }
 
-    new_node->region_id = neighbor_id;
-    new_node->next = region->neighbors;
-    region->neighbors = new_node;
+    job_stats_tls = SDL_TLSCreate();
+    daemon_mutex = SDL_CreateMutex();
+    daemon_cond = SDL_CreateCond();
 
-    return true; 
-}
+    signal(SIGPIPE, SIG_IGN);
 
-int greedy_coloring() {
-    int max_color = 0;
-    color_used_final = 0;
-    
-    for (int i = 0; i < current_map.reg_count; i++) {
-        bool used_colors[MAX_COLORS] = {false};
-        
-        NeighborNode* neighbor = current_map.regions[i].neighbors;
-        while (neighbor) {
-            int neighbor_id = neighbor->region_id;
+    int wake[2] = {-1, -1};
+    SDL_Thread* signal_thread = NULL;
+    if (pipe(wake) == 0) {
+        signal_thread = SDL_CreateThread(daemon_signal_thread, "signals", &wake[1]);
+    }
+    if (!signal_thread) {
+        log_error("Failed to start the signal thread");
+    }
 
-            if (neighbor_id >= 0 && neighbor_id < current_map.reg_count && current_map.regions[neighbor_id].is_colored && current_map.regions[neighbor_id].color != -1) {
-                used_colors[current_map.regions[neighbor_id].color] = true;
-            }
-            neighbor = neighbor->next;
+    DaemonWorker workers[DAEMON_MAX_WORKERS];
+    memset(workers, 0, sizeof(workers));
+    int started = 0;
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].index = i;
+        workers[i].fd = -1;
+        workers[i].thread = SDL_CreateThread(daemon_worker, "daemon", &workers[i]);
+        if (!workers[i].thread) {
+            log_warn("Failed to start daemon worker %d: %s", i, SDL_GetError());
+            break;
         }
-        
-        int chosen_color = -1;
-        for (int j = 0; j < MAX_COLORS; j++) {
-            if (!used_colors[j]) {
-                current_map.regions[i].color = j;
-                current_map.regions[i].is_colored = true;
-                chosen_color = j;
-                if (j > max_color) {
-                    max_color = j;
-                }
-                break;
-            }
+        started++;
+    }
+
+    bool ok = started > 0 && signal_thread;
+    if (ok) {
+        log_info("Listening on %s with %d workers", socket_path, started);
+        printf("Listening on %s with %d workers\n", socket_path, started);
+        fflush(stdout);
+    }
+
+    while (ok && !SDL_AtomicGet(&daemon_signal)) {
+        struct pollfd fds[2];
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll failed: %s", strerror(errno));
+            break;
         }
-        if(chosen_color == -1) {
-            current_map.regions[i].color = 0;
-            current_map.regions[i].is_colored = true;
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) log_warn("accept failed: %s", strerror(errno));
+            continue;
         }
-        
-        color_region_pixels(i, colors[current_map.regions[i].color]);
+
+        SDL_LockMutex(daemon_mutex);
+        while (daemon_queue_count == DAEMON_QUEUE_SIZE && !SDL_AtomicGet(&daemon_signal)) {
+            SDL_CondWaitTimeout(daemon_cond, daemon_mutex, 100);
+        }
+        if (SDL_AtomicGet(&daemon_signal)) {
+            SDL_UnlockMutex(daemon_mutex);
+            close(fd);
+            break;
+        }
+        daemon_queue[(daemon_queue_head + daemon_queue_count) % DAEMON_QUEUE_SIZE] = fd;
+        daemon_queue_count++;
+        SDL_CondBroadcast(daemon_cond);
+        SDL_UnlockMutex(daemon_mutex);
     }
-    
-    color_used_final = max_color + 1;
-    
-    return color_used_final;
-}
 
-void color_region_pixels(int region_id, SDL_Color color) {
-    if (!current_map.surface) {
-        log_message("[LOG]   ERROR: current_map.surface is NULL!\n");
-        return;
+    log_info("Daemon stopping, finishing queued connections");
+    close(listen_fd);
+    unlink(socket_path);
+
+    SDL_LockMutex(daemon_mutex);
+    daemon_quit = true;
+    for (int i = 0; i < started; i++) {
+        if (workers[i].fd >= 0) shutdown(workers[i].fd, SHUT_RD);
     }
-    
-    if (!current_map.reg_map) {
-        log_message("[LOG]   ERROR: current_map.reg_map is NULL!\n");
-        return;
+    SDL_CondBroadcast(daemon_cond);
+    SDL_UnlockMutex(daemon_mutex);
+
+    for (int i = 0; i < started; i++) {
+        SDL_WaitThread(workers[i].thread, NULL);
     }
-    
-    if (!current_map.pixels) {
-        log_message("[LOG]   ERROR: current_map.pixels is NULL!\n");
-        return;
+
+    /* Without a stop signal the signal thread is still in sigwait; a signal of our own releases it. */
+    if (signal_thread) {
+        if (!SDL_AtomicGet(&daemon_signal)) kill(getpid(), SIGTERM);
+        SDL_WaitThread(signal_thread, NULL);
     }
-    
-    unsigned int pixel_color = SDL_MapRGB(current_map.surface->format, color.r, color.g, color.b);
-    
-    int expected_pixels = current_map.regions[region_id].pixel_count;
-    
-    int pixels_colored = 0;
-    int map_size = current_map.width * current_map.height;
-    
-    for (int i = 0; i < map_size && pixels_colored < expected_pixels; i++) {
-        if (current_map.reg_map[i] == region_id) {
-            current_map.pixels[i] = pixel_color;
-            pixels_colored++;
-        }
+    if (wake[0] >= 0) {
+        close(wake[0]);
+        close(wake[1]);
     }
-    
+
+    SDL_DestroyCond(daemon_cond);
+    SDL_DestroyMutex(daemon_mutex);
+    daemon_cond = NULL;
+    daemon_mutex = NULL;
+    log_info("Daemon served %d jobs", SDL_AtomicGet(&daemon_jobs));
+    return ok;
 }
 
-void render_text(const char* text, int x, int y, SDL_Color color) {
-    if (!font) return;
-    
-    SDL_Surface* text_surface = TTF_RenderText_Solid(font, text, color);
-    if (text_surface) {
-        SDL_Texture* text_texture = SDL_CreateTextureFromSurface(renderer, text_surface);
-        if (text_texture) {
-            SDL_Rect dest_rect = {x, y, text_surface->w, text_surface->h};
-            SDL_RenderCopy(renderer, text_texture, NULL, &dest_rect);
-            SDL_DestroyTexture(text_texture);
+int daemon_worker(void* data) {
+    DaemonWorker* worker = data;
+    char name[32];
+    snprintf(name, sizeof(name), "daemon %d", worker->index);
+    profile_thread(name);
+
+    SDL_LockMutex(daemon_mutex);
+    for (;;) {
+        while (daemon_queue_count == 0 && !daemon_quit) {
+            SDL_CondWait(daemon_cond, daemon_mutex);
         }
-        SDL_FreeSurface(text_surface);
-    }
-}
+        if (daemon_queue_count == 0) break;
 
-void render_map() {
-    if (!current_map.surface) return;
+        int fd = daemon_queue[daemon_queue_head];
+        daemon_queue_head = (daemon_queue_head + 1) % DAEMON_QUEUE_SIZE;
+        daemon_queue_count--;
+        worker->fd = fd;
+        if (daemon_quit) shutdown(fd, SHUT_RD);
+        SDL_CondBroadcast(daemon_cond);
+        SDL_UnlockMutex(daemon_mutex);
 
-    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, current_map.surface);
-    if (texture) {
-        SDL_Rect dest_rect = {50, MENU_HEIGHT + 50, WINDOW_WIDTH - 100, WINDOW_HEIGHT - MENU_HEIGHT - 100};
-        SDL_RenderCopy(renderer, texture, NULL, &dest_rect);
-        SDL_DestroyTexture(texture);
+        serve_connection(worker, fd);
+
+        SDL_LockMutex(daemon_mutex);
+        worker->fd = -1;
+        close(fd);
     }
+    SDL_UnlockMutex(daemon_mutex);
 
-    if (current_map.reg_count > 0) {
-        char info_text[256];
-        sprintf(info_text, "Map %d/%d | Regions: %d", curr_map_index + 1, total_maps, current_map.reg_count);
-        SDL_Color white = {0, 0, 0, 255};
-        render_text(info_text, WINDOW_WIDTH - 1150, MENU_HEIGHT + 10, white);
+    mem_free(worker->payload);
+    arena_release(&worker->arena);
+    return 0;
+}
+
+/* Runs the jobs of one connection in order until the client hangs up. */
+void serve_connection(DaemonWorker* worker, int fd) {
+    DaemonConnection conn;
+    conn.fd = fd;
+    conn.start = conn.end = 0;
+
+    char line[DAEMON_LINE_SIZE];
+    while (daemon_read_line(&conn, line, sizeof(line))) {
+        if (strcmp(line, "PING") == 0) {
+            if (!daemon_reply(&conn, "PONG\n")) break;
+        } else if (strncmp(line, "COLOR", 5) == 0 && (line[5] == ' ' || line[5] == '\0')) {
+            if (!run_job(worker, &conn, line + 5)) break;
+        } else if (line[0] != '\0') {
+            if (!daemon_reply(&conn, "ERROR 0 unknown request\n")) break;
+        }
+    }
+}
+
+/*
+ * Splits the next key=value field off a request line in place. A value in
+ * double quotes may contain spaces, with \" and \\ standing for a quote and a
+ * backslash. Returns false at the end of the line; *value is NULL when the
+ * field is malformed.
+ */
+bool next_job_field(char** cursor, char** key, char** value) {
+    char* p = *cursor + strspn(*cursor, " ");
+    if (*p == '\0') return false;
+    *key = p;
+    *value = NULL;
+    p += strcspn(p, " =");
+    if (*p == '=') {
+        *p++ = '\0';
+        if (*p != '"') {
+            *value = p;
+            p += strcspn(p, " ");
+        } else {
+            char* start = ++p;
+            char* out = start;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1]) p++;
+                *out++ = *p++;
+            }
+            if (*p == '"' && (p[1] == '\0' || p[1] == ' ')) {
+                *out = '\0';
+                *value = start;
+                p++;
+            } else {
+                p += strcspn(p, " ");
+            }
+        }
+    }
+    if (*p) *p++ = '\0';
+    *cursor = p;
+    return true;
+}
+
+/*
+ * One COLOR request: "COLOR key=value ...", followed by size bytes of image
+ * data when the input is inline. Besides the input and output, a job may set
+ * min_area, close_ink, color_tolerance, simplify and palette; anything it
+ * leaves out keeps the daemon's command line setting. Replies are streamed
+ * as the job advances: ACCEPTED, one PHASE line per step, the STAGE
+ * breakdown, RESULT, an optional DATA block and finally OK or ERROR. Returns
+ * false when the connection can no longer be used.
+ */
+bool run_job(DaemonWorker* worker, DaemonConnection* conn, char* request) {
+    int job = SDL_AtomicAdd(&daemon_jobs, 1) + 1;
+    const char* input = NULL;
+    const char* output = NULL;
+    const char* format = "bmp";
+    const char* palette = NULL;
+    unsigned long long size = 0;
+    MapOptions options = map_options;
+    options.rle = true;
+    const char* error = NULL;
+
+    char* cursor = request;
+    char *key, *value;
+    while (next_job_field(&cursor, &key, &value)) {
+        if (!value) {
+            error = "expected key=value";
+        } else if (strcmp(key, "input") == 0) {
+            input = value;
+        } else if (strcmp(key, "size") == 0) {
+            size = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "output") == 0) {
+            output = value;
+        } else if (strcmp(key, "format") == 0) {
+            format = value;
+        } else if (strcmp(key, "rle") == 0) {
+            options.rle = atoi(value) != 0;
+        } else if (strcmp(key, "min_area") == 0) {
+            options.min_region_area = atoi(value);
+        } else if (strcmp(key, "close_ink") == 0) {
+            options.ink_close_radius = atoi(value);
+        } else if (strcmp(key, "color_tolerance") == 0) {
+            options.color_tolerance = SDL_min(atoi(value), 255);
+        } else if (strcmp(key, "simplify") == 0) {
+            options.vector_tolerance = atof(value);
+        } else if (strcmp(key, "palette") == 0) {
+            palette = value;
+        } else {
+            error = "unknown parameter";
+        }
+    }
+
+    if (size > DAEMON_MAX_PAYLOAD) {
+        daemon_reply(conn, "ERROR %d inline image larger than %llu bytes\n", job, DAEMON_MAX_PAYLOAD);
+        return false;
+    }
+
+    uint64_t start = now_ns();
+    if (size > 0) {
+        if (size > worker->payload_capacity) {
+            unsigned char* payload = mem_realloc(MEM_DAEMON, worker->payload, (size_t)size);
+            if (!payload) {
+                daemon_reply(conn, "ERROR %d out of memory for the inline image\n", job);
+                return false;
+            }
+            worker->payload = payload;
+            worker->payload_capacity = (size_t)size;
+        }
+        if (!daemon_read_bytes(conn, worker->payload, (size_t)size)) return false;
+    }
+
+    bool streamed = output && strcmp(output, "-") == 0;
+    bool want_bmp = strcmp(format, "bmp") == 0, want_cmap = strcmp(format, "cmap") == 0;
+    bool want_svg = strcmp(format, "svg") == 0, want_geojson = strcmp(format, "geojson") == 0;
+    bool want_output = want_bmp || want_cmap || want_svg || want_geojson;
+    if (!error && (input ? size > 0 : size == 0)) error = "give either input=PATH or size=BYTES";
+    if (!error && !want_output && strcmp(format, "none") != 0) error = "format must be bmp, cmap, svg, geojson or none";
+    if (!error && want_output && !output) error = "output=PATH or output=- is required";
+    if (!error && palette && !load_palette(palette, &options.palette)) error = "cannot read the palette";
+    if (error) {
+        return daemon_reply(conn, "ERROR %d %s\n", job, error);
+    }
+    if (!daemon_reply(conn, "ACCEPTED %d\nPHASE receive %.3f\n", job, (now_ns() - start) / 1e6)) return false;
+
+    JobStats stats;
+    memset(&stats, 0, sizeof(stats));
+    SDL_TLSSet(job_stats_tls, &stats, NULL);
+
+    Map map;
+    memset(&map, 0, sizeof(map));
+    map.options = &options;
+    map.arena = worker->arena;
+    memset(&worker->arena, 0, sizeof(Arena));
+    start = now_ns();
+    bool loaded = input ? process_map(&map, input, NULL) : process_map_buffer(&map, worker->payload, (size_t)size);
+    bool alive = daemon_reply(conn, "PHASE load %.3f\n", (now_ns() - start) / 1e6);
+    if (!loaded) {
+        SDL_TLSSet(job_stats_tls, NULL, NULL);
+        daemon_free_map(worker, &map);
+        return alive && daemon_reply(conn, "ERROR %d failed to load the map\n", job);
+    }
+
+    start = now_ns();
+    int colors_used = greedy_coloring(&map);
+    alive = alive && daemon_reply(conn, "PHASE color %.3f\n", (now_ns() - start) / 1e6);
+
+    char path[512];
+    bool written = true;
+    if (want_output) {
+        if (streamed) {
+            snprintf(path, sizeof(path), "%s/coloring-%d-XXXXXX", P_tmpdir, job);
+            int temp_fd = mkstemp(path);
+            if (temp_fd >= 0) close(temp_fd);
+            written = temp_fd >= 0;
+        } else {
+            snprintf(path, sizeof(path), "%s", output);
+        }
+
+        start = now_ns();
+        if (written && want_bmp) {
+            written = save_colored_map(&map, path);
+        } else if (written && (want_svg || want_geojson)) {
+            written = export_vector(&map, path, want_geojson, options.vector_tolerance);
+        } else if (written) {
+            ProfileScope export_scope = profile_begin("export");
+            written = export_map(&map, path, options.rle);
+            profile_end(&export_scope);
+        }
+        alive = alive && daemon_reply(conn, "PHASE output %.3f\n", (now_ns() - start) / 1e6);
+    }
+    SDL_TLSSet(job_stats_tls, NULL, NULL);
+
+    for (int i = 0; i < stats.count && alive; i++) {
+        alive = daemon_reply(conn, "STAGE %s %d %.3f\n", stats.stages[i].name, stats.stages[i].count, stats.stages[i].total_ns / 1e6);
+    }
+
+    long long edges = 0, conflicts = 0;
+    for (int i = 0; i < map.reg_count; i++) {
+        for (NeighborNode* node = map.regions[i].neighbors; node; node = node->next) {
+            edges++;
+            if (map.regions[i].color == map.regions[node->region_id].color) conflicts++;
+        }
+    }
+    alive = alive && daemon_reply(conn, "RESULT width=%d height=%d regions=%d edges=%lld colors=%d conflicts=%lld\n",
+                                  map.width, map.height, map.reg_count, edges / 2, colors_used, conflicts / 2);
+    daemon_free_map(worker, &map);
+
+    int result_fd = -1;
+    if (written && streamed) {
+        result_fd = open(path, O_RDONLY);
+        written = result_fd >= 0;
+    }
+    if (streamed) remove(path);
+    if (!written) {
+        return alive && daemon_reply(conn, "ERROR %d failed to write the %s output\n", job, format);
+    }
+    if (streamed) {
+        alive = alive && daemon_send_file(conn, result_fd);
+        close(result_fd);
+    }
+    return alive && daemon_reply(conn, "OK %d\n", job);
+}
+
+/* Frees a job's map but hands its arena back to the worker, reset for the next job. */
+void daemon_free_map(DaemonWorker* worker, Map* map) {
+    arena_reset(&map->arena);
+    worker->arena = map->arena;
+    memset(&map->arena, 0, sizeof(Arena));
+    free_map(map);
+}
+
+void job_stats_add(JobStats* stats, const char* name, uint64_t duration_ns) {
+    for (int i = 0; i < stats->count; i++) {
+        if (strcmp(stats->stages[i].name, name) == 0) {
+            stats->stages[i].count++;
+            stats->stages[i].total_ns += duration_ns;
+            return;
+        }
+    }
+    if (stats->count < JOB_MAX_STAGES) {
+        JobStage* stage = &stats->stages[stats->count++];
+        stage->name = name;
+        stage->count = 1;
+        stage->total_ns = duration_ns;
+    }
+}
+
+bool daemon_read_line(DaemonConnection* conn, char* line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        while (conn->start < conn->end) {
+            char c = conn->buffer[conn->start++];
+            if (c == '\n') {
+                if (length > 0 && line[length - 1] == '\r') length--;
+                line[length] = '\0';
+                return true;
+            }
+            if (length + 1 < size) line[length++] = c;
+        }
+
+        ssize_t got = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        conn->start = 0;
+        conn->end = (size_t)got;
+    }
+}
+
+bool daemon_read_bytes(DaemonConnection* conn, void* data, size_t size) {
+    unsigned char* out = data;
+    size_t buffered = SDL_min(size, conn->end - conn->start);
+    memcpy(out, conn->buffer + conn->start, buffered);
+    conn->start += buffered;
+
+    size_t done = buffered;
+    while (done < size) {
+        ssize_t got = recv(conn->fd, out + done, size - done, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        done += (size_t)got;
+    }
+    return true;
+}
+
+bool daemon_send(DaemonConnection* conn, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    while (size > 0) {
+        ssize_t sent = send(conn->fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+bool daemon_reply(DaemonConnection* conn, const char* format, ...) {
+    char text[DAEMON_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0) return false;
+    return daemon_send(conn, text, SDL_min((size_t)length, sizeof(text) - 1));
+}
+
+/*
+ * Streams an open file as "DATA <bytes>\n" followed by its contents. A read
+ * error or a short file after the header leaves the client waiting for bytes
+ * that never come, so it returns false and the connection must be dropped.
+ */
+bool daemon_send_file(DaemonConnection* conn, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+
+    bool ok = daemon_reply(conn, "DATA %llu\n", (unsigned long long)st.st_size);
+    char chunk[65536];
+    unsigned long long left = (unsigned long long)st.st_size;
+    while (ok && left > 0) {
+        ssize_t got = read(fd, chunk, (size_t)SDL_min(left, (unsigned long long)sizeof(chunk)));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            log_error("Result file ended %llu bytes early: %s", left, got < 0 ? strerror(errno) : "end of file");
+            return false;
+        }
+        ok = daemon_send(conn, chunk, (size_t)got);
+        left -= (unsigned long long)got;
+    }
+    return ok;
+}
+
+bool write_profile_summary(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        log_error("Failed to open profile summary %s", filename);
+        return false;
+    }
+
+    SDL_LockMutex(profile_mutex);
+    fprintf(file, "{\n");
+    fprintf(file, "  \"clock\": \"monotonic\",\n");
+    fprintf(file, "  \"wall_ns\": %llu,\n", (unsigned long long)(now_ns() - profile_origin_ns));
+    fprintf(file, "  \"perf_counters\": %s,\n", perf_counters_enabled ? "true" : "false");
+    fprintf(file, "  \"dropped_trace_events\": %d,\n", profile_dropped);
+    fprintf(file, "  \"stages\": [");
+    for (int i = 0; i < profile_stage_count; i++) {
+        const ProfileStage* stage = &profile_stages[i];
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"thread\": \"%s\", \"count\": %llu, \"total_ns\": %llu, \"min_ns\": %llu, \"max_ns\": %llu",
+                i ? "," : "", stage->name, stage->thread >= 0 ? profile_threads[stage->thread].name : "unknown",
+                (unsigned long long)stage->count, (unsigned long long)stage->total_ns,
+                (unsigned long long)stage->min_ns, (unsigned long long)stage->max_ns);
+        fprintf(file, ", \"peak_bytes\": %llu, \"peak_delta_bytes\": %llu",
+                (unsigned long long)stage->peak_bytes, (unsigned long long)stage->peak_delta_bytes);
+        if (perf_counters_enabled) {
+            for (int c = 0; c < PROFILE_COUNTERS; c++) {
+                fprintf(file, ", \"%s\": %llu", profile_counter_names[c], (unsigned long long)stage->counters[c]);
+            }
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n  ],\n");
+
+    SDL_AtomicLock(&mem_lock);
+    fprintf(file, "  \"memory\": {\"current_bytes\": %llu, \"peak_bytes\": %llu, \"subsystems\": [",
+            (unsigned long long)mem_total, (unsigned long long)mem_total_peak);
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"current_bytes\": %llu, \"peak_bytes\": %llu, \"allocations\": %llu}",
+                i ? "," : "", mem_subsystem_names[i], (unsigned long long)mem_current[i],
+                (unsigned long long)mem_peak[i], (unsigned long long)mem_allocations[i]);
+    }
+    SDL_AtomicUnlock(&mem_lock);
+    fprintf(file, "\n  ]}\n}\n");
+    SDL_UnlockMutex(profile_mutex);
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        log_error("Failed to write profile summary %s", filename);
+    }
+    return ok;
+}
+
+bool write_chrome_trace(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        log_error("Failed to open trace file %s", filename);
+        return false;
+    }
+
+    int pid = (int)getpid();
+    SDL_LockMutex(profile_mutex);
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (int i = 0; i < profile_thread_count; i++) {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                i ? ",\n" : "", pid, i, profile_threads[i].name);
+    }
+    for (int i = 0; i < profile_event_count; i++) {
+        const ProfileEvent* event = &profile_events[i];
+        fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"pipeline\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                event->name, pid, event->thread, event->start_ns / 1000.0, event->duration_ns / 1000.0);
+        fprintf(file, ", \"args\": {\"peak_bytes\": %llu", (unsigned long long)event->peak_bytes);
+        if (perf_counters_enabled) {
+            fprintf(file, ", \"%s\": %llu, \"%s\": %llu",
+                    profile_counter_names[0], (unsigned long long)event->counters[0],
+                    profile_counter_names[1], (unsigned long long)event->counters[1]);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n]}\n");
+    SDL_UnlockMutex(profile_mutex);
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        log_error("Failed to write trace file %s", filename);
+    } else {
+        log_info("Wrote %d trace events to %s", profile_event_count, filename);
+    }
+    return ok;
+}
+
+void mem_update(MemSubsystem subsystem, int64_t delta) {
+    SDL_AtomicLock(&mem_lock);
+    mem_current[subsystem] += (uint64_t)delta;
+    mem_total += (uint64_t)delta;
+    if (delta > 0) {
+        mem_allocations[subsystem]++;
+        if (mem_current[subsystem] > mem_peak[subsystem]) mem_peak[subsystem] = mem_current[subsystem];
+        if (mem_total > mem_total_peak) mem_total_peak = mem_total;
+    }
+    SDL_AtomicUnlock(&mem_lock);
+
+    MemThread* thread = mem_current_thread();
+    if (!thread) return;
+    thread->total += delta;
+    if (delta > 0) {
+        for (int i = 0; i < thread->watch_limit; i++) {
+            if (thread->watch_used[i] && thread->total > thread->watch_peak[i]) thread->watch_peak[i] = thread->total;
+        }
+    }
+}
+
+/* The calling thread's watches, created on first use; NULL before main sets up the TLS slot. */
+MemThread* mem_current_thread() {
+    if (!mem_thread_tls) return NULL;
+
+    MemThread* thread = SDL_TLSGet(mem_thread_tls);
+    if (!thread) {
+        thread = calloc(1, sizeof(MemThread));
+        if (thread) SDL_TLSSet(mem_thread_tls, thread, free);
+    }
+    return thread;
+}
+
+void* mem_alloc(MemSubsystem subsystem, size_t size) {
+    MemHeader* header = malloc(sizeof(MemHeader) + size);
+    if (!header) return NULL;
+
+    header->size = size;
+    header->subsystem = subsystem;
+    mem_update(subsystem, (int64_t)size);
+    return header + 1;
+}
+
+void* mem_calloc(MemSubsystem subsystem, size_t count, size_t size) {
+    if (size && count > (SIZE_MAX - sizeof(MemHeader)) / size) return NULL;
+
+    MemHeader* header = calloc(1, sizeof(MemHeader) + count * size);
+    if (!header) return NULL;
+
+    header->size = count * size;
+    header->subsystem = subsystem;
+    mem_update(subsystem, (int64_t)header->size);
+    return header + 1;
+}
+
+void mem_free(void* ptr) {
+    if (!ptr) return;
+
+    MemHeader* header = (MemHeader*)ptr - 1;
+    mem_update((MemSubsystem)header->subsystem, -(int64_t)header->size);
+    free(header);
+}
+
+void* mem_realloc(MemSubsystem subsystem, void* ptr, size_t size) {
+    if (size > SIZE_MAX - sizeof(MemHeader)) return NULL;
+
+    MemHeader* header = ptr ? (MemHeader*)ptr - 1 : NULL;
+    size_t old_size = header ? header->size : 0;
+    header = realloc(header, sizeof(MemHeader) + size);
+    if (!header) return NULL;
+
+    header->size = size;
+    header->subsystem = subsystem;
+    mem_update(subsystem, (int64_t)size - (int64_t)old_size);
+    return header + 1;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk* chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (arena->spare && arena->spare->size >= size) {
+            chunk = arena->spare;
+            arena->spare = chunk->next;
+        } else {
+            size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            chunk = mem_alloc(MEM_ARENA, ARENA_HEADER + capacity);
+            if (!chunk) return NULL;
+            chunk->size = capacity;
+            arena->reserved += ARENA_HEADER + capacity;
+        }
+
+        chunk->next = arena->head;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+
+    void* ptr = (unsigned char*)chunk + ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/* Empties the arena but keeps its chunks on the spare list for the next map. */
+void arena_reset(Arena* arena) {
+    while (arena->head) {
+        ArenaChunk* chunk = arena->head;
+        arena->head = chunk->next;
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+    }
+}
+
+void arena_release(Arena* arena) {
+    arena_reset(arena);
+    ArenaChunk* chunk = arena->spare;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        mem_free(chunk);
+        chunk = next;
+    }
+    arena->spare = NULL;
+    arena->reserved = 0;
+}
+
+SDL_Surface* mem_track_surface(MemSubsystem subsystem, SDL_Surface* surface) {
+    if (surface) {
+        mem_update(subsystem, (int64_t)surface->h * surface->pitch);
+    }
+    return surface;
+}
+
+void mem_free_surface(MemSubsystem subsystem, SDL_Surface* surface) {
+    if (!surface) return;
+
+    mem_update(subsystem, -(int64_t)surface->h * surface->pitch);
+    SDL_FreeSurface(surface);
+}
+
+/*
+ * Starts a watch on the calling thread and stores the tracked total in
+ * current. mem_watch_end returns that total plus the most this thread
+ * added on top of it while the watch ran.
+ */
+int mem_watch_begin(uint64_t* current) {
+    SDL_AtomicLock(&mem_lock);
+    *current = mem_total;
+    SDL_AtomicUnlock(&mem_lock);
+
+    MemThread* thread = mem_current_thread();
+    if (!thread) return -1;
+    for (int i = 0; i < MEM_MAX_WATCHES; i++) {
+        if (!thread->watch_used[i]) {
+            thread->watch_used[i] = true;
+            thread->watch_start[i] = thread->total;
+            thread->watch_peak[i] = thread->total;
+            thread->watch_base[i] = *current;
+            if (i >= thread->watch_limit) thread->watch_limit = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint64_t mem_watch_end(int watch) {
+    MemThread* thread = mem_current_thread();
+    if (watch < 0 || !thread) return 0;
+
+    uint64_t peak = thread->watch_base[watch] + (uint64_t)(thread->watch_peak[watch] - thread->watch_start[watch]);
+    thread->watch_used[watch] = false;
+    while (thread->watch_limit > 0 && !thread->watch_used[thread->watch_limit - 1]) {
+        thread->watch_limit--;
+    }
+    return peak;
+}
+
+void report_memory(FILE* file) {
+    uint64_t current[MEM_SUBSYSTEMS], peak[MEM_SUBSYSTEMS];
+
+    SDL_AtomicLock(&mem_lock);
+    memcpy(current, mem_current, sizeof(current));
+    memcpy(peak, mem_peak, sizeof(peak));
+    uint64_t total = mem_total, total_peak = mem_total_peak;
+    SDL_AtomicUnlock(&mem_lock);
+
+    if (file) {
+        fprintf(file, "Tracked memory: %.1f MB now, %.1f MB peak\n", total / 1048576.0, total_peak / 1048576.0);
+    } else {
+        log_info("Tracked memory: %.1f MB now, %.1f MB peak", total / 1048576.0, total_peak / 1048576.0);
+    }
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        if (peak[i] == 0) continue;
+        if (file) {
+            fprintf(file, "  %-16s %10.1f MB now %10.1f MB peak\n", mem_subsystem_names[i], current[i] / 1048576.0, peak[i] / 1048576.0);
+        } else {
+            log_info("  %-16s %10.1f MB now %10.1f MB peak", mem_subsystem_names[i], current[i] / 1048576.0, peak[i] / 1048576.0);
+        }
+    }
+}
+
+void cleanup() {
+    stop_map_loader();
+    stop_background_loader();
+    clear_color_log();
+    reset_tile_view();
+
+    free_map(&current_map);
+
+    if (font) {
+        TTF_CloseFont(font);
+    }
+
+    if (m_m_bg) {
+        SDL_DestroyTexture(m_m_bg);
+    }
+
+    if (set_bg) {
+        SDL_DestroyTexture(set_bg);
+    }
+
+    if (renderer) {
+        SDL_DestroyRenderer(renderer);
+    }
+
+    if (window) {
+        SDL_DestroyWindow(window);
+    }
+
+    TTF_Quit();
+    IMG_Quit();
+    SDL_Quit();
+}
+
+bool load_map_files() {
+
+    const char* test_files[] = {
+        "maps/map1.bmp", "maps/map2.bmp", "maps/map3.bmp",
+        "maps/map4.bmp", "maps/map5.bmp", "maps/map6.bmp",
+        "maps/map7.bmp", "maps/map8.bmp", "maps/map9.bmp",
+        "maps/map10.bmp", "maps/map11.bmp", "maps/map12.bmp",
+        "maps/map13.bmp", "maps/map14.bmp", "maps/map15.bmp",
+        "maps/map16.bmp", "maps/map17.bmp", "maps/map18.bmp",
+        "maps/map19.bmp", "maps/map20.bmp", "maps/map21.bmp",
+        "maps/map22.bmp", "maps/map23.bmp", "maps/map24.bmp",
+        "maps/map25.bmp", "maps/map26.bmp", "maps/map27.bmp",
+        "maps/map28.bmp", "maps/map29.bmp", "maps/map30.bmp"
+    };
+
+    total_maps = sizeof(test_files) / sizeof(test_files[0]);
+    for (int i = 0; i < total_maps; i++) {
+        strcpy(map_files[i], test_files[i]);
+    }
+
+    return true;
+}
+
+bool load_map(const char* filename) {
+    log_info("Loading map: %s", filename);
+
+    free_map(&current_map);
+    bool loaded = process_map(&current_map, filename, NULL);
+    color_used_final = current_map.colors_used;
+    reset_tile_view();
+    return loaded;
+}
+
+void free_map(Map* map) {
+    if (map->surface) {
+        mem_free_surface(MEM_SURFACE, map->surface);
+        map->surface = NULL;
+    }
+    if (map->original_surface) {
+        mem_free_surface(MEM_ORIGINAL_SURFACE, map->original_surface);
+        map->original_surface = NULL;
+    }
+    if (map->regions) {
+        mem_free(map->regions);
+        map->regions = NULL;
+    }
+    arena_release(&map->arena);
+    if (map->reg_map) {
+        mem_free(map->reg_map);
+        map->reg_map = NULL;
+    }
+    mem_free(map->chain_queue);
+    mem_free(map->in_chain);
+
+    memset(map, 0, sizeof(Map));
+}
+
+bool process_map(Map* map, const char* filename, SDL_atomic_t* progress) {
+    map->progress = progress;
+
+    if (is_map_export(filename)) {
+        ProfileScope export_scope = profile_begin("load_export");
+        bool loaded = load_map_export(map, filename);
+        profile_end(&export_scope);
+        return loaded;
+    }
+
+    char cache_path[512];
+    ProfileScope key_scope = profile_begin("cache_key");
+    bool cacheable = cache_enabled && map_cache_key(filename, map_options_of(map), cache_path, sizeof(cache_path));
+    profile_end(&key_scope);
+
+    ProfileScope decode_scope = profile_begin("decode");
+    bool decoded = decode_map(map, filename);
+    profile_end(&decode_scope);
+    if (!decoded) {
+        return false;
+    }
+
+    return segment_map(map, cacheable ? cache_path : NULL);
+}
+
+bool process_map_buffer(Map* map, const void* data, size_t size) {
+    char cache_path[512];
+    ProfileScope key_scope = profile_begin("cache_key");
+    bool cacheable = cache_enabled && map_cache_key_data(data, size, map_options_of(map), cache_path, sizeof(cache_path));
+    profile_end(&key_scope);
+
+    ProfileScope decode_scope = profile_begin("decode");
+    bool decoded = decode_map_buffer(map, data, size);
+    profile_end(&decode_scope);
+    if (!decoded) {
+        return false;
+    }
+
+    return segment_map(map, cacheable ? cache_path : NULL);
+}
+
+bool decode_map(Map* map, const char* filename) {
+    return init_map_surfaces(map, decode_image(filename));
+}
+
+/* Decodes filename in whatever format the decoder produces; init_map_surfaces converts it. */
+SDL_Surface* decode_image(const char* filename) {
+    SDL_Surface* loaded_surface = NULL;
+    init_image_decoders();
+    loaded_surface = mem_track_surface(MEM_DECODE, IMG_Load(filename));
+    
+    if (!loaded_surface) {
+        log_warn("SDL_image failed: %s. Attempting to load as BMP via SDL_LoadBMP: %s", IMG_GetError(), filename);
+        loaded_surface = mem_track_surface(MEM_DECODE, SDL_LoadBMP(filename));
+        if (loaded_surface) {
+            log_debug("Image loaded successfully as BMP");
+        }
+    }
+
+    return loaded_surface;
+}
+
+/* Same as decode_map for an image held in memory, such as one sent to the daemon. */
+bool decode_map_buffer(Map* map, const void* data, size_t size) {
+    if (size > INT_MAX) return false;
+
+    init_image_decoders();
+    SDL_Surface* loaded_surface = mem_track_surface(MEM_DECODE, IMG_Load_RW(SDL_RWFromConstMem(data, (int)size), 1));
+    if (!loaded_surface) {
+        log_warn("SDL_image failed: %s. Attempting to load the buffer as BMP", IMG_GetError());
+        loaded_surface = mem_track_surface(MEM_DECODE, SDL_LoadBMP_RW(SDL_RWFromConstMem(data, (int)size), 1));
+    }
+
+    return init_map_surfaces(map, loaded_surface);
+}
+
+/* Converts a decoded image to ARGB8888 and keeps an untouched copy for resets. */
+bool init_map_surfaces(Map* map, SDL_Surface* loaded_surface) {
+    if (!loaded_surface) {
+        log_error("Failed to create or load any surface!");
+        return false;
+    }
+
+    map->surface = mem_track_surface(MEM_SURFACE, SDL_ConvertSurfaceFormat(loaded_surface, SDL_PIXELFORMAT_ARGB8888, 0));
+    mem_free_surface(MEM_DECODE, loaded_surface);
+    if (!map->surface) {
+        log_error("Failed to convert loaded surface to ARGB8888! SDL Error: %s", SDL_GetError());
+        return false;
+    }
+
+    map->original_surface = mem_track_surface(MEM_ORIGINAL_SURFACE, SDL_ConvertSurface(map->surface, map->surface->format, 0));
+    if (!map->original_surface) {
+        log_error("Failed to create original_surface copy! SDL Error: %s", SDL_GetError());
+        mem_free_surface(MEM_SURFACE, map->surface);
+        map->surface = NULL;
+        return false;
+    }
+
+    map->width = map->surface->w;
+    map->height = map->surface->h;
+    map->pixels = (unsigned int*)map->surface->pixels;
+    if (map->progress) SDL_AtomicSet(map->progress, 20);
+
+    return true;
+}
+
+bool segment_map(Map* map, const char* cache_path) {
+    if (cache_path && access(cache_path, R_OK) == 0) {
+        ProfileScope cache_scope = profile_begin("cache_load");
+        bool hit = read_map_export(map, cache_path, false);
+        profile_end(&cache_scope);
+        if (hit) {
+            utimensat(AT_FDCWD, cache_path, NULL, 0);
+            log_info("Cache hit: %s", cache_path);
+            paint_cleared_ink(map);
+            return true;
+        }
+        log_warn("Removing unreadable cache entry %s", cache_path);
+        remove(cache_path);
+    }
+
+    map->reg_map = mem_alloc(MEM_REG_MAP, (size_t)map->width * map->height * sizeof(int));
+    if (!map->reg_map) {
+        log_error("Failed to allocate memory for reg_map! Map dimensions: %dx%d", map->width, map->height);
+        if (map->surface) {
+            mem_free_surface(MEM_SURFACE, map->surface);
+            map->surface = NULL;
+        }
+        if (map->original_surface) {
+            mem_free_surface(MEM_ORIGINAL_SURFACE, map->original_surface);
+            map->original_surface = NULL;
+        }
+        return false;
+    }
+    
+    for (int i = 0; i < map->width * map->height; i++) {
+        map->reg_map[i] = -1;
+    }
+
+    map->regions = mem_calloc(MEM_REGIONS, MAX_REGIONS, sizeof(Region));
+    if (!map->regions) {
+        log_error("Failed to allocate memory for regions!");
+        if (map->surface) {
+            mem_free_surface(MEM_SURFACE, map->surface);
+            map->surface = NULL;
+        }
+        if (map->original_surface) {
+            mem_free_surface(MEM_ORIGINAL_SURFACE, map->original_surface);
+            map->original_surface = NULL;
+        }
+        if (map->reg_map) {
+            mem_free(map->reg_map);
+            map->reg_map = NULL;
+        }
+        return false;
+    }
+
+    if (map_options_of(map)->ink_close_radius > 0) {
+        ProfileScope close_scope = profile_begin("close_ink");
+        close_ink_mask(map);
+        profile_end(&close_scope);
+    }
+
+    ProfileScope regions_scope = profile_begin("find_regions");
+    bool found = find_regions(map);
+    profile_end(&regions_scope);
+    if (!found) {
+        log_error("Segmentation ran out of memory, the map is not loaded");
+        free_map(map);
+        return false;
+    }
+    log_info("Found %d regions", map->reg_count);
+    
+    ProfileScope adjacency_scope = profile_begin("build_adjacency");
+    build_adjacency_graph(map);
+    profile_end(&adjacency_scope);
+    paint_cleared_ink(map);
+
+    if (cache_path) {
+        ProfileScope store_scope = profile_begin("cache_store");
+        map_cache_store(map, cache_path);
+        profile_end(&store_scope);
+    }
+
+    if (map->progress) SDL_AtomicSet(map->progress, 100);
+
+    return true;
+}
+
+void reset_map_colors() {
+    if (current_map.original_surface && current_map.surface) {
+        SDL_BlitSurface(current_map.original_surface, NULL, current_map.surface, NULL);
+        
+        for (int i = 0; i < current_map.reg_count; i++) {
+            current_map.regions[i].color = -1;
+            current_map.regions[i].is_colored = false;
+        }
+        mark_tiles_dirty(0, 0, current_map.width, current_map.height);
+    }
+
+    color_used_final = 0;
+}
+
+/*
+ * Colors every region at full speed without painting, logging each color
+ * change, then leaves the map uncolored for the replay to paint. Returns
+ * the number of colors used.
+ */
+int record_coloring() {
+    ProfileScope scope = profile_begin("coloring");
+    clear_color_log();
+    color_log.regions = current_map.regions;
+    color_log.reg_count = current_map.reg_count;
+
+    uint64_t start = now_ns();
+    int max_color = -1;
+    color_log_recording = true;
+    for (int i = 0; i < current_map.reg_count; i++) {
+        int chosen_color = pick_region_color(&current_map, i);
+        if (chosen_color > max_color) {
+            max_color = chosen_color;
+        }
+    }
+    color_log_recording = false;
+    color_log.compute_ns = now_ns() - start;
+    color_log.colors_used = max_color + 1;
+
+    for (int i = 0; i < current_map.reg_count; i++) {
+        current_map.regions[i].color = -1;
+        current_map.regions[i].is_colored = false;
+    }
+    if (!build_color_checkpoints()) {
+        clear_color_log();
+    }
+    profile_end(&scope);
+
+    return max_color + 1;
+}
+
+void record_color_event(int region_id, int previous, int color) {
+    if (color_log.count == color_log.capacity) {
+        int capacity = color_log.capacity ? color_log.capacity * 2 : STACK_INITIAL_CAPACITY;
+        ColorEvent* events = mem_realloc(MEM_REPLAY, color_log.events, (size_t)capacity * sizeof(ColorEvent));
+        if (!events) {
+            log_error("Failed to grow the coloring log, the replay will stop early");
+            return;
+        }
+        color_log.events = events;
+        color_log.capacity = capacity;
+    }
+
+    ColorEvent* event = &color_log.events[color_log.count++];
+    event->region = region_id;
+    event->color = (int16_t)color;
+    event->previous = (int16_t)previous;
+}
+
+/*
+ * Snapshots of every region's color after 0, K, 2K, ... events, so a seek
+ * replays at most K events. K starts at REPLAY_CHECKPOINT_INTERVAL and grows
+ * on long logs so there are never more than REPLAY_MAX_CHECKPOINTS, which
+ * keeps the memory at a fixed number of copies of the region colors.
+ */
+bool build_color_checkpoints() {
+    int reg_count = color_log.reg_count;
+    int interval = SDL_max(REPLAY_CHECKPOINT_INTERVAL, (color_log.count + REPLAY_MAX_CHECKPOINTS - 2) / (REPLAY_MAX_CHECKPOINTS - 1));
+    int count = color_log.count / interval + 1;
+    int16_t* checkpoints = mem_alloc(MEM_REPLAY, ((size_t)count * reg_count + 1) * sizeof(int16_t));
+    int16_t* painted = mem_alloc(MEM_REPLAY, (size_t)(reg_count + 1) * sizeof(int16_t));
+    if (!checkpoints || !painted) {
+        log_error("Failed to allocate replay checkpoints!");
+        mem_free(checkpoints);
+        mem_free(painted);
+        return false;
+    }
+
+    /* painted doubles as the running state here; nothing is on screen yet. */
+    for (int i = 0; i < reg_count; i++) painted[i] = -1;
+    for (int e = 0; e <= color_log.count; e++) {
+        if (e % interval == 0) {
+            memcpy(checkpoints + (size_t)(e / interval) * reg_count, painted, (size_t)reg_count * sizeof(int16_t));
+        }
+        if (e < color_log.count) {
+            painted[color_log.events[e].region] = color_log.events[e].color;
+        }
+    }
+
+    color_log.checkpoints = checkpoints;
+    color_log.checkpoint_count = count;
+    color_log.checkpoint_interval = interval;
+    color_log.painted = painted;
+    for (int i = 0; i < reg_count; i++) painted[i] = -1;
+    color_log.position = 0;
+    return true;
+}
+
+void clear_color_log() {
+    mem_free(color_log.events);
+    mem_free(color_log.checkpoints);
+    mem_free(color_log.painted);
+    memset(&color_log, 0, sizeof(color_log));
+    replay_paused = false;
+}
+
+/* The log belongs to the map on screen until the map is switched or edited. */
+bool color_log_valid() {
+    return color_log.checkpoints && color_log.regions == current_map.regions && color_log.reg_count == current_map.reg_count;
+}
+
+void show_region_color(int region_id, int color) {
+    Region* region = &current_map.regions[region_id];
+    region->color = color;
+    region->is_colored = color >= 0;
+    color_log.painted[region_id] = (int16_t)color;
+    if (color >= 0) {
+        color_region_pixels(&current_map, region_id, map_options.palette.colors[color]);
+    } else {
+        restore_region_pixels(region_id);
+    }
+}
+
+/*
+ * Brings the map to the state after `target` events. Short forward steps
+ * apply the events in between; anything else starts from the checkpoint
+ * below the target and repaints only the regions whose color differs.
+ */
+void seek_replay(int target) {
+    if (!color_log_valid()) return;
+    if (target < 0) target = 0;
+    if (target > color_log.count) target = color_log.count;
+
+    ProfileScope scope = profile_begin("paint");
+    if (target >= color_log.position && target - color_log.position <= color_log.checkpoint_interval) {
+        for (int e = color_log.position; e < target; e++) {
+            show_region_color(color_log.events[e].region, color_log.events[e].color);
+        }
+    } else {
+        int reg_count = color_log.reg_count;
+        int checkpoint = target / color_log.checkpoint_interval;
+        int16_t* state = color_log.checkpoints + (size_t)checkpoint * reg_count;
+        int16_t* wanted = mem_alloc(MEM_REPLAY, (size_t)(reg_count + 1) * sizeof(int16_t));
+        if (!wanted) {
+            profile_end(&scope);
+            return;
+        }
+
+        memcpy(wanted, state, (size_t)reg_count * sizeof(int16_t));
+        for (int e = checkpoint * color_log.checkpoint_interval; e < target; e++) {
+            wanted[color_log.events[e].region] = color_log.events[e].color;
+        }
+        for (int i = 0; i < reg_count; i++) {
+            if (wanted[i] != color_log.painted[i]) show_region_color(i, wanted[i]);
+        }
+        mem_free(wanted);
+    }
+    profile_end(&scope);
+
+    color_log.position = target;
+    replay_origin_ns = now_ns();
+    replay_origin_position = target;
+}
+
+void start_replay() {
+    color_log.position = 0;
+    replay_paused = false;
+    replay_origin_ns = now_ns();
+    replay_origin_position = 0;
+}
+
+void pause_replay(bool paused) {
+    replay_paused = paused;
+    replay_origin_ns = now_ns();
+    replay_origin_position = color_log.position;
+}
+
+/* Events per second: slow enough to watch on small maps, bounded in time on large ones, times the chosen speed. */
+double coloring_rate() {
+    return SDL_max(COLORING_MIN_RATE, color_log.count * 1000.0 / COLORING_TARGET_MS) * replay_speed;
+}
+
+/*
+ * Plays the events that are due by now, but stops after FRAME_BUDGET_NS so
+ * the frame can still be drawn. Returns false once the last event is shown.
+ */
+bool advance_replay() {
+    if (!color_log_valid()) return false;
+    if (replay_paused) return true;
+
+    uint64_t now = now_ns();
+    uint64_t deadline = now + FRAME_BUDGET_NS;
+    double due = replay_origin_position + (now - replay_origin_ns) / 1e9 * coloring_rate() + 1;
+
+    ProfileScope scope = profile_begin("paint");
+    while (color_log.position < due && color_log.position < color_log.count) {
+        const ColorEvent* event = &color_log.events[color_log.position++];
+        show_region_color(event->region, event->color);
+        if (now_ns() >= deadline) break;
+    }
+    profile_end(&scope);
+    return color_log.position < color_log.count;
+}
+
+/* Milliseconds until the next event is due, 0 when the replay is behind and -1 while paused. */
+int replay_wait_ms() {
+    if (replay_paused) return -1;
+    double next_ms = (color_log.position - replay_origin_position) * 1000.0 / coloring_rate();
+    double elapsed_ms = (now_ns() - replay_origin_ns) / 1e6;
+    return next_ms > elapsed_ms ? (int)ceil(next_ms - elapsed_ms) : 0;
+}
+
+/*
+ * Coloring log file (.clog): ColorLogHeader, the palette as ARGB words,
+ * then ColorEvent[event_count]. The header holds map_label_hash of the map
+ * the log was recorded on. Checkpoints are rebuilt on load.
+ */
+bool save_color_log(const char* filename) {
+    if (!color_log_valid()) {
+        log_error("No recorded coloring for this map, nothing to save");
+        return false;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        log_error("Failed to open coloring log %s", filename);
+        return false;
+    }
+
+    ColorLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COLOR_LOG_MAGIC, 4);
+    header.version = COLOR_LOG_VERSION;
+    header.reg_count = color_log.reg_count;
+    header.event_count = color_log.count;
+    header.colors_used = color_log.colors_used;
+    const Palette* palette = &map_options.palette;
+    header.palette_size = palette->size;
+    header.compute_ns = color_log.compute_ns;
+    header.map_hash = map_label_hash(&current_map);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < palette->size && ok; i++) {
+        const SDL_Color* c = &palette->colors[i];
+        uint32_t argb = 0xFF000000u | ((uint32_t)c->r << 16) | ((uint32_t)c->g << 8) | c->b;
+        ok = fwrite(&argb, sizeof(argb), 1, file) == 1;
+    }
+    ok = ok && fwrite(color_log.events, sizeof(ColorEvent), (size_t)color_log.count, file) == (size_t)color_log.count;
+    if (fclose(file) != 0) ok = false;
+
+    if (!ok) {
+        log_error("Failed to write coloring log %s", filename);
+        remove(filename);
+        return false;
+    }
+    log_info("Saved %d coloring events for %d regions to %s", color_log.count, color_log.reg_count, filename);
+    return true;
+}
+
+/*
+ * Loads a log recorded on the current map, ready to replay from the start.
+ * The log's palette is used unless one was given with --palette, in which
+ * case the log has to fit in it.
+ */
+bool load_color_log(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        log_error("Failed to open coloring log %s", filename);
+        return false;
+    }
+
+    ColorLogHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, COLOR_LOG_MAGIC, 4) == 0 &&
+              header.version == COLOR_LOG_VERSION && header.event_count >= 0 &&
+              header.palette_size > 0 && header.palette_size <= MAX_COLORS;
+    if (ok && (header.reg_count != current_map.reg_count || header.map_hash != map_label_hash(&current_map))) {
+        log_error("Coloring log %s was recorded on another map (%d regions, the map has %d)", filename, header.reg_count,
+                  current_map.reg_count);
+        fclose(file);
+        return false;
+    }
+    if (ok && palette_filename && header.colors_used > map_options.palette.size) {
+        log_error("Coloring log %s uses %d colors, the palette from %s has %d", filename, header.colors_used,
+                  palette_filename, map_options.palette.size);
+        fclose(file);
+        return false;
+    }
+
+    uint32_t palette[MAX_COLORS];
+    ok = ok && fread(palette, sizeof(uint32_t), (size_t)header.palette_size, file) == (size_t)header.palette_size;
+    clear_color_log();
+    ColorEvent* events = ok ? mem_alloc(MEM_REPLAY, ((size_t)header.event_count + 1) * sizeof(ColorEvent)) : NULL;
+    ok = events && fread(events, sizeof(ColorEvent), (size_t)header.event_count, file) == (size_t)header.event_count;
+    fclose(file);
+
+    int palette_size = palette_filename ? map_options.palette.size : header.palette_size;
+    for (int e = 0; ok && e < header.event_count; e++) {
+        ok = events[e].region >= 0 && events[e].region < header.reg_count &&
+             events[e].color >= -1 && events[e].color < palette_size;
+    }
+    if (!ok) {
+        log_error("Coloring log %s is damaged or from another version", filename);
+        mem_free(events);
+        return false;
+    }
+
+    for (int i = 0; i < header.palette_size && !palette_filename; i++) {
+        SDL_Color* c = &map_options.palette.colors[i];
+        c->r = (Uint8)(palette[i] >> 16);
+        c->g = (Uint8)(palette[i] >> 8);
+        c->b = (Uint8)palette[i];
+        c->a = 255;
+    }
+    if (!palette_filename) set_palette_size(&map_options.palette, header.palette_size);
+
+    color_log.events = events;
+    color_log.count = color_log.capacity = header.event_count;
+    color_log.regions = current_map.regions;
+    color_log.reg_count = header.reg_count;
+    color_log.colors_used = header.colors_used;
+    color_log.compute_ns = header.compute_ns;
+    if (!build_color_checkpoints()) {
+        clear_color_log();
+        return false;
+    }
+    log_info("Loaded %d coloring events from %s", header.event_count, filename);
+    return true;
+}
+
+bool is_black_pixel(const Map* map, unsigned int pixel) {//--------new
+    SDL_Color color;
+    SDL_GetRGB(pixel, map->surface->format, &color.r, &color.g, &color.b);
+    int brightness = (color.r + color.g + color.b) / 3;
+    return brightness < INK_THRESHOLD;
+}
+
+bool find_regions(Map* map) {
+    log_debug("Map dimensions: %dx%d", map->width, map->height);
+
+    unsigned int* visited = mem_calloc(MEM_VISITED, (size_t)map->width * map->height, sizeof(unsigned int));
+    if (!visited) {
+        log_error("Failed to allocate memory for visited array!");
+        return false;
+    }
+
+    const MapOptions* options = map_options_of(map);
+    unsigned char* links = NULL;
+    if (options->color_tolerance >= 0) {
+        ProfileScope links_scope = profile_begin("color_links");
+        links = build_color_links(map);
+        profile_end(&links_scope);
+        if (!links) {
+            mem_free(visited);
+            return false;
+        }
+    }
+
+    PixelStack stack = {NULL, 0, 0};
+    PixelStack specks = {NULL, 0, 0};
+    bool ok = true;
+    int scale = SDL_max(map->preview_scale, 1);
+    int min_area = options->min_region_area / (scale * scale);
+    map->reg_count = 0;
+
+    for (int y = 0; ok && y < map->height && map->reg_count < MAX_REGIONS; y++) {
+        if (map->progress && (y & 63) == 0) {
+            SDL_AtomicSet(map->progress, 20 + 50 * y / map->height);
+        }
+        for (int x = 0; ok && x < map->width && map->reg_count < MAX_REGIONS; x++) {
+            int index = y * map->width + x;
+
+            bool ink = links ? (links[index] & LINK_INK) != 0 : is_black_pixel(map, map->pixels[index]);
+            if (!visited[index] && !ink) {
+
+                int region_id = map->reg_count;
+
+                map->regions[region_id].id = region_id;
+                map->regions[region_id].color = -1;
+                map->regions[region_id].is_colored = false;
+
+                map->regions[region_id].neighbors = NULL;
+
+                map->regions[region_id].pixel_count = 0;
+                map->regions[region_id].min_x = x;
+                map->regions[region_id].max_x = x;
+                map->regions[region_id].min_y = y;
+                map->regions[region_id].max_y = y;
+
+                if (links) {
+                    ok = flood_fill_links(map, x, y, region_id, visited, links, &stack);
+                } else {
+                    ok = flood_fill_iterative(map, x, y, region_id, visited, &stack);
+                }
+                if (!ok) break;
+
+                /* Specks give their slot back and are merged once every real region is known. */
+                const Region* region = &map->regions[region_id];
+                if (region->pixel_count < min_area) {
+                    for (int py = region->min_y; py <= region->max_y; py++) {
+                        int* row = map->reg_map + (size_t)py * map->width;
+                        for (int px = region->min_x; px <= region->max_x; px++) {
+                            if (row[px] == region_id) row[px] = REGION_SPECK;
+                        }
+                    }
+                    ok = stack_push(&specks, x, y);
+                    continue;
+                }
+
+                map->reg_count++;
+            }
+        }
+    }
+
+    mem_free(stack.items);
+    mem_free(links);
+    mem_free(visited);
+
+    if (ok && specks.count > 0) {
+        ProfileScope merge_scope = profile_begin("merge_small");
+        ok = merge_small_regions(map, &specks);
+        profile_end(&merge_scope);
+    }
+    mem_free(specks.items);
+    return ok;
+}
+
+/*
+ * Links for color-distance segmentation: LINK_RIGHT and LINK_DOWN when that
+ * neighbor is within color_tolerance, LINK_INK where the ink rule still draws
+ * a border. Links into ink are dropped, so the fill only follows the bits.
+ */
+unsigned char* build_color_links(const Map* map) {
+    const int width = map->width, height = map->height;
+    const int tolerance = map_options_of(map)->color_tolerance;
+    unsigned char* links = mem_alloc(MEM_SEGMENT, (size_t)width * height);
+    if (!links) {
+        log_error("Failed to allocate memory for the color links!");
+        return NULL;
+    }
+
+    for (int y = 0; y < height; y++) {
+        mark_ink_row(map->pixels + (size_t)y * width, links + (size_t)y * width, width);
+    }
+    for (int y = 0; y < height; y++) {
+        const unsigned int* row = map->pixels + (size_t)y * width;
+        unsigned char* out = links + (size_t)y * width;
+        const unsigned char* below = y + 1 < height ? out + width : NULL;
+        color_join_row(row, row + 1, out, width - 1, LINK_RIGHT, tolerance);
+        if (below) color_join_row(row, row + width, out, width, LINK_DOWN, tolerance);
+
+        for (int x = 0; x < width; x++) {
+            if (out[x] & LINK_INK) {
+                out[x] = LINK_INK;
+                continue;
+            }
+            if (x + 1 < width && (out[x + 1] & LINK_INK)) out[x] &= ~LINK_RIGHT;
+            if (below && (below[x] & LINK_INK)) out[x] &= ~LINK_DOWN;
+        }
+    }
+    return links;
+}
+
+/* is_black_pixel for a row of ARGB8888 pixels: (r + g + b) / 3 < INK_THRESHOLD. */
+void mark_ink_row(const unsigned int* row, unsigned char* out, int count) {
+    for (int x = 0; x < count; x++) {
+        unsigned int sum = (row[x] >> 16 & 0xFF) + (row[x] >> 8 & 0xFF) + (row[x] & 0xFF);
+        out[x] = sum < 3 * INK_THRESHOLD ? LINK_INK : 0;
+    }
+}
+
+/*
+ * Sets bit in out[x] when a[x] and b[x] differ by at most tolerance on
+ * each of R, G and B. The SSE2 path compares 16 pixels per step: saturating
+ * subtraction both ways gives the per-byte distance, subtracting the tolerance
+ * leaves only the excess (alpha gets 255, so it never counts), and pixels with
+ * no excess pack down to 0xFF bytes.
+ */
+void color_join_row(const unsigned int* a, const unsigned int* b, unsigned char* out, int count, unsigned char bit, int tolerance) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i limit = _mm_set1_epi32((int)(0xFF000000u | (unsigned int)tolerance * 0x010101u));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bits = _mm_set1_epi8((char)bit);
+    for (; x + 16 <= count; x += 16) {
+        __m128i joined[4];
+        for (int k = 0; k < 4; k++) {
+            __m128i pa = _mm_loadu_si128((const __m128i*)(a + x + 4 * k));
+            __m128i pb = _mm_loadu_si128((const __m128i*)(b + x + 4 * k));
+            __m128i distance = _mm_or_si128(_mm_subs_epu8(pa, pb), _mm_subs_epu8(pb, pa));
+            joined[k] = _mm_cmpeq_epi32(_mm_subs_epu8(distance, limit), zero);
+        }
+        __m128i mask = _mm_packs_epi16(_mm_packs_epi32(joined[0], joined[1]), _mm_packs_epi32(joined[2], joined[3]));
+        __m128i current = _mm_loadu_si128((const __m128i*)(out + x));
+        _mm_storeu_si128((__m128i*)(out + x), _mm_or_si128(current, _mm_and_si128(mask, bits)));
+    }
+#endif
+    for (; x < count; x++) {
+        if (pixels_join(a[x], b[x], tolerance)) out[x] |= bit;
+    }
+}
+
+bool pixels_join(unsigned int a, unsigned int b, int tolerance) {
+    for (int shift = 0; shift < 24; shift += 8) {
+        int difference = (int)(a >> shift & 0xFF) - (int)(b >> shift & 0xFF);
+        if (difference > tolerance || -difference > tolerance) return false;
+    }
+    return true;
+}
+
+/*
+ * Morphological closing of the ink mask: ink is grown by the radius and then
+ * shrunk by it again, which fills white specks and gaps up to about twice the
+ * radius without thinning the borders. Both steps are separable box filters
+ * with running counts, so the cost does not depend on the radius. The new ink
+ * is painted into the surface so every later stage sees it.
+ */
+void close_ink_mask(Map* map) {
+    int scale = SDL_max(map->preview_scale, 1);
+    int radius = map_options_of(map)->ink_close_radius / scale;
+    if (radius < 1) return;
+
+    const int width = map->width, height = map->height;
+    size_t count = (size_t)width * height;
+    unsigned char* mask = mem_alloc(MEM_CLEANUP, count);
+    unsigned char* temp = mem_alloc(MEM_CLEANUP, count);
+    if (!mask || !temp) {
+        log_error("Failed to allocate memory for the ink mask!");
+        mem_free(mask);
+        mem_free(temp);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        mask[i] = is_black_pixel(map, map->pixels[i]);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        bool grow = pass == 0;
+        for (int y = 0; y < height; y++) {
+            filter_mask_line(mask + (size_t)y * width, temp + (size_t)y * width, width, 1, radius, grow);
+        }
+        for (int x = 0; x < width; x++) {
+            filter_mask_line(temp + x, mask + x, height, (size_t)width, radius, grow);
+        }
+    }
+
+    unsigned int black = SDL_MapRGB(map->surface->format, 0, 0, 0);
+    int filled = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (mask[i] && !is_black_pixel(map, map->pixels[i])) {
+            map->pixels[i] = black;
+            filled++;
+        }
+    }
+    mem_free(mask);
+    mem_free(temp);
+    log_info("Closing the ink with radius %d filled %d pixels", radius, filled);
+}
+
+/* Box max (grow) or min filter over one row or column of the mask; outside pixels are ignored. */
+void filter_mask_line(const unsigned char* in, unsigned char* out, int length, size_t stride, int radius, bool grow) {
+    int count = 0;
+    for (int i = 0; i < radius && i < length; i++) {
+        count += in[(size_t)i * stride];
+    }
+    for (int i = 0; i < length; i++) {
+        if (i + radius < length) count += in[(size_t)(i + radius) * stride];
+        if (i - radius - 1 >= 0) count -= in[(size_t)(i - radius - 1) * stride];
+        int span = SDL_min(i + radius, length - 1) - SDL_max(i - radius, 0) + 1;
+        out[(size_t)i * stride] = grow ? count > 0 : count == span;
+    }
+}
+
+/*
+ * A speck joins the region whose territory shares the longest boundary with
+ * its own, the same test build_adjacency_graph uses for neighbors, so the
+ * merge contracts one edge of the region graph and keeps it planar. The
+ * speck's pixels carry the spare label reg_count while the territories
+ * within 2 * TERRITORY_RADIUS + 1 of it are built. A speck with no
+ * territory neighbor (deep inside a thick border, say) becomes ink.
+ */
+bool merge_small_regions(Map* map, const PixelStack* specks) {
+    const int width = map->width, height = map->height;
+    int* labels = map->reg_map;
+    const int dx[4] = {1, -1, 0, 0};
+    const int dy[4] = {0, 0, 1, -1};
+    const int speck = map->reg_count;
+    const int reach = 2 * TERRITORY_RADIUS + 1;
+    unsigned int black = SDL_MapRGB(map->surface->format, 0, 0, 0);
+    PixelStack component = {NULL, 0, 0};
+    int merged = 0, dissolved = 0;
+
+    for (size_t s = 0; s < specks->count; s++) {
+        int seed_x = specks->items[s].x, seed_y = specks->items[s].y;
+        if (labels[seed_y * width + seed_x] != REGION_SPECK) continue;
+
+        component.count = 0;
+        labels[seed_y * width + seed_x] = speck;
+        if (!stack_push(&component, seed_x, seed_y)) {
+            mem_free(component.items);
+            return false;
+        }
+        int min_x = seed_x, max_x = seed_x, min_y = seed_y, max_y = seed_y;
+        for (size_t i = 0; i < component.count; i++) {
+            int px = component.items[i].x, py = component.items[i].y;
+            min_x = SDL_min(min_x, px);
+            max_x = SDL_max(max_x, px);
+            min_y = SDL_min(min_y, py);
+            max_y = SDL_max(max_y, py);
+            for (int d = 0; d < 4; d++) {
+                int nx = px + dx[d], ny = py + dy[d];
+                if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+                if (labels[ny * width + nx] == REGION_SPECK) {
+                    labels[ny * width + nx] = speck;
+                    if (!stack_push(&component, nx, ny)) {
+                        mem_free(component.items);
+                        return false;
+                    }
+                }
+            }
+        }
+
+        int tx0 = SDL_max(min_x - reach, 0), ty0 = SDL_max(min_y - reach, 0);
+        int tx1 = SDL_min(max_x + 1 + reach, width), ty1 = SDL_min(max_y + 1 + reach, height);
+        int* territory = build_territories(map, tx0, ty0, tx1, ty1);
+        if (!territory) {
+            mem_free(component.items);
+            return false;
+        }
+
+        int candidates[MERGE_MAX_CANDIDATES], votes[MERGE_MAX_CANDIDATES];
+        int candidate_count = 0;
+        int tw = tx1 - tx0, th = ty1 - ty0;
+        for (int y = 0; y < th; y++) {
+            for (int x = 0; x < tw; x++) {
+                int here = territory[y * tw + x];
+                int others[2] = {x + 1 < tw ? territory[y * tw + x + 1] : -1, y + 1 < th ? territory[(y + 1) * tw + x] : -1};
+                for (int k = 0; k < 2; k++) {
+                    int other = here == speck ? others[k] : others[k] == speck ? here : -1;
+                    if (other < 0 || other == speck) continue;
+                    int c = 0;
+                    while (c < candidate_count && candidates[c] != other) c++;
+                    if (c == candidate_count && candidate_count < MERGE_MAX_CANDIDATES) {
+                        candidates[candidate_count] = other;
+                        votes[candidate_count++] = 0;
+                    }
+                    if (c < candidate_count) votes[c]++;
+                }
+            }
+        }
+        mem_free(territory);
+
+        int target = -1;
+        for (int c = 0; c < candidate_count; c++) {
+            if (target < 0 || votes[c] > votes[target]) target = c;
+        }
+        int id = target >= 0 ? candidates[target] : -1;
+        Region* region = id >= 0 ? &map->regions[id] : NULL;
+
+        for (size_t i = 0; i < component.count; i++) {
+            int px = component.items[i].x, py = component.items[i].y;
+            labels[py * width + px] = id;
+            if (region) {
+                if (px < region->min_x) region->min_x = px;
+                if (px > region->max_x) region->max_x = px;
+                if (py < region->min_y) region->min_y = py;
+                if (py > region->max_y) region->max_y = py;
+            } else {
+                map->pixels[py * width + px] = black;
+            }
+        }
+        if (region) {
+            region->pixel_count += (int)component.count;
+            merged++;
+        } else {
+            dissolved++;
+        }
+    }
+
+    mem_free(component.items);
+    log_info("Merged %d small regions into neighbors and %d into the ink", merged, dissolved);
+    return true;
+}
+
+/*
+ * Makes both surfaces agree with the cleanup: unlabeled pixels that are not
+ * dark yet become ink. Cache hits only restore labels, so this runs there too.
+ */
+void paint_cleared_ink(Map* map) {
+    const MapOptions* options = map_options_of(map);
+    if (options->min_region_area <= 0 && options->ink_close_radius <= 0) return;
+    if (!map->reg_map || !map->original_surface) return;
+
+    SDL_Surface* original = map->original_surface;
+    unsigned int black = SDL_MapRGB(map->surface->format, 0, 0, 0);
+    unsigned int original_black = SDL_MapRGB(original->format, 0, 0, 0);
+    for (int y = 0; y < map->height; y++) {
+        unsigned int* row = (unsigned int*)((Uint8*)original->pixels + (size_t)y * original->pitch);
+        for (int x = 0; x < map->width; x++) {
+            int index = y * map->width + x;
+            if (map->reg_map[index] < 0 && !is_black_pixel(map, row[x])) {
+                row[x] = original_black;
+                map->pixels[index] = black;
+            }
+        }
+    }
+}
+
+bool stack_push(PixelStack* stack, int x, int y) {
+    if (stack->count == stack->capacity) {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : STACK_INITIAL_CAPACITY;
+        StackItem* items = mem_realloc(MEM_STACK, stack->items, capacity * sizeof(StackItem));
+        if (!items) {
+            log_error("Failed to grow the flood fill stack to %zu items", capacity);
+            return false;
+        }
+        stack->items = items;
+        stack->capacity = capacity;
+    }
+    stack->items[stack->count].x = x;
+    stack->items[stack->count].y = y;
+    stack->count++;
+    return true;
+}
+
+bool stack_pop(PixelStack* stack, int* x, int* y) {
+    if (stack->count == 0) return false;
+    stack->count--;
+    *x = stack->items[stack->count].x;
+    *y = stack->items[stack->count].y;
+    return true;
+}
+bool flood_fill_iterative(Map* map, int start_x, int start_y, int region_id, unsigned int* visited, PixelStack* stack) {//--------new
+    stack->count = 0;
+    if (!stack_push(stack, start_x, start_y)) return false;
+
+    int pixels_processed = 0;
+
+    int x, y;
+    while (stack_pop(stack, &x, &y)) {
+        if (x < 0 || x >= map->width || y < 0 || y >= map->height) continue;
+
+        int index = y * map->width + x;
+        if (visited[index] || is_black_pixel(map, map->pixels[index])) continue;
+
+        int left = x;
+        while (left >= 0 && !visited[y * map->width + left] && !is_black_pixel(map, map->pixels[y * map->width + left])) {
+            visited[y * map->width + left] = 1;
+            map->reg_map[y * map->width + left] = region_id;
+            map->regions[region_id].pixel_count++;
+            pixels_processed++;
+            left--;
+        }
+        left++;
+
+        int right = x + 1;
+        while (right < map->width && !visited[y * map->width + right] && !is_black_pixel(map, map->pixels[y * map->width + right])) {
+            visited[y * map->width + right] = 1;
+            map->reg_map[y * map->width + right] = region_id;
+            map->regions[region_id].pixel_count++;
+            pixels_processed++;
+            right++;
+        }
+
+        Region* region = &map->regions[region_id];
+        if (left < region->min_x) region->min_x = left;
+        if (right - 1 > region->max_x) region->max_x = right - 1;
+        if (y < region->min_y) region->min_y = y;
+        if (y > region->max_y) region->max_y = y;
+
+        for (int scan_x = left; scan_x < right; scan_x++) {
+            if (y - 1 >= 0 && !visited[(y - 1) * map->width + scan_x] && !is_black_pixel(map, map->pixels[(y - 1) * map->width + scan_x])) {
+                if (!stack_push(stack, scan_x, y - 1)) return false;
+            }
+            if (y + 1 < map->height && !visited[(y + 1) * map->width + scan_x] && !is_black_pixel(map, map->pixels[(y + 1) * map->width + scan_x])) {
+                if (!stack_push(stack, scan_x, y + 1)) return false;
+            }
+        }
+
+        if (pixels_processed > 100000) break;
+    }
+    return true;
+}
+
+/*
+ * Scanline fill over the color links: spans follow LINK_RIGHT, rows are entered through LINK_DOWN.
+ * Stops after the same number of pixels as flood_fill_iterative, the rest is labeled as further regions.
+ */
+bool flood_fill_links(Map* map, int start_x, int start_y, int region_id, unsigned int* visited, const unsigned char* links, PixelStack* stack) {
+    const int width = map->width, height = map->height;
+    Region* region = &map->regions[region_id];
+    stack->count = 0;
+    if (!stack_push(stack, start_x, start_y)) return false;
+
+    int pixels_processed = 0;
+
+    int x, y;
+    while (stack_pop(stack, &x, &y)) {
+        size_t row = (size_t)y * width;
+        if (visited[row + x]) continue;
+
+        int left = x, right = x;
+        while (left > 0 && (links[row + left - 1] & LINK_RIGHT) && !visited[row + left - 1]) left--;
+        while (right + 1 < width && (links[row + right] & LINK_RIGHT) && !visited[row + right + 1]) right++;
+
+        for (int scan_x = left; scan_x <= right; scan_x++) {
+            visited[row + scan_x] = 1;
+            map->reg_map[row + scan_x] = region_id;
+        }
+        region->pixel_count += right - left + 1;
+        pixels_processed += right - left + 1;
+        if (left < region->min_x) region->min_x = left;
+        if (right > region->max_x) region->max_x = right;
+        if (y < region->min_y) region->min_y = y;
+        if (y > region->max_y) region->max_y = y;
+
+        for (int scan_x = left; scan_x <= right; scan_x++) {
+            if (y > 0 && (links[row - width + scan_x] & LINK_DOWN) && !visited[row - width + scan_x]) {
+                if (!stack_push(stack, scan_x, y - 1)) return false;
+            }
+            if (y + 1 < height && (links[row + scan_x] & LINK_DOWN) && !visited[row + width + scan_x]) {
+                if (!stack_push(stack, scan_x, y + 1)) return false;
+            }
+        }
+
+        if (pixels_processed > 100000) break;
+    }
+    return true;
+}
+
+/* Regions are neighbors when their territories touch, see build_territories. */
+void build_adjacency_graph(Map* map) {//--------new
+    if (map->reg_count == 0) {
+        log_warn("No regions found, skipping graph building");
+        return;
+    }
+
+    int* territory = build_territories(map, 0, 0, map->width, map->height);
+    if (!territory) return;
+    if (map->progress) SDL_AtomicSet(map->progress, 85);
+
+    long long added_number_regions = add_territory_edges(map, territory, map->width, 0, 0, map->width, map->height);
+    mem_free(territory);
+
+    log_info("Added adjacencies: %lld", added_number_regions);
+}
+
+/*
+ * Gives every ink pixel of [x0, x1) x [y0, y1) that is at most
+ * TERRITORY_RADIUS steps from a region to the nearest one. A breadth-first
+ * search starts from the region pixels, and each ink pixel takes the label
+ * of its first neighbor (left, up, right, down) that is one step closer.
+ * Every territory is therefore connected, so territories that touch form a
+ * planar graph. Regions that only meet at a point across an ink junction do
+ * not become neighbors, and neither do regions separated by more than about
+ * twice the radius of ink. Values within TERRITORY_RADIUS of the rectangle's
+ * edge can miss regions outside it, so callers pass a widened rectangle.
+ * Returns the labels (-1 for ink out of reach) in rows of x1 - x0, or NULL.
+ */
+int* build_territories(const Map* map, int x0, int y0, int x1, int y1) {
+    const int w = x1 - x0, h = y1 - y0;
+    size_t count = (size_t)w * h;
+    int* territory = mem_alloc(MEM_ADJACENCY, count * sizeof(int));
+    int* queue = mem_alloc(MEM_ADJACENCY, count * sizeof(int));
+    unsigned char* distance = mem_alloc(MEM_ADJACENCY, count);
+    if (!territory || !queue || !distance) {
+        log_error("Failed to allocate memory for region territories!");
+        mem_free(territory);
+        mem_free(queue);
+        mem_free(distance);
+        return NULL;
+    }
+
+    /* Only region pixels next to ink can start a path, the rest are never expanded. */
+    size_t head = 0, tail = 0;
+    for (int y = 0; y < h; y++) {
+        const int* labels = map->reg_map + (size_t)(y0 + y) * map->width + x0;
+        for (int x = 0; x < w; x++) {
+            size_t i = (size_t)y * w + x;
+            territory[i] = labels[x] >= 0 ? labels[x] : -1;
+            distance[i] = labels[x] >= 0 ? 0 : UCHAR_MAX;
+            if (labels[x] < 0) continue;
+
+            bool border = (x > 0 && labels[x - 1] < 0) || (x + 1 < w && labels[x + 1] < 0) ||
+                          (y > 0 && labels[x - map->width] < 0) || (y + 1 < h && labels[x + map->width] < 0);
+            if (border) queue[tail++] = (int)i;
+        }
+    }
+
+    const int dx[4] = {-1, 0, 1, 0};
+    const int dy[4] = {0, -1, 0, 1};
+    while (head < tail) {
+        int i = queue[head++];
+        int y = i / w, x = i - y * w;
+        int d = distance[i];
+        for (int k = 0; k < 4 && d > 0; k++) {
+            int nx = x + dx[k], ny = y + dy[k];
+            if (nx < 0 || nx >= w || ny < 0 || ny >= h) continue;
+            if (distance[ny * w + nx] == d - 1) {
+                territory[i] = territory[ny * w + nx];
+                break;
+            }
+        }
+        if (d == TERRITORY_RADIUS) continue;
+
+        for (int k = 0; k < 4; k++) {
+            int nx = x + dx[k], ny = y + dy[k];
+            if (nx < 0 || nx >= w || ny < 0 || ny >= h || distance[ny * w + nx] != UCHAR_MAX) continue;
+            distance[ny * w + nx] = (unsigned char)(d + 1);
+            queue[tail++] = ny * w + nx;
+        }
+    }
+
+    mem_free(queue);
+    mem_free(distance);
+    return territory;
+}
+
+/* Links the regions of every two touching territory pixels inside [x0, x1) x [y0, y1); returns the list entries added. */
+long long add_territory_edges(Map* map, const int* territory, int stride, int x0, int y0, int x1, int y1) {
+    long long added = 0;
+    for (int y = y0; y < y1; y++) {
+        const int* row = territory + (size_t)y * stride;
+        int last_r1 = -1, last_r2 = -1;
+        for (int x = x0; x < x1; x++) {
+            int r1 = row[x];
+            int right = x + 1 < x1 ? row[x + 1] : r1;
+            int below = y + 1 < y1 ? row[x + stride] : r1;
+            if (r1 < 0 || r1 >= map->reg_count || (right == r1 && below == r1)) continue;
+
+            int others[2] = {right, below};
+            for (int k = 0; k < 2; k++) {
+                int r2 = others[k];
+                if (r2 < 0 || r2 == r1 || r2 >= map->reg_count) continue;
+                /* A boundary usually repeats the same pair pixel after pixel. */
+                if ((r1 == last_r1 && r2 == last_r2) || (r1 == last_r2 && r2 == last_r1)) continue;
+                last_r1 = r1;
+                last_r2 = r2;
+                if (add_neighbor(&map->arena, &map->regions[r1], r2)) added++;
+                if (add_neighbor(&map->arena, &map->regions[r2], r1)) added++;
+            }
+        }
+    }
+    return added;
+}
+
+
+bool add_neighbor(Arena* arena, Region* region, int neighbor_id) {
+    if (!region) return false;
+
+    NeighborNode* current = region->neighbors;
+    while (current) {
+        if (current->region_id == neighbor_id) {
+            return false;
+        }
+        current = current->next;
+    }
+
+    NeighborNode* new_node = arena_alloc(arena, sizeof(NeighborNode));
+    if (!new_node) {
+        log_error("Failed to allocate NeighborNode for region %d", region->id);
+        return false;
+    }
+
+    new_node->region_id = neighbor_id;
+    new_node->next = region->neighbors;
+    region->neighbors = new_node;
+
+    return true; 
+}
+
+/*
+ * Colors every region of map, then paints them all in one pass; returns the
+ * number of colors used, also kept in map->colors_used.
+ */
+int greedy_coloring(Map* map) {
+    ProfileScope scope = profile_begin("coloring");
+    int max_color = 0;
+    
+    for (int i = 0; i < map->reg_count; i++) {
+        int chosen_color = pick_region_color(map, i);
+        if (chosen_color > max_color) {
+            max_color = chosen_color;
+        }
+    }
+    
+    map->colors_used = max_color + 1;
+    profile_end(&scope);
+
+    ProfileScope paint_scope = profile_begin("paint");
+    const Palette* palette = &map_options_of(map)->palette;
+    for (int i = 0; i < map->reg_count; i++) {
+        color_region_pixels(map, i, palette->colors[map->regions[i].color]);
+    }
+    profile_end(&paint_scope);
+    
+    return map->colors_used;
+}
+
+
+/*
+ * Called when every color is taken around region_id. For a pair of colors
+ * a, b the a/b chains reachable from the neighbors colored a can swap colors
+ * unless they also reach a neighbor colored b; after the swap a is free.
+ * Returns the freed color, or -1 when no pair works. The chain buffers are
+ * sized for MAX_REGIONS and kept with the map, so a coloring pass or an edit
+ * only allocates them the first time it needs a swap.
+ */
+int kempe_free_color(Map* map, int region_id) {
+    int count = map->reg_count;
+    Region* regions = map->regions;
+    if (!map->chain_queue) map->chain_queue = mem_alloc(MEM_REGIONS, MAX_REGIONS * sizeof(int));
+    if (!map->in_chain) map->in_chain = mem_alloc(MEM_REGIONS, MAX_REGIONS);
+    int* queue = map->chain_queue;
+    unsigned char* in_chain = map->in_chain;
+    const Palette* palette = &map_options_of(map)->palette;
+    int freed = -1;
+
+    if (!queue || !in_chain) {
+        log_error("Failed to allocate memory for Kempe chains!");
+        return -1;
+    }
+
+    for (int a = 0; a < palette->size && freed == -1; a++) {
+        for (int b = 0; b < palette->size && freed == -1; b++) {
+            if (a == b) continue;
+
+            memset(in_chain, 0, (size_t)count);
+            int head = 0, tail = 0;
+            for (NeighborNode* node = regions[region_id].neighbors; node; node = node->next) {
+                int id = node->region_id;
+                if (regions[id].is_colored && regions[id].color == a && !in_chain[id]) {
+                    in_chain[id] = 1;
+                    queue[tail++] = id;
+                }
+            }
+
+            while (head < tail) {
+                int id = queue[head++];
+                for (NeighborNode* node = regions[id].neighbors; node; node = node->next) {
+                    int next = node->region_id;
+                    if (next == region_id || in_chain[next] || !regions[next].is_colored) continue;
+                    if (regions[next].color == a || regions[next].color == b) {
+                        in_chain[next] = 1;
+                        queue[tail++] = next;
+                    }
+                }
+            }
+
+            bool blocked = false;
+            for (NeighborNode* node = regions[region_id].neighbors; node && !blocked; node = node->next) {
+                int id = node->region_id;
+                blocked = in_chain[id] && regions[id].color == b;
+            }
+            if (blocked) continue;
+
+            for (int i = 0; i < tail; i++) {
+                Region* region = &regions[queue[i]];
+                region->color = region->color == a ? b : a;
+                if (color_log_recording) {
+                    record_color_event(queue[i], region->color == a ? b : a, region->color);
+                } else {
+                    color_region_pixels(map, queue[i], palette->colors[region->color]);
+                }
+            }
+            freed = a;
+        }
+    }
+
+    return freed;
+}
+
+
+const MapOptions* map_options_of(const Map* map) {
+    return map->options ? map->options : &map_options;
+}
+
+/* Entries past the built-in four are spread around the hue circle. */
+void init_palette(Palette* palette) {
+    for (int i = 4; i < MAX_COLORS; i++) {
+        double hue = fmod(i * 137.508, 360.0) / 60.0;
+        double value = i % 2 ? 0.75 : 1.0;
+        double x = value * (1.0 - fabs(fmod(hue, 2.0) - 1.0));
+        double r = 0, g = 0, b = 0;
+        switch ((int)hue) {
+            case 0: r = value; g = x; break;
+            case 1: r = x; g = value; break;
+            case 2: g = value; b = x; break;
+            case 3: g = x; b = value; break;
+            case 4: r = x; b = value; break;
+            default: r = value; b = x; break;
+        }
+        palette->colors[i].r = (Uint8)(r * 255);
+        palette->colors[i].g = (Uint8)(g * 255);
+        palette->colors[i].b = (Uint8)(b * 255);
+        palette->colors[i].a = 255;
+    }
+    set_palette_size(palette, MAX_COLORS);
+}
+
+void set_palette_size(Palette* palette, int size) {
+    palette->size = size;
+    palette->mask = size >= (int)(sizeof(ColorSet) * 8) ? (ColorSet)~(ColorSet)0 : (ColorSet)(((ColorSet)1 << size) - 1);
+}
+
+/*
+ * Reads one color per line, either "#RRGGBB" or "R G B". A '#' followed by
+ * anything but hex digits starts a comment, a run of other than six digits
+ * is reported and skipped. The palette keeps its old colors if the file has
+ * none.
+ */
+bool load_palette(const char* filename, Palette* palette) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        log_error("Failed to open palette %s", filename);
+        return false;
+    }
+
+    SDL_Color loaded[MAX_COLORS];
+    int count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int r, g, b;
+        const char* text = line + strspn(line, " \t\r\n");
+        bool parsed;
+        if (*text == '#') {
+            size_t digits = strspn(text + 1, "0123456789abcdefABCDEF");
+            if (digits == 0) continue;
+            const char* end = text + 1 + digits;
+            parsed = digits == 6 && (*end == '\0' || strchr(" \t\r\n", *end)) &&
+                     sscanf(text + 1, "%2x%2x%2x", &r, &g, &b) == 3;
+        } else {
+            parsed = sscanf(text, "%u %u %u", &r, &g, &b) == 3 && r < 256 && g < 256 && b < 256;
+        }
+        if (!parsed) {
+            if (*text) log_warn("Ignoring palette line: %s", line);
+            continue;
+        }
+
+        if (count == MAX_COLORS) {
+            log_warn("%s has more than %d colors, the rest are ignored (build with a larger PALETTE_SIZE)", filename, MAX_COLORS);
+            break;
+        }
+        loaded[count].r = (Uint8)r;
+        loaded[count].g = (Uint8)g;
+        loaded[count].b = (Uint8)b;
+        loaded[count].a = 255;
+        count++;
+    }
+    fclose(file);
+
+    if (count == 0) {
+        log_error("No colors found in palette %s", filename);
+        return false;
+    }
+
+    memcpy(palette->colors, loaded, count * sizeof(SDL_Color));
+    set_palette_size(palette, count);
+    log_info("Loaded %d colors from %s", count, filename);
+    return true;
+}
+
+int first_free_color(ColorSet used, ColorSet mask) {
+    ColorSet free_colors = (ColorSet)(~used & mask);
+    if (!free_colors) return -1;
+#if defined(__GNUC__)
+    return COLOR_SET_CTZ(free_colors);
+#else
+    int color = 0;
+    while (!(free_colors & 1)) {
+        free_colors >>= 1;
+        color++;
+    }
+    return color;
+#endif
+}
+
+/* Repaints a colored map after a palette change, recoloring if it used colors that are gone. */
+void apply_palette() {
+    if (current_map.reg_count == 0 || color_used_final == 0) return;
+
+    if (color_used_final > map_options.palette.size) {
+        clear_color_log();
+        reset_map_colors();
+        color_used_final = greedy_coloring(&current_map);
+        return;
+    }
+    ProfileScope scope = profile_begin("paint");
+    for (int i = 0; i < current_map.reg_count; i++) {
+        if (current_map.regions[i].is_colored) {
+            color_region_pixels(&current_map, i, map_options.palette.colors[current_map.regions[i].color]);
+        }
+    }
+    profile_end(&scope);
+}
+
+/*
+ * Paints (ink) or erases a rectangle of the current map and updates the
+ * segmentation in place. Only regions touching the rectangle are relabeled,
+ * inside the union of their bounding boxes, so the cost follows the regions
+ * the edit reaches rather than the map; touching the background still
+ * relabels all of it. A region emptied by a merge gives its slot to the last
+ * region to keep the table dense. Touched regions get new neighbor lists and,
+ * if the map is colored, new colors, as does any region left sharing a color
+ * with a new neighbor.
+ */
+bool edit_map_rect(int x, int y, int w, int h, bool ink) {
+    Map* map = &current_map;
+    if (!map->surface || !map->original_surface || !map->reg_map || !map->regions || map->preview_scale > 1) {
+        return false;
+    }
+
+    int x0 = SDL_max(x, 0), y0 = SDL_max(y, 0);
+    int x1 = SDL_min(x + w, map->width), y1 = SDL_min(y + h, map->height);
+    if (x0 >= x1 || y0 >= y1) return false;
+
+    ProfileScope scope = profile_begin("edit");
+    clear_color_log();
+    int width = map->width;
+    int* labels = map->reg_map;
+    SDL_Surface* original = map->original_surface;
+    const Palette* palette = &map_options_of(map)->palette;
+    unsigned int stroke = ink ? SDL_MapRGB(original->format, 0, 0, 0) : SDL_MapRGB(original->format, 255, 255, 255);
+
+    for (int py = y0; py < y1; py++) {
+        unsigned int* row = (unsigned int*)((Uint8*)original->pixels + (size_t)py * original->pitch);
+        for (int px = x0; px < x1; px++) {
+            row[px] = stroke;
+            map->pixels[py * width + px] = stroke;
+        }
+    }
+
+    bool affected[MAX_REGIONS] = {false};
+    int affected_ids[MAX_REGIONS];
+    int affected_count = 0;
+    int wx0 = x0, wy0 = y0, wx1 = x1, wy1 = y1;
+    for (int py = SDL_max(y0 - 1, 0); py < SDL_min(y1 + 1, map->height); py++) {
+        for (int px = SDL_max(x0 - 1, 0); px < SDL_min(x1 + 1, width); px++) {
+            int label = labels[py * width + px];
+            if (label < 0 || affected[label]) continue;
+
+            const Region* region = &map->regions[label];
+            affected[label] = true;
+            affected_ids[affected_count++] = label;
+            wx0 = SDL_min(wx0, region->min_x);
+            wy0 = SDL_min(wy0, region->min_y);
+            wx1 = SDL_max(wx1, region->max_x + 1);
+            wy1 = SDL_max(wy1, region->max_y + 1);
+        }
+    }
+
+    for (int py = wy0; py < wy1; py++) {
+        for (int px = wx0; px < wx1; px++) {
+            int index = py * width + px;
+            bool in_rect = px >= x0 && px < x1 && py >= y0 && py < y1;
+            if (in_rect) {
+                labels[index] = ink ? -1 : EDIT_PENDING;
+            } else if (labels[index] >= 0 && affected[labels[index]]) {
+                labels[index] = EDIT_PENDING;
+            }
+        }
+    }
+
+    for (int i = 0; i < affected_count; i++) {
+        Region* region = &map->regions[affected_ids[i]];
+        for (NeighborNode* node = region->neighbors; node; node = node->next) {
+            if (!affected[node->region_id]) {
+                unlink_neighbor(&map->regions[node->region_id], affected_ids[i]);
+            }
+        }
+        region->neighbors = NULL;
+    }
+
+    qsort(affected_ids, affected_count, sizeof(int), compare_ints);
+    int touched[MAX_REGIONS];
+    int touched_count = 0, reused = 0;
+    PixelStack stack = {NULL, 0, 0};
+    bool filled = true;
+
+    for (int py = wy0; py < wy1; py++) {
+        for (int px = wx0; px < wx1; px++) {
+            if (labels[py * width + px] != EDIT_PENDING) continue;
+            if (!filled) {
+                labels[py * width + px] = -1;
+                continue;
+            }
+
+            int id;
+            if (reused < affected_count) {
+                id = affected_ids[reused++];
+            } else if (map->reg_count < MAX_REGIONS) {
+                id = map->reg_count++;
+            } else {
+                log_warn("Edit needs more than %d regions, the new area stays unlabeled", MAX_REGIONS);
+                id = -1;
+            }
+            filled = fill_edit_component(map, px, py, id, &stack);
+            if (id >= 0) touched[touched_count++] = id;
+            if (!filled) {
+                log_error("Edit ran out of memory, the rest of the window stays unlabeled");
+            }
+        }
+    }
+    mem_free(stack.items);
+
+    for (int i = affected_count - 1; i >= reused; i--) {
+        int gone = affected_ids[i];
+        int last = map->reg_count - 1;
+        if (gone != last) {
+            move_region(map, last, gone);
+            for (int t = 0; t < touched_count; t++) {
+                if (touched[t] == last) touched[t] = gone;
+            }
+        }
+        memset(&map->regions[last], 0, sizeof(Region));
+        map->reg_count--;
+    }
+
+    /*
+     * A territory depends on the labels up to TERRITORY_RADIUS away, so only
+     * pixels that close to the relabeled window can change hands, and only
+     * regions within twice that distance can own them before or after. Their
+     * lists are rebuilt along with the touched regions.
+     */
+    bool rescan[MAX_REGIONS] = {false};
+    int rescan_ids[MAX_REGIONS];
+    int rescan_count = 0;
+    for (int t = 0; t < touched_count; t++) {
+        rescan[touched[t]] = true;
+        rescan_ids[rescan_count++] = touched[t];
+    }
+    int reach = 2 * TERRITORY_RADIUS + 1;
+    for (int py = SDL_max(wy0 - reach, 0); py < SDL_min(wy1 + reach, map->height); py++) {
+        for (int px = SDL_max(wx0 - reach, 0); px < SDL_min(wx1 + reach, width); px++) {
+            int label = labels[py * width + px];
+            if (label >= 0 && !rescan[label]) {
+                rescan[label] = true;
+                rescan_ids[rescan_count++] = label;
+            }
+        }
+    }
+    rebuild_region_adjacency(map, rescan_ids, rescan_count);
+
+    /*
+     * Besides the touched regions, a rescanned region can gain a neighbor of
+     * its own color; one of each such pair is recolored too.
+     */
+    if (color_used_final > 0) {
+        int recolor[MAX_REGIONS];
+        int recolor_count = 0;
+        for (int t = 0; t < touched_count; t++) {
+            map->regions[touched[t]].color = -1;
+            map->regions[touched[t]].is_colored = false;
+            recolor[recolor_count++] = touched[t];
+        }
+        for (int i = touched_count; i < rescan_count; i++) {
+            Region* region = &map->regions[rescan_ids[i]];
+            for (NeighborNode* node = region->neighbors; node && region->is_colored; node = node->next) {
+                const Region* other = &map->regions[node->region_id];
+                if (other->is_colored && other->color == region->color) {
+                    region->color = -1;
+                    region->is_colored = false;
+                    recolor[recolor_count++] = rescan_ids[i];
+                }
+            }
+        }
+        if (!recolor_edit_regions(map, recolor, recolor_count, touched_count)) {
+            log_warn("Edit left regions without a free color, recoloring the map");
+            for (int i = 0; i < map->reg_count; i++) {
+                map->regions[i].color = -1;
+                map->regions[i].is_colored = false;
+                recolor[i] = i;
+            }
+            if (!recolor_edit_regions(map, recolor, map->reg_count, 0)) {
+                log_error("No conflict-free coloring found, uncolored regions share a color with a neighbor");
+                for (int i = 0; i < map->reg_count; i++) {
+                    if (!map->regions[i].is_colored) color_region_pixels(map, i, palette->colors[pick_region_color(map, i)]);
+                }
+            }
+        }
+    }
+
+    unsigned int color_pixels[MAX_COLORS];
+    for (int c = 0; c < palette->size; c++) {
+        color_pixels[c] = SDL_MapRGB(map->surface->format, palette->colors[c].r, palette->colors[c].g, palette->colors[c].b);
+    }
+    for (int py = wy0; py < wy1; py++) {
+        const unsigned int* source = (const unsigned int*)((const Uint8*)original->pixels + (size_t)py * original->pitch);
+        for (int px = wx0; px < wx1; px++) {
+            int label = labels[py * width + px];
+            bool colored = label >= 0 && map->regions[label].is_colored;
+            map->pixels[py * width + px] = colored ? color_pixels[map->regions[label].color] : source[px];
+        }
+    }
+    mark_tiles_dirty(wx0, wy0, wx1 - wx0, wy1 - wy0);
+
+    profile_end(&scope);
+    log_debug("Edit %dx%d at (%d, %d) relabeled a %dx%d window, %d regions touched, %d removed, %d rescanned",
+              x1 - x0, y1 - y0, x0, y0, wx1 - wx0, wy1 - wy0, touched_count, affected_count - reused, rescan_count);
+    return filled;
+}
+
+/*
+ * Labels the 4-connected pending pixels around (x, y), within the color
+ * tolerance if one is set; id -1 leaves them as ink. Returns false when the
+ * stack cannot grow, with part of the component still pending.
+ */
+bool fill_edit_component(Map* map, int x, int y, int id, PixelStack* stack) {
+    const int tolerance = map_options_of(map)->color_tolerance;
+    Region* region = id >= 0 ? &map->regions[id] : NULL;
+    if (region) {
+        memset(region, 0, sizeof(Region));
+        region->id = id;
+        region->color = -1;
+        region->min_x = region->max_x = x;
+        region->min_y = region->max_y = y;
+    }
+
+    const SDL_Surface* original = map->original_surface;
+    stack->count = 0;
+    map->reg_map[y * map->width + x] = id;
+    if (!stack_push(stack, x, y)) return false;
+
+    int px, py;
+    while (stack_pop(stack, &px, &py)) {
+        if (region) {
+            region->pixel_count++;
+            if (px < region->min_x) region->min_x = px;
+            if (px > region->max_x) region->max_x = px;
+            if (py < region->min_y) region->min_y = py;
+            if (py > region->max_y) region->max_y = py;
+        }
+
+        const int dx[4] = {1, -1, 0, 0};
+        const int dy[4] = {0, 0, 1, -1};
+        for (int d = 0; d < 4; d++) {
+            int nx = px + dx[d], ny = py + dy[d];
+            if (nx < 0 || nx >= map->width || ny < 0 || ny >= map->height) continue;
+            int index = ny * map->width + nx;
+            if (map->reg_map[index] != EDIT_PENDING) continue;
+            if (tolerance >= 0) {
+                const unsigned int* row = (const unsigned int*)((const Uint8*)original->pixels + (size_t)py * original->pitch);
+                const unsigned int* next = (const unsigned int*)((const Uint8*)original->pixels + (size_t)ny * original->pitch);
+                if (!pixels_join(row[px], next[nx], tolerance)) continue;
+            }
+            map->reg_map[index] = id;
+            if (!stack_push(stack, nx, ny)) return false;
+        }
+    }
+    return true;
+}
+
+void unlink_neighbor(Region* region, int neighbor_id) {
+    NeighborNode** link = &region->neighbors;
+    while (*link) {
+        if ((*link)->region_id == neighbor_id) {
+            *link = (*link)->next;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Moves region from into slot to, relabeling its pixels and the lists that point at it. */
+void move_region(Map* map, int from, int to) {
+    Region* region = &map->regions[from];
+    for (int py = region->min_y; py <= region->max_y; py++) {
+        int* row = map->reg_map + (size_t)py * map->width;
+        for (int px = region->min_x; px <= region->max_x; px++) {
+            if (row[px] == from) row[px] = to;
+        }
+    }
+    for (NeighborNode* node = region->neighbors; node; node = node->next) {
+        for (NeighborNode* back = map->regions[node->region_id].neighbors; back; back = back->next) {
+            if (back->region_id == from) back->region_id = to;
+        }
+    }
+
+    map->regions[to] = *region;
+    map->regions[to].id = to;
+}
+
+/*
+ * Rebuilds every edge of the given regions from the territories around
+ * them: each territory lies within TERRITORY_RADIUS of its region's box, so
+ * the boxes widened by one more pixel hold all of their edges, and the
+ * territories are computed on a rectangle widened once more to be exact.
+ */
+void rebuild_region_adjacency(Map* map, const int* ids, int count) {
+    if (count == 0) return;
+
+    int x0 = map->width, y0 = map->height, x1 = 0, y1 = 0;
+    for (int i = 0; i < count; i++) {
+        Region* region = &map->regions[ids[i]];
+        for (NeighborNode* node = region->neighbors; node; node = node->next) {
+            unlink_neighbor(&map->regions[node->region_id], ids[i]);
+        }
+        region->neighbors = NULL;
+        x0 = SDL_min(x0, region->min_x);
+        y0 = SDL_min(y0, region->min_y);
+        x1 = SDL_max(x1, region->max_x + 1);
+        y1 = SDL_max(y1, region->max_y + 1);
+    }
+
+    int reach = TERRITORY_RADIUS + 1;
+    int ex0 = SDL_max(x0 - reach, 0), ey0 = SDL_max(y0 - reach, 0);
+    int ex1 = SDL_min(x1 + reach, map->width), ey1 = SDL_min(y1 + reach, map->height);
+    int tx0 = SDL_max(ex0 - TERRITORY_RADIUS, 0), ty0 = SDL_max(ey0 - TERRITORY_RADIUS, 0);
+    int tx1 = SDL_min(ex1 + TERRITORY_RADIUS, map->width), ty1 = SDL_min(ey1 + TERRITORY_RADIUS, map->height);
+
+    int* territory = build_territories(map, tx0, ty0, tx1, ty1);
+    if (!territory) return;
+    add_territory_edges(map, territory, tx1 - tx0, ex0 - tx0, ey0 - ty0, ex1 - tx0, ey1 - ty0);
+    mem_free(territory);
+}
+
+/* Colors region_id for a whole-map pass, which has to give every region a color. */
+int pick_region_color(Map* map, int region_id) {
+    int color = try_region_color(map, region_id);
+    if (color == -1) {
+        Region* region = &map->regions[region_id];
+        int previous = region->is_colored ? region->color : -1;
+        log_warn("No free color for region %d, it will share a color with a neighbor", region_id);
+        color = 0;
+        region->color = color;
+        region->is_colored = true;
+        if (color_log_recording) {
+            record_color_event(region_id, previous, color);
+        }
+    }
+    return color;
+}
+
+/* Gives region_id a color no neighbor has, swapping a Kempe chain if needed; returns -1 and leaves it as it was when none works. */
+int try_region_color(Map* map, int region_id) {
+    Region* region = &map->regions[region_id];
+    int previous = region->is_colored ? region->color : -1;
+    ColorSet used_colors = 0;
+    for (NeighborNode* node = region->neighbors; node; node = node->next) {
+        const Region* other = &map->regions[node->region_id];
+        if (other->is_colored && other->color >= 0) {
+            used_colors |= (ColorSet)1 << other->color;
+        }
+    }
+
+    int color = first_free_color(used_colors, map_options_of(map)->palette.mask);
+    if (color == -1) color = kempe_free_color(map, region_id);
+    if (color == -1) return -1;
+    region->color = color;
+    region->is_colored = true;
+    if (color_log_recording) {
+        record_color_event(region_id, previous, color);
+    }
+    return color;
+}
+
+/*
+ * Colors the uncolored regions in ids after an edit, painting those outside
+ * the first window_count, which lie in the window the edit repaints itself.
+ * A region that finds no color even after a Kempe swap takes the color the
+ * fewest neighbors have, and those neighbors go back in the queue. Returns
+ * false if regions are still waiting after RECOLOR_STEPS per region.
+ */
+bool recolor_edit_regions(Map* map, const int* ids, int count, int window_count) {
+    bool in_window[MAX_REGIONS] = {false};
+    bool queued[MAX_REGIONS] = {false};
+    int queue[MAX_REGIONS], lost[MAX_REGIONS];
+    int head = 0, waiting = 0;
+    const Palette* palette = &map_options_of(map)->palette;
+    for (int i = 0; i < count; i++) {
+        if (i < window_count) in_window[ids[i]] = true;
+        lost[ids[i]] = -1;
+        if (map->regions[ids[i]].is_colored || queued[ids[i]]) continue;
+        queued[ids[i]] = true;
+        queue[(head + waiting++) % MAX_REGIONS] = ids[i];
+    }
+
+    long long steps = (long long)RECOLOR_STEPS * map->reg_count;
+    for (long long step = 0; waiting > 0 && step < steps; step++) {
+        int id = queue[head];
+        head = (head + 1) % MAX_REGIONS;
+        waiting--;
+        queued[id] = false;
+
+        int color = try_region_color(map, id);
+        if (color == -1) {
+            int owners[MAX_COLORS] = {0};
+            for (NeighborNode* node = map->regions[id].neighbors; node; node = node->next) {
+                const Region* other = &map->regions[node->region_id];
+                if (other->is_colored) owners[other->color]++;
+            }
+            for (int k = 0; k < palette->size; k++) {
+                int c = (int)((step + k) % palette->size);
+                if (c == lost[id] && palette->size > 1) continue;
+                if (color == -1 || owners[c] < owners[color]) color = c;
+            }
+            for (NeighborNode* node = map->regions[id].neighbors; node; node = node->next) {
+                Region* other = &map->regions[node->region_id];
+                if (!other->is_colored || other->color != color) continue;
+                other->color = -1;
+                other->is_colored = false;
+                lost[node->region_id] = color;
+                queued[node->region_id] = true;
+                queue[(head + waiting++) % MAX_REGIONS] = node->region_id;
+            }
+            map->regions[id].color = color;
+            map->regions[id].is_colored = true;
+        }
+
+        if (color + 1 > color_used_final) color_used_final = color + 1;
+        if (!in_window[id]) color_region_pixels(map, id, palette->colors[color]);
+    }
+    return waiting == 0;
+}
+
+/* Stamps the brush along a mouse drag, given in window coordinates. */
+void brush_stroke(int from_x, int from_y, int to_x, int to_y, bool ink) {
+    if (current_map.reg_count == 0 || is_coloring || pending_map_index >= 0) return;
+
+    SDL_Rect viewport = {50, MENU_HEIGHT + 50, WINDOW_WIDTH - 100, WINDOW_HEIGHT - MENU_HEIGHT - 100};
+    double ax = view_x + (from_x - viewport.x) / view_scale, ay = view_y + (from_y - viewport.y) / view_scale;
+    double bx = view_x + (to_x - viewport.x) / view_scale, by = view_y + (to_y - viewport.y) / view_scale;
+    double distance = sqrt((bx - ax) * (bx - ax) + (by - ay) * (by - ay));
+    int steps = (int)(distance / SDL_max(brush_size / 2, 1)) + 1;
+
+    for (int i = 0; i < steps; i++) {
+        double t = steps > 1 ? (double)i / (steps - 1) : 1.0;
+        int cx = (int)floor(ax + (bx - ax) * t), cy = (int)floor(ay + (by - ay) * t);
+        edit_map_rect(cx - brush_size / 2, cy - brush_size / 2, brush_size, brush_size, ink);
+    }
+}
+
+/*
+ * Paints a region of map; the tiles are only marked for current_map, the one
+ * on screen. Callers time a whole paint pass, not each region.
+ */
+void color_region_pixels(Map* map, int region_id, SDL_Color color) {
+    if (!map->surface) {
+        log_error("map->surface is NULL!");
+        return;
+    }
+    
+    if (!map->reg_map) {
+        log_error("map->reg_map is NULL!");
+        return;
+    }
+    
+    if (!map->pixels) {
+        log_error("map->pixels is NULL!");
+        return;
+    }
+    
+    unsigned int pixel_color = SDL_MapRGB(map->surface->format, color.r, color.g, color.b);
+    
+    Region* region = &map->regions[region_id];
+    int expected_pixels = region->pixel_count;
+    int pixels_colored = 0;
+
+    for (int y = region->min_y; y <= region->max_y && pixels_colored < expected_pixels; y++) {
+        const int* labels = map->reg_map + (size_t)y * map->width;
+        unsigned int* pixels = map->pixels + (size_t)y * map->width;
+        for (int x = region->min_x; x <= region->max_x; x++) {
+            if (labels[x] == region_id) {
+                pixels[x] = pixel_color;
+                pixels_colored++;
+            }
+        }
+    }
+
+    if (map == &current_map) {
+        mark_tiles_dirty(region->min_x, region->min_y, region->max_x - region->min_x + 1, region->max_y - region->min_y + 1);
+    }
+}
+
+/* Puts the source pixels back over a region, as when a replay seeks to before it was colored. */
+void restore_region_pixels(int region_id) {
+    if (!current_map.surface || !current_map.original_surface || !current_map.reg_map) return;
+
+    const Region* region = &current_map.regions[region_id];
+    const SDL_Surface* original = current_map.original_surface;
+    for (int y = region->min_y; y <= region->max_y; y++) {
+        const int* labels = current_map.reg_map + (size_t)y * current_map.width;
+        const unsigned int* source = (const unsigned int*)((const Uint8*)original->pixels + (size_t)y * original->pitch);
+        unsigned int* pixels = current_map.pixels + (size_t)y * current_map.width;
+        for (int x = region->min_x; x <= region->max_x; x++) {
+            if (labels[x] == region_id) {
+                pixels[x] = source[x];
+            }
+        }
+    }
+
+    mark_tiles_dirty(region->min_x, region->min_y, region->max_x - region->min_x + 1, region->max_y - region->min_y + 1);
+}
+
+void render_text(const char* text, int x, int y, SDL_Color color) {
+    if (!load_font()) return;
+    
+    SDL_Surface* text_surface = TTF_RenderText_Solid(font, text, color);
+    if (text_surface) {
+        SDL_Texture* text_texture = SDL_CreateTextureFromSurface(renderer, text_surface);
+        if (text_texture) {
+            SDL_Rect dest_rect = {x, y, text_surface->w, text_surface->h};
+            SDL_RenderCopy(renderer, text_texture, NULL, &dest_rect);
+            SDL_DestroyTexture(text_texture);
+        }
+        SDL_FreeSurface(text_surface);
+    }
+}
+
+void render_map() {
+    if (pending_map_index >= 0 && !current_map.surface) {
+        char loading_text[256];
+        sprintf(loading_text, "Loading map %d/%d... %d%%", pending_map_index + 1, total_maps, pending_map_progress());
+        SDL_Color black = {0, 0, 0, 255};
+        SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+        SDL_Rect bar_back = {WINDOW_WIDTH / 2 - 150, WINDOW_HEIGHT / 2, 300, 20};
+        SDL_RenderFillRect(renderer, &bar_back);
+        SDL_SetRenderDrawColor(renderer, 64, 160, 64, 255);
+        SDL_Rect bar = {bar_back.x, bar_back.y, bar_back.w * pending_map_progress() / 100, bar_back.h};
+        SDL_RenderFillRect(renderer, &bar);
+        render_text(loading_text, WINDOW_WIDTH / 2 - 150, WINDOW_HEIGHT / 2 - 30, black);
+        return;
+    }
+
+    if (!current_map.surface) return;
+
+    SDL_Rect dest_rect = {50, MENU_HEIGHT + 50, WINDOW_WIDTH - 100, WINDOW_HEIGHT - MENU_HEIGHT - 100};
+    render_map_tiles(&dest_rect);
+
+    if (current_map.reg_count > 0) {
+        char info_text[256];
+        sprintf(info_text, "Map %d/%d | Regions: %d", curr_map_index + 1, total_maps, current_map.reg_count);
+        SDL_Color white = {0, 0, 0, 255};
+        render_text(info_text, WINDOW_WIDTH - 1150, MENU_HEIGHT + 10, white);
 
         if (realtime_coloring && is_coloring) {
-            sprintf(info_text, "Colored: %d/%d", curr_color_region, current_map.reg_count);
+            sprintf(info_text, "Step: %d/%d", color_log.position, color_log.count);
             render_text(info_text, WINDOW_WIDTH - 950, MENU_HEIGHT + 10, white);
             
-            int progress = (curr_color_region * 100) / current_map.reg_count;
-            sprintf(info_text, "Progress: %d%%", progress);
+            if (replay_paused) {
+                sprintf(info_text, "Paused, x%g", replay_speed);
+            } else {
+                sprintf(info_text, "Playing x%g", replay_speed);
+            }
             render_text(info_text, WINDOW_WIDTH - 825, MENU_HEIGHT + 10, white);
         }
 
-        if (color_used_final > 0 && !is_coloring) {
-            sprintf(info_text, "Colors used: %d", color_used_final);
-            SDL_Color green = {0, 0, 0, 255};
-            render_text(info_text, WINDOW_WIDTH - 250, MENU_HEIGHT + 10, green);
+        if (current_map.preview_scale > 1) {
+            sprintf(info_text, "Preview 1:%d - processing full resolution... %d%%", current_map.preview_scale, pending_map_progress());
+            SDL_Color red = {150, 0, 0, 255};
+            render_text(info_text, WINDOW_WIDTH - 950, MENU_HEIGHT + 10, red);
+        }
+
+        if (brush_mode) {
+            sprintf(info_text, "Brush %d px: left paints, right erases", brush_size);
+            SDL_Color red = {150, 0, 0, 255};
+            render_text(info_text, WINDOW_WIDTH - 650, MENU_HEIGHT + 10, red);
+        }
+
+        if (color_used_final > 0 && !is_coloring) {
+            sprintf(info_text, "Colors used: %d", color_used_final);
+            SDL_Color green = {0, 0, 0, 255};
+            render_text(info_text, WINDOW_WIDTH - 250, MENU_HEIGHT + 10, green);
+        }
+    }
+}
+
+void render_settings(){
+    if (set_bg) {
+        SDL_RenderCopy(renderer, set_bg, NULL, NULL);
+    }
+
+    SDL_Color text_color = {150, 0, 0, 255};
+    render_text("Author 25", WINDOW_WIDTH/2 + 120, 15, text_color);
+    render_text("Map Coloring Game Controls:", WINDOW_WIDTH/2 + 130, 40, text_color);
+    render_text(" SPACE - Dynamic Coloring / Pause", WINDOW_WIDTH/2 + 130, 70, text_color);
+    render_text(" I - Instant Coloring", WINDOW_WIDTH/2 + 150, 100, text_color);
+    render_text(" E - Export Map Data", WINDOW_WIDTH/2 + 150, 130, text_color);
+    render_text(" V - Export SVG", WINDOW_WIDTH/2 + 150, 160, text_color);
+    render_text(" P - Reload Palette", WINDOW_WIDTH/2 + 150, 190, text_color);
+    render_text(" B - Brush, [ ] - Brush Size", WINDOW_WIDTH/2 + 150, 220, text_color);
+    render_text(" , . Home End - Scrub Replay, Up/Down - Speed", WINDOW_WIDTH/2 + 150, 250, text_color);
+    render_text(" L - Save Coloring Log", WINDOW_WIDTH/2 + 150, 280, text_color);
+    render_text(" ESC - Return to Main Menu", WINDOW_WIDTH/2 + 130, 310, text_color);
+}
+
+void show_main_menu() {
+    if (m_m_bg) {
+        SDL_RenderCopy(renderer, m_m_bg, NULL, NULL);
+    }
+
+    SDL_Color but_color = {70, 70, 70, 50};
+    SDL_Color hover_color = {100, 100, 100, 100};
+    SDL_Color text_color = {255, 255, 255, 255};
+
+    int but_w = 200;
+    int but_h = 50;
+    int but_x = WINDOW_WIDTH / 2 - but_w / 2;
+    int but_spacing = 70;
+
+    render_text("MAP COLORING",  but_x + (but_w - 100) / 2, 25, (SDL_Color){64, 224, 208, 255});
+    
+    int mouse_x, mouse_y;
+    SDL_GetMouseState(&mouse_x, &mouse_y);
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+
+    SDL_Rect start_but = {but_x, 220, but_w, but_h};
+    bool active_start = (mouse_x >= start_but.x && mouse_x <= start_but.x + but_w && mouse_y >= start_but.y && mouse_y <= start_but.y + but_h);
+
+    SDL_SetRenderDrawColor(renderer, active_start ? hover_color.r : but_color.r, active_start ? hover_color.g : but_color.g, active_start ? hover_color.b : but_color.b, active_start ? hover_color.a : but_color.a);
+
+    SDL_RenderFillRect(renderer, &start_but);
+
+    render_text("START GAME", but_x + (but_w - 100) / 2, 235, text_color);
+
+    SDL_Rect settings_but = {but_x, 220 + but_spacing, but_w, but_h};
+    bool active_settings = (mouse_x >= settings_but.x && mouse_x <= settings_but.x + but_w && mouse_y >= settings_but.y && mouse_y <= settings_but.y + but_h);
+
+    SDL_SetRenderDrawColor(renderer, active_settings ? hover_color.r : but_color.r, active_settings ? hover_color.g : but_color.g, active_settings ? hover_color.b : but_color.b, active_settings ? hover_color.a : but_color.a);
+
+    SDL_RenderFillRect(renderer, &settings_but);
+
+    render_text("SETTINGS", but_x + (but_w - 80) / 2, 235 + but_spacing, text_color);
+
+    SDL_Rect exit_but = {but_x, 220 + 2 * but_spacing, but_w, but_h};
+    bool active_exit = (mouse_x >= exit_but.x && mouse_x <= exit_but.x + but_w && mouse_y >= exit_but.y && mouse_y <= exit_but.y + but_h);
+
+    SDL_SetRenderDrawColor(renderer, active_exit ? hover_color.r : but_color.r, active_exit ? hover_color.g : but_color.g, active_exit ? hover_color.b : but_color.b, active_exit ? hover_color.a : but_color.a);
+
+    SDL_RenderFillRect(renderer, &exit_but);
+
+    render_text("EXIT", but_x + (but_w - 40) / 2, 235 + 2 * but_spacing, text_color);
+
+}
+
+void render_menu() {
+    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
+    SDL_Rect menu_rect = {0, 0, WINDOW_WIDTH, MENU_HEIGHT};
+    SDL_RenderFillRect(renderer, &menu_rect);
+
+    SDL_Color button_color = {100, 100, 100, 255};
+    SDL_Color text_color = {255, 255, 255, 255};
+
+    SDL_SetRenderDrawColor(renderer, button_color.r, button_color.g, button_color.b, 255);
+    SDL_Rect prev_button = {20, 20, 80, 30};
+    SDL_RenderFillRect(renderer, &prev_button);
+    render_text("<- Prev", 30, 27, text_color);
+
+    SDL_Rect next_button = {110, 20, 80, 30};
+    SDL_RenderFillRect(renderer, &next_button);
+    render_text("Next ->", 120, 27, text_color);
+
+    SDL_Rect color_button = {200, 20, 140, 30};
+    SDL_RenderFillRect(renderer, &color_button);
+    render_text("SPACE: Color", 210, 27, text_color);
+
+    SDL_Rect instant_button = {350, 20, 120, 30};
+    SDL_RenderFillRect(renderer, &instant_button);
+    render_text("I: Instant", 360, 27, text_color);
+
+    SDL_Rect reset_button = {480, 20, 80, 30};
+    SDL_RenderFillRect(renderer, &reset_button);
+    render_text("R: Reset", 490, 27, text_color);
+
+    SDL_Rect save_button = {570, 20, 100, 30};
+    SDL_RenderFillRect(renderer, &save_button);
+    render_text("S: Save", 580, 27, text_color);
+
+    if (is_coloring) {
+        SDL_Color red = {255, 0, 0, 255};
+        if (realtime_coloring) {
+            render_text("DYNAMIC COLORING", 680, 25, red);
+        } else {
+            render_text("PROCESSING...", 680, 25, red);
+        }
+    } else {
+        SDL_Color green = {0, 255, 0, 255};
+        render_text("READY", 680, 25, green);
+    }
+
+    render_text("ESC: Exit  |  Left / Right: Maps  |  SPACE: Dynamic  |  I: Instant  |  R: Reset  |  S: Save  |  E: Export  |  Wheel / + / - / 0: Zoom  |  Drag: Pan", 10, 70, text_color);
+}
+
+bool save_colored_map(const Map* map, const char* filename) {
+    bool saved = false;
+    if (map->surface) {
+        ProfileScope scope = profile_begin("save");
+        saved = SDL_SaveBMP(map->surface, filename) == 0;
+        if (!saved) {
+            log_error("Ошибка сохранения файла %s: %s", filename, SDL_GetError());
+        }
+        profile_end(&scope);
+    }
+    return saved;
+}
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+bool write_export_padding(FILE* file, uint64_t* position, uint64_t offset) {
+    static const char zeros[MAP_EXPORT_ALIGN] = {0};
+
+    while (*position < offset) {
+        uint64_t chunk = offset - *position;
+        if (chunk > MAP_EXPORT_ALIGN) chunk = MAP_EXPORT_ALIGN;
+        if (fwrite(zeros, 1, chunk, file) != chunk) return false;
+        *position += chunk;
+    }
+    return true;
+}
+
+#define MAP_EXPORT_ALIGN_UP(x) (((x) + MAP_EXPORT_ALIGN - 1) & ~(uint64_t)(MAP_EXPORT_ALIGN - 1))
+
+bool export_map(const Map* map, const char* filename, bool rle) {
+    if (!map->reg_map || !map->regions) {
+        log_error("No map loaded, nothing to export");
+        return false;
+    }
+
+    const int width = map->width;
+    const int height = map->height;
+    const int reg_count = map->reg_count;
+    const int* labels = map->reg_map;
+
+    MapExportHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_EXPORT_MAGIC, 4);
+    header.version = MAP_EXPORT_VERSION;
+    header.header_size = sizeof(MapExportHeader);
+    header.width = width;
+    header.height = height;
+    header.reg_count = reg_count;
+
+    for (int i = 0; i < reg_count; i++) {
+        if (map->regions[i].is_colored) {
+            header.flags |= MAP_EXPORT_FLAG_COLORED;
+            break;
+        }
+    }
+
+    uint64_t* row_start = NULL;
+    if (rle) {
+        row_start = mem_alloc(MEM_EXPORT, (size_t)(height + 1) * sizeof(uint64_t));
+        if (!row_start) {
+            log_error("Failed to allocate memory for RLE row index!");
+            return false;
+        }
+
+        uint64_t runs = 0;
+        for (int y = 0; y < height; y++) {
+            const int* row = labels + (size_t)y * width;
+            row_start[y] = runs;
+            for (int x = 0; x < width; x++) {
+                if (x == 0 || row[x] != row[x - 1]) runs++;
+            }
+        }
+        row_start[height] = runs;
+
+        header.flags |= MAP_EXPORT_FLAG_RLE;
+        header.run_count = runs;
+        header.labels_size = (uint64_t)(height + 1) * sizeof(uint64_t) + runs * sizeof(MapExportRun);
+    } else {
+        header.labels_size = (uint64_t)width * height * sizeof(int32_t);
+    }
+
+    uint32_t* adj_offsets = mem_alloc(MEM_EXPORT, (size_t)(reg_count + 1) * sizeof(uint32_t));
+    int* neighbor_ids = mem_alloc(MEM_EXPORT, (size_t)(reg_count > 0 ? reg_count : 1) * sizeof(int));
+    MapExportRun* runs = rle ? mem_alloc(MEM_EXPORT, (size_t)width * sizeof(MapExportRun)) : NULL;
+    if (!adj_offsets || !neighbor_ids || (rle && !runs)) {
+        log_error("Failed to allocate memory for map export!");
+        mem_free(row_start);
+        mem_free(adj_offsets);
+        mem_free(neighbor_ids);
+        mem_free(runs);
+        return false;
+    }
+
+    adj_offsets[0] = 0;
+    for (int i = 0; i < reg_count; i++) {
+        uint32_t degree = 0;
+        for (NeighborNode* n = map->regions[i].neighbors; n; n = n->next) {
+            degree++;
+        }
+        adj_offsets[i + 1] = adj_offsets[i] + degree;
+    }
+    header.edge_count = adj_offsets[reg_count];
+
+    header.labels_offset = MAP_EXPORT_ALIGN_UP(sizeof(MapExportHeader));
+    header.regions_offset = MAP_EXPORT_ALIGN_UP(header.labels_offset + header.labels_size);
+    header.adj_offsets_offset = MAP_EXPORT_ALIGN_UP(header.regions_offset + (uint64_t)reg_count * sizeof(MapExportRegion));
+    header.adj_ids_offset = MAP_EXPORT_ALIGN_UP(header.adj_offsets_offset + (uint64_t)(reg_count + 1) * sizeof(uint32_t));
+    header.file_size = header.adj_ids_offset + header.edge_count * sizeof(int32_t);
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        log_error("Failed to open export file %s", filename);
+        mem_free(row_start);
+        mem_free(adj_offsets);
+        mem_free(neighbor_ids);
+        mem_free(runs);
+        return false;
+    }
+
+    uint64_t position = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    position += sizeof(header);
+
+    ok = ok && write_export_padding(file, &position, header.labels_offset);
+    if (rle) {
+        ok = ok && fwrite(row_start, sizeof(uint64_t), height + 1, file) == (size_t)(height + 1);
+        position += (uint64_t)(height + 1) * sizeof(uint64_t);
+        for (int y = 0; y < height && ok; y++) {
+            const int* row = labels + (size_t)y * width;
+            int run_count = 0;
+            for (int x = 0; x < width; x++) {
+                if (x == 0 || row[x] != row[x - 1]) {
+                    runs[run_count].label = row[x];
+                    runs[run_count].length = 0;
+                    run_count++;
+                }
+                runs[run_count - 1].length++;
+            }
+            ok = fwrite(runs, sizeof(MapExportRun), run_count, file) == (size_t)run_count;
+            position += (uint64_t)run_count * sizeof(MapExportRun);
+        }
+    } else {
+        ok = ok && fwrite(labels, sizeof(int32_t), (size_t)width * height, file) == (size_t)width * height;
+        position += header.labels_size;
+    }
+
+    ok = ok && write_export_padding(file, &position, header.regions_offset);
+    for (int i = 0; i < reg_count && ok; i++) {
+        Region* region = &map->regions[i];
+        MapExportRegion record;
+        memset(&record, 0, sizeof(record));
+        record.pixel_count = region->pixel_count;
+        record.min_x = region->min_x;
+        record.min_y = region->min_y;
+        record.max_x = region->max_x;
+        record.max_y = region->max_y;
+        record.color = region->is_colored ? region->color : -1;
+        if (region->is_colored && region->color >= 0 && region->color < map_options_of(map)->palette.size) {
+            SDL_Color c = map_options_of(map)->palette.colors[region->color];
+            record.argb = 0xFF000000u | ((uint32_t)c.r << 16) | ((uint32_t)c.g << 8) | c.b;
+        }
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+        position += sizeof(record);
+    }
+
+    ok = ok && write_export_padding(file, &position, header.adj_offsets_offset);
+    ok = ok && fwrite(adj_offsets, sizeof(uint32_t), reg_count + 1, file) == (size_t)(reg_count + 1);
+    position += (uint64_t)(reg_count + 1) * sizeof(uint32_t);
+
+    ok = ok && write_export_padding(file, &position, header.adj_ids_offset);
+    for (int i = 0; i < reg_count && ok; i++) {
+        int degree = 0;
+        for (NeighborNode* n = map->regions[i].neighbors; n; n = n->next) {
+            neighbor_ids[degree++] = n->region_id;
+        }
+        qsort(neighbor_ids, degree, sizeof(int), compare_ints);
+        ok = fwrite(neighbor_ids, sizeof(int32_t), degree, file) == (size_t)degree;
+    }
+
+    if (fclose(file) != 0) ok = false;
+
+    mem_free(row_start);
+    mem_free(adj_offsets);
+    mem_free(neighbor_ids);
+    mem_free(runs);
+
+    if (!ok) {
+        log_error("Failed to write export file %s", filename);
+        remove(filename);
+        return false;
+    }
+
+    log_info("Exported %d regions, %llu adjacencies to %s (%llu bytes)", reg_count, (unsigned long long)header.edge_count, filename, (unsigned long long)header.file_size);
+    return true;
+}
+
+bool vector_is_geojson(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    return dot && (strcmp(dot, ".geojson") == 0 || strcmp(dot, ".json") == 0);
+}
+
+bool export_vector(const Map* map, const char* filename, bool geojson, double tolerance) {
+    if (!map->reg_map || !map->regions) {
+        log_error("No map loaded, nothing to export");
+        return false;
+    }
+
+    VectorMap vector;
+    memset(&vector, 0, sizeof(vector));
+
+    ProfileScope trace_scope = profile_begin("trace_boundaries");
+    bool ok = trace_map_boundaries(map, &vector);
+    profile_end(&trace_scope);
+
+    if (ok) {
+        assign_vector_holes(&vector);
+        ProfileScope simplify_scope = profile_begin("simplify");
+        ok = simplify_vector_map(map, &vector, tolerance);
+        profile_end(&simplify_scope);
+    }
+
+    if (ok) {
+        ProfileScope write_scope = profile_begin("write_vector");
+        ok = write_vector_map(map, &vector, filename, geojson);
+        profile_end(&write_scope);
+    }
+
+    free_vector_map(&vector);
+    return ok;
+}
+
+void free_vector_map(VectorMap* vector) {
+    mem_free(vector->points);
+    mem_free(vector->rings);
+    memset(vector, 0, sizeof(VectorMap));
+}
+
+int trace_label(const Map* map, int x, int y) {
+    if (x < 0 || y < 0 || x >= map->width || y >= map->height) return -1;
+    return map->reg_map[(size_t)y * map->width + x];
+}
+
+bool add_vector_point(VectorMap* vector, int x, int y) {
+    if (vector->point_count == vector->point_capacity) {
+        size_t capacity = vector->point_capacity ? vector->point_capacity * 2 : STACK_INITIAL_CAPACITY;
+        int32_t* points = mem_realloc(MEM_VECTOR, vector->points, capacity * 2 * sizeof(int32_t));
+        if (!points) return false;
+        vector->points = points;
+        vector->point_capacity = capacity;
+    }
+    vector->points[vector->point_count * 2] = x;
+    vector->points[vector->point_count * 2 + 1] = y;
+    vector->point_count++;
+    return true;
+}
+
+/*
+ * Crack following: boundary edges run along pixel sides and are walked with
+ * the region on the right, so outer rings come out clockwise on screen
+ * (positive shoelace area with y down) and holes counterclockwise. At a
+ * corner shared by two diagonal pixels of the region the walk turns so that
+ * they stay apart under 4-connectivity. Only corners are stored.
+ */
+bool trace_map_boundaries(const Map* map, VectorMap* vector) {
+    /* Headings right, down, left, up; edges are named by the pixel on their right and its side. */
+    static const int step_x[4] = {1, 0, -1, 0}, step_y[4] = {0, 1, 0, -1};
+    static const int right_x[4] = {0, -1, -1, 0}, right_y[4] = {0, 0, -1, -1};
+    static const int across_x[4] = {0, 1, 0, -1}, across_y[4] = {-1, 0, 1, 0};
+    /* Pixels around a corner as offsets: NW, NE, SW, SE, and which are ahead-left / ahead-right per heading. */
+    static const int corner_x[4] = {-1, 0, -1, 0}, corner_y[4] = {-1, -1, 0, 0};
+    static const int ahead_left[4] = {1, 3, 2, 0}, ahead_right[4] = {3, 2, 0, 1};
+
+    const int width = map->width;
+    const int height = map->height;
+    unsigned char* done = mem_calloc(MEM_VECTOR, (size_t)width * height, 1);
+    if (!done) {
+        log_error("Failed to allocate memory for boundary tracing!");
+        return false;
+    }
+
+    bool ok = true;
+    for (int y = 0; y < height && ok; y++) {
+        for (int x = 0; x < width && ok; x++) {
+            int region = map->reg_map[(size_t)y * width + x];
+            if (region < 0) continue;
+
+            for (int side = 0; side < 4 && ok; side++) {
+                if (done[(size_t)y * width + x] & (1u << side)) continue;
+                if (trace_label(map, x + across_x[side], y + across_y[side]) == region) continue;
+
+                if (vector->ring_count == vector->ring_capacity) {
+                    int capacity = vector->ring_capacity ? vector->ring_capacity * 2 : 256;
+                    VectorRing* rings = mem_realloc(MEM_VECTOR, vector->rings, (size_t)capacity * sizeof(VectorRing));
+                    if (!rings) {
+                        ok = false;
+                        break;
+                    }
+                    vector->rings = rings;
+                    vector->ring_capacity = capacity;
+                }
+                VectorRing* ring = &vector->rings[vector->ring_count++];
+                ring->region = region;
+                ring->start = vector->point_count;
+                ring->parent = -1;
+                ring->probe_x = x + across_x[side];
+                ring->probe_y = y + across_y[side];
+
+                int start_x = x - right_x[side], start_y = y - right_y[side];
+                int vx = start_x, vy = start_y, heading = side;
+                do {
+                    int px = vx + right_x[heading], py = vy + right_y[heading];
+                    done[(size_t)py * width + px] |= (unsigned char)(1u << heading);
+                    vx += step_x[heading];
+                    vy += step_y[heading];
+
+                    bool left_in = trace_label(map, vx + corner_x[ahead_left[heading]], vy + corner_y[ahead_left[heading]]) == region;
+                    bool right_in = trace_label(map, vx + corner_x[ahead_right[heading]], vy + corner_y[ahead_right[heading]]) == region;
+                    int next = heading;
+                    if (!right_in) {
+                        next = (heading + 1) & 3;
+                    } else if (left_in) {
+                        next = (heading + 3) & 3;
+                    }
+                    if (next != heading && !add_vector_point(vector, vx, vy)) {
+                        ok = false;
+                        break;
+                    }
+                    heading = next;
+                } while (vx != start_x || vy != start_y || heading != side);
+
+                ring->count = (int)(vector->point_count - ring->start);
+                long long area2 = 0;
+                const int32_t* p = vector->points + ring->start * 2;
+                for (int i = 0; i < ring->count; i++) {
+                    int j = (i + 1) % ring->count;
+                    area2 += (long long)p[i * 2] * p[j * 2 + 1] - (long long)p[j * 2] * p[i * 2 + 1];
+                }
+                ring->area2 = area2;
+            }
+        }
+    }
+
+    mem_free(done);
+    if (!ok) {
+        log_error("Failed to allocate memory for boundary tracing!");
+    }
+    return ok;
+}
+
+/* Even-odd test of a pixel center against an axis-aligned ring, before simplification. */
+bool ring_contains_pixel(const VectorMap* vector, const VectorRing* ring, int x, int y) {
+    const int32_t* p = vector->points + ring->start * 2;
+    bool inside = false;
+    for (int i = 0; i < ring->count; i++) {
+        int j = (i + 1) % ring->count;
+        int x1 = p[i * 2], y1 = p[i * 2 + 1], y2 = p[j * 2 + 1];
+        if (x1 == p[j * 2] && x1 > x && ((y1 <= y && y < y2) || (y2 <= y && y < y1))) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+/* Gives every hole the smallest outer ring of its region that contains the pixel just inside it. */
+void assign_vector_holes(VectorMap* vector) {
+    for (int h = 0; h < vector->ring_count; h++) {
+        VectorRing* hole = &vector->rings[h];
+        if (hole->area2 > 0) continue;
+
+        for (int o = 0; o < vector->ring_count; o++) {
+            const VectorRing* outer = &vector->rings[o];
+            if (outer->region != hole->region || outer->area2 <= 0) continue;
+            if (hole->parent >= 0 && outer->area2 >= vector->rings[hole->parent].area2) continue;
+            if (ring_contains_pixel(vector, outer, hole->probe_x, hole->probe_y)) {
+                hole->parent = o;
+            }
+        }
+    }
+}
+
+double point_segment_distance2(const int32_t* p, const int32_t* a, const int32_t* b) {
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double length2 = dx * dx + dy * dy;
+    double t = length2 > 0 ? ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / length2 : 0.0;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    double ex = a[0] + t * dx - p[0], ey = a[1] + t * dy - p[1];
+    return ex * ex + ey * ey;
+}
+
+/*
+ * A corner where three labels meet, or two meet diagonally. Every other
+ * corner lies on exactly one border between two labels, so cutting the rings
+ * at these gives chains that two neighboring rings share point for point.
+ */
+bool vector_node(const Map* map, int x, int y) {
+    int a = trace_label(map, x - 1, y - 1), b = trace_label(map, x, y - 1);
+    int c = trace_label(map, x - 1, y), d = trace_label(map, x, y);
+    int distinct = 1 + (b != a) + (c != a && c != b) + (d != a && d != b && d != c);
+    return distinct >= 3 || (a == d && b == c && a != b);
+}
+
+/*
+ * Douglas-Peucker between p[first] and p[last], which stay. The points in
+ * between are marked VECTOR_DECIDED, the ones that stay also VECTOR_KEEP.
+ */
+void simplify_chain(const int32_t* p, int first, int last, double limit, int* spans, unsigned char* marks, int stride) {
+    for (int i = first + 1; i < last; i++) {
+        marks[(size_t)p[i * 2 + 1] * stride + p[i * 2]] |= VECTOR_DECIDED;
+    }
+
+    int span_count = 0;
+    spans[span_count * 2] = first;
+    spans[span_count * 2 + 1] = last;
+    span_count++;
+    while (span_count > 0) {
+        span_count--;
+        int a = spans[span_count * 2], b = spans[span_count * 2 + 1];
+        int split = -1;
+        double split_distance = limit;
+        for (int i = a + 1; i < b; i++) {
+            double d = point_segment_distance2(p + i * 2, p + a * 2, p + b * 2);
+            if (d > split_distance) {
+                split_distance = d;
+                split = i;
+            }
+        }
+        if (split < 0) continue;
+        marks[(size_t)p[split * 2 + 1] * stride + p[split * 2]] |= VECTOR_KEEP;
+        spans[span_count * 2] = a;
+        spans[span_count * 2 + 1] = split;
+        span_count++;
+        spans[span_count * 2] = split;
+        spans[span_count * 2 + 1] = b;
+        span_count++;
+    }
+}
+
+/*
+ * Copies a ring into chain with the nodes it runs straight through added,
+ * where a neighbor's border ends on one of its sides. Returns the point
+ * count n and sets offset to the first node, or -1 when there is none.
+ * chain + max(offset, 0) * 2 then holds the ring from that point on, with
+ * the point repeated at index n, so every chain between nodes is one span.
+ * chain needs room for twice the ring's perimeter plus one.
+ */
+int expand_vector_ring(const Map* map, const VectorMap* vector, const VectorRing* ring, int32_t* chain, int* offset) {
+    const int32_t* p = vector->points + ring->start * 2;
+    int n = 0;
+    *offset = -1;
+    for (int i = 0; i < ring->count; i++) {
+        int j = (i + 1) % ring->count;
+        int x = p[i * 2], y = p[i * 2 + 1];
+        int dx = (p[j * 2] > x) - (p[j * 2] < x), dy = (p[j * 2 + 1] > y) - (p[j * 2 + 1] < y);
+        do {
+            if (vector_node(map, x, y)) {
+                if (*offset < 0) *offset = n;
+            } else if (x != p[i * 2] || y != p[i * 2 + 1]) {
+                x += dx;
+                y += dy;
+                continue;
+            }
+            chain[n * 2] = x;
+            chain[n * 2 + 1] = y;
+            n++;
+            x += dx;
+            y += dy;
+        } while (x != p[j * 2] || y != p[j * 2 + 1]);
+    }
+    for (int i = 0; i <= SDL_max(*offset, 0); i++) {
+        chain[(n + i) * 2] = chain[i * 2];
+        chain[(n + i) * 2 + 1] = chain[i * 2 + 1];
+    }
+    return n;
+}
+
+/*
+ * Douglas-Peucker per border chain rather than per ring, so two neighbors
+ * keep the same points along their shared border and the polygons neither
+ * gap nor overlap. Rings are cut at vector_node corners; the first ring to
+ * reach a chain simplifies it and marks its corners on a grid, later rings
+ * read the marks. A ring without nodes is one closed chain, split at its
+ * first point and the point farthest from it. A ring that would drop below
+ * three points keeps all of them, and so do its neighbors along it, so small
+ * regions keep their shape instead of vanishing.
+ */
+bool simplify_vector_map(const Map* map, VectorMap* vector, double tolerance) {
+    if (tolerance <= 0 || vector->ring_count == 0) return true;
+
+    long long longest = 0;
+    for (int r = 0; r < vector->ring_count; r++) {
+        const int32_t* p = vector->points + vector->rings[r].start * 2;
+        int n = vector->rings[r].count;
+        long long perimeter = 0;
+        for (int i = 0; i < n; i++) {
+            int j = (i + 1) % n;
+            perimeter += abs(p[j * 2] - p[i * 2]) + abs(p[j * 2 + 1] - p[i * 2 + 1]);
+        }
+        if (perimeter > longest) longest = perimeter;
+    }
+    const int stride = map->width + 1;
+    unsigned char* marks = mem_calloc(MEM_VECTOR, (size_t)stride * (map->height + 1), 1);
+    int32_t* chain = mem_alloc(MEM_VECTOR, ((size_t)longest * 2 + 1) * 2 * sizeof(int32_t));
+    int* spans = mem_alloc(MEM_VECTOR, ((size_t)longest + 1) * 2 * sizeof(int));
+    if (!marks || !chain || !spans) {
+        log_error("Failed to allocate memory for simplification!");
+        mem_free(marks);
+        mem_free(chain);
+        mem_free(spans);
+        return false;
+    }
+
+    double limit = tolerance * tolerance;
+    for (int r = 0; r < vector->ring_count; r++) {
+        int offset;
+        int n = expand_vector_ring(map, vector, &vector->rings[r], chain, &offset);
+        const int32_t* q = chain + SDL_max(offset, 0) * 2;
+
+        if (offset < 0) {
+            unsigned char* mark = &marks[(size_t)q[1] * stride + q[0]];
+            if (*mark & VECTOR_DECIDED) continue;
+            int far = 0;
+            double far_distance = -1;
+            for (int i = 1; i < n; i++) {
+                double dx = q[i * 2] - q[0], dy = q[i * 2 + 1] - q[1];
+                if (dx * dx + dy * dy > far_distance) {
+                    far_distance = dx * dx + dy * dy;
+                    far = i;
+                }
+            }
+            *mark |= VECTOR_KEEP | VECTOR_DECIDED;
+            marks[(size_t)q[far * 2 + 1] * stride + q[far * 2]] |= VECTOR_KEEP | VECTOR_DECIDED;
+            simplify_chain(q, 0, far, limit, spans, marks, stride);
+            simplify_chain(q, far, n, limit, spans, marks, stride);
+            continue;
+        }
+
+        int first = 0;
+        for (int i = 1; i <= n; i++) {
+            if (i < n && !vector_node(map, q[i * 2], q[i * 2 + 1])) continue;
+            marks[(size_t)q[first * 2 + 1] * stride + q[first * 2]] |= VECTOR_KEEP | VECTOR_DECIDED;
+            bool decided = i == first + 1 || (marks[(size_t)q[first * 2 + 3] * stride + q[first * 2 + 2]] & VECTOR_DECIDED);
+            if (!decided) simplify_chain(q, first, i, limit, spans, marks, stride);
+            first = i;
+        }
+    }
+
+    size_t total = 0;
+    for (int r = 0; r < vector->ring_count; r++) {
+        int offset;
+        int n = expand_vector_ring(map, vector, &vector->rings[r], chain, &offset);
+        int kept = 0;
+        for (int i = 0; i < n; i++) kept += marks[(size_t)chain[i * 2 + 1] * stride + chain[i * 2]] & VECTOR_KEEP;
+        if (kept < 3) {
+            for (int i = 0; i < n; i++) marks[(size_t)chain[i * 2 + 1] * stride + chain[i * 2]] |= VECTOR_KEEP;
+            kept = n;
+        }
+        total += (size_t)kept;
+    }
+
+    /* Nodes a ring ran straight through can make it longer, so the kept points go to a new array. */
+    int32_t* points = mem_alloc(MEM_VECTOR, (total > 0 ? total : 1) * 2 * sizeof(int32_t));
+    size_t out = 0;
+    for (int r = 0; r < vector->ring_count && points; r++) {
+        VectorRing* ring = &vector->rings[r];
+        int offset;
+        int n = expand_vector_ring(map, vector, ring, chain, &offset);
+        size_t start = out;
+        for (int i = 0; i < n; i++) {
+            if (!(marks[(size_t)chain[i * 2 + 1] * stride + chain[i * 2]] & VECTOR_KEEP)) continue;
+            points[out * 2] = chain[i * 2];
+            points[out * 2 + 1] = chain[i * 2 + 1];
+            out++;
+        }
+        ring->start = start;
+        ring->count = (int)(out - start);
+    }
+
+    mem_free(marks);
+    mem_free(chain);
+    mem_free(spans);
+    if (!points) {
+        log_error("Failed to allocate memory for simplification!");
+        return false;
+    }
+    mem_free(vector->points);
+    vector->points = points;
+    vector->point_count = vector->point_capacity = out;
+    return true;
+}
+
+void write_svg_ring(FILE* file, const VectorMap* vector, const VectorRing* ring) {
+    const int32_t* p = vector->points + ring->start * 2;
+    fprintf(file, "M%d %d", p[0], p[1]);
+    for (int i = 1; i < ring->count; i++) {
+        fprintf(file, " %d %d", p[i * 2], p[i * 2 + 1]);
+    }
+    fputc('Z', file);
+}
+
+void write_geojson_ring(FILE* file, const VectorMap* vector, const VectorRing* ring) {
+    const int32_t* p = vector->points + ring->start * 2;
+    fputc('[', file);
+    for (int i = 0; i <= ring->count; i++) {
+        int k = i % ring->count;
+        fprintf(file, "%s[%d,%d]", i ? "," : "", p[k * 2], p[k * 2 + 1]);
+    }
+    fputc(']', file);
+}
+
+/*
+ * One SVG path or GeoJSON MultiPolygon per region, in pixel coordinates with
+ * y pointing down. Ink is left to the black SVG background. GeoJSON outer
+ * rings are counterclockwise once y is read as pointing up, as RFC 7946 asks.
+ */
+bool write_vector_map(const Map* map, const VectorMap* vector, const char* filename, bool geojson) {
+    const int reg_count = map->reg_count;
+    int* first = mem_alloc(MEM_VECTOR, (size_t)(reg_count + 1) * sizeof(int));
+    int* order = mem_alloc(MEM_VECTOR, (size_t)(vector->ring_count > 0 ? vector->ring_count : 1) * sizeof(int));
+    if (!first || !order) {
+        log_error("Failed to allocate memory for vector export!");
+        mem_free(first);
+        mem_free(order);
+        return false;
+    }
+
+    memset(first, 0, (size_t)(reg_count + 1) * sizeof(int));
+    for (int r = 0; r < vector->ring_count; r++) first[vector->rings[r].region + 1]++;
+    for (int i = 0; i < reg_count; i++) first[i + 1] += first[i];
+    for (int r = 0; r < vector->ring_count; r++) order[first[vector->rings[r].region]++] = r;
+    for (int i = reg_count; i > 0; i--) first[i] = first[i - 1];
+    first[0] = 0;
+
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        log_error("Failed to open vector file %s", filename);
+        mem_free(first);
+        mem_free(order);
+        return false;
+    }
+
+    if (geojson) {
+        fprintf(file, "{\"type\":\"FeatureCollection\",\"features\":[");
+    } else {
+        fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\">\n",
+                map->width, map->height, map->width, map->height);
+        fprintf(file, "<rect width=\"%d\" height=\"%d\" fill=\"#000000\"/>\n", map->width, map->height);
+    }
+
+    int features = 0;
+    for (int i = 0; i < reg_count; i++) {
+        if (first[i] == first[i + 1]) continue;
+
+        const Region* region = &map->regions[i];
+        SDL_Color fill = {255, 255, 255, 255};
+        if (region->is_colored && region->color >= 0 && region->color < map_options_of(map)->palette.size) {
+            fill = map_options_of(map)->palette.colors[region->color];
+        }
+
+        if (!geojson) {
+            fprintf(file, "<path fill=\"#%02x%02x%02x\" fill-rule=\"evenodd\" d=\"", fill.r, fill.g, fill.b);
+            for (int k = first[i]; k < first[i + 1]; k++) {
+                write_svg_ring(file, vector, &vector->rings[order[k]]);
+            }
+            fprintf(file, "\"/>\n");
+            features++;
+            continue;
+        }
+
+        fprintf(file, "%s\n{\"type\":\"Feature\",\"properties\":{\"region\":%d,\"color\":%d,\"fill\":\"#%02x%02x%02x\",\"pixels\":%d},",
+                features ? "," : "", i, region->is_colored ? region->color : -1, fill.r, fill.g, fill.b, region->pixel_count);
+        fprintf(file, "\"geometry\":{\"type\":\"MultiPolygon\",\"coordinates\":[");
+        int polygons = 0;
+        for (int k = first[i]; k < first[i + 1]; k++) {
+            int outer = order[k];
+            if (vector->rings[outer].area2 <= 0) continue;
+            fprintf(file, "%s[", polygons++ ? "," : "");
+            write_geojson_ring(file, vector, &vector->rings[outer]);
+            for (int h = first[i]; h < first[i + 1]; h++) {
+                if (vector->rings[order[h]].parent != outer) continue;
+                fputc(',', file);
+                write_geojson_ring(file, vector, &vector->rings[order[h]]);
+            }
+            fputc(']', file);
+        }
+        fprintf(file, "]}}");
+        features++;
+    }
+
+    fprintf(file, geojson ? "\n]}\n" : "</svg>\n");
+    long size = ftell(file);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    mem_free(first);
+    mem_free(order);
+
+    if (!ok) {
+        log_error("Failed to write vector file %s", filename);
+        remove(filename);
+        return false;
+    }
+
+    log_info("Traced %d regions into %d rings, %llu points, %s written to %s (%ld bytes)", features, vector->ring_count,
+             (unsigned long long)vector->point_count, geojson ? "GeoJSON" : "SVG", filename, size);
+    return true;
+}
+
+bool is_map_export(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+
+    char magic[4];
+    bool result = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, MAP_EXPORT_MAGIC, 4) == 0;
+    fclose(file);
+    return result;
+}
+
+bool load_map_export(Map* map, const char* filename) {
+    return read_map_export(map, filename, true);
+}
+
+/* True when count elements of element_size bytes at offset lie inside file_size bytes and offset is a multiple of align. */
+bool export_section_fits(uint64_t offset, uint64_t align, uint64_t count, uint64_t element_size, uint64_t file_size) {
+    if (offset % align != 0 || count > file_size / element_size) return false;
+    uint64_t size = count * element_size;
+    return offset <= file_size && size <= file_size - offset;
+}
+
+bool read_map_export(Map* map, const char* filename, bool with_surface) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        log_error("Failed to open map export %s", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(MapExportHeader)) {
+        log_error("Map export %s is truncated", filename);
+        close(fd);
+        return false;
+    }
+
+    size_t file_size = (size_t)st.st_size;
+    const unsigned char* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Failed to mmap map export %s", filename);
+        return false;
+    }
+
+    const MapExportHeader* header = (const MapExportHeader*)data;
+    const int width = header->width;
+    const int height = header->height;
+    const int reg_count = header->reg_count;
+    const bool rle = (header->flags & MAP_EXPORT_FLAG_RLE) != 0;
+
+    bool valid = memcmp(header->magic, MAP_EXPORT_MAGIC, 4) == 0 && header->version == MAP_EXPORT_VERSION &&
+                 header->header_size == sizeof(MapExportHeader) && header->file_size <= file_size && width > 0 && height > 0 &&
+                 reg_count >= 0 && reg_count <= MAX_REGIONS && (with_surface || (width == map->width && height == map->height));
+
+    /* Counts come from the file, so each is bounded before it is multiplied and every sum is checked against the file. */
+    uint64_t labels_size = 0;
+    if (valid && rle) {
+        uint64_t rows_size = ((uint64_t)height + 1) * sizeof(uint64_t);
+        valid = export_section_fits(header->labels_offset, MAP_EXPORT_ALIGN, (uint64_t)height + 1, sizeof(uint64_t), header->file_size) &&
+                export_section_fits(header->labels_offset + rows_size, sizeof(uint64_t), header->run_count, sizeof(MapExportRun), header->file_size);
+        labels_size = valid ? rows_size + header->run_count * sizeof(MapExportRun) : 0;
+    } else if (valid) {
+        valid = export_section_fits(header->labels_offset, MAP_EXPORT_ALIGN, (uint64_t)width * height, sizeof(int32_t), header->file_size);
+        labels_size = (uint64_t)width * height * sizeof(int32_t);
+    }
+    valid = valid && header->labels_size == labels_size &&
+            export_section_fits(header->regions_offset, MAP_EXPORT_ALIGN, (uint64_t)reg_count, sizeof(MapExportRegion), header->file_size) &&
+            export_section_fits(header->adj_offsets_offset, MAP_EXPORT_ALIGN, (uint64_t)reg_count + 1, sizeof(uint32_t), header->file_size) &&
+            export_section_fits(header->adj_ids_offset, MAP_EXPORT_ALIGN, header->edge_count, sizeof(int32_t), header->file_size);
+
+    if (!valid) {
+        log_error("Invalid or unsupported map export %s", filename);
+        munmap((void*)data, file_size);
+        return false;
+    }
+
+    const MapExportRegion* records = (const MapExportRegion*)(data + header->regions_offset);
+    const uint32_t* adj_offsets = (const uint32_t*)(data + header->adj_offsets_offset);
+    const int32_t* adj_ids = (const int32_t*)(data + header->adj_ids_offset);
+
+    if (with_surface) {
+        map->surface = mem_track_surface(MEM_SURFACE, SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888));
+    }
+    map->reg_map = mem_alloc(MEM_REG_MAP, (size_t)width * height * sizeof(int));
+    map->regions = mem_calloc(MEM_REGIONS, MAX_REGIONS, sizeof(Region));
+    bool ok = map->surface && map->reg_map && map->regions;
+
+    if (ok) {
+        map->width = width;
+        map->height = height;
+        map->pixels = (unsigned int*)map->surface->pixels;
+
+        if (rle) {
+            const uint64_t* row_start = (const uint64_t*)(data + header->labels_offset);
+            const MapExportRun* runs = (const MapExportRun*)(row_start + height + 1);
+            for (int y = 0; y < height && ok; y++) {
+                int* row = map->reg_map + (size_t)y * width;
+                int x = 0;
+                if (row_start[y] > row_start[y + 1] || row_start[y + 1] > header->run_count) {
+                    ok = false;
+                    break;
+                }
+                for (uint64_t r = row_start[y]; r < row_start[y + 1]; r++) {
+                    if (runs[r].length <= 0 || runs[r].length > width - x) {
+                        ok = false;
+                        break;
+                    }
+                    for (int k = 0; k < runs[r].length; k++) {
+                        row[x++] = runs[r].label;
+                    }
+                }
+                if (x != width) ok = false;
+            }
+        } else {
+            memcpy(map->reg_map, data + header->labels_offset, labels_size);
+        }
+    }
+
+    if (ok && adj_offsets[0] != 0) ok = false;
+    for (int i = 0; i < reg_count && ok; i++) {
+        if (adj_offsets[i + 1] < adj_offsets[i] || adj_offsets[i + 1] > header->edge_count) ok = false;
+    }
+
+    if (ok) {
+        for (int i = 0; i < reg_count && ok; i++) {
+            Region* region = &map->regions[i];
+            region->id = i;
+            region->pixel_count = 0;
+            region->min_x = width;
+            region->min_y = height;
+            region->max_x = -1;
+            region->max_y = -1;
+            region->color = -1;
+            region->is_colored = false;
+            if (with_surface && (header->flags & MAP_EXPORT_FLAG_COLORED) && records[i].color >= 0 && records[i].color < map_options_of(map)->palette.size) {
+                region->color = records[i].color;
+                region->is_colored = true;
+            }
+
+            for (uint32_t e = adj_offsets[i + 1]; e > adj_offsets[i]; e--) {
+                int neighbor_id = adj_ids[e - 1];
+                if (neighbor_id < 0 || neighbor_id >= reg_count) {
+                    ok = false;
+                    break;
+                }
+                NeighborNode* node = arena_alloc(&map->arena, sizeof(NeighborNode));
+                if (!node) {
+                    ok = false;
+                    break;
+                }
+                node->region_id = neighbor_id;
+                node->next = region->neighbors;
+                region->neighbors = node;
+            }
+        }
+        map->reg_count = reg_count;
+    }
+
+    /*
+     * Bounding boxes and pixel counts are taken from the labels checked here
+     * rather than from the records, so a damaged file cannot send the loops
+     * that walk a region's box outside the map. Every region needs a pixel.
+     */
+    if (ok) {
+        unsigned int ink = SDL_MapRGB(map->surface->format, 0, 0, 0);
+        unsigned int paper = SDL_MapRGB(map->surface->format, 255, 255, 255);
+
+        for (int y = 0; y < height && ok; y++) {
+            const int* labels = map->reg_map + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                int label = labels[x];
+                if (label < -1 || label >= reg_count) {
+                    ok = false;
+                    break;
+                }
+                if (with_surface) {
+                    map->pixels[(size_t)y * width + x] = label == -1 ? ink : paper;
+                }
+                if (label < 0) continue;
+
+                Region* region = &map->regions[label];
+                region->pixel_count++;
+                if (x < region->min_x) region->min_x = x;
+                if (x > region->max_x) region->max_x = x;
+                if (y < region->min_y) region->min_y = y;
+                if (y > region->max_y) region->max_y = y;
+            }
+        }
+        for (int i = 0; i < reg_count && ok; i++) {
+            ok = map->regions[i].pixel_count > 0;
+        }
+    }
+
+    if (ok && with_surface) {
+        map->original_surface = mem_track_surface(MEM_ORIGINAL_SURFACE, SDL_ConvertSurface(map->surface, map->surface->format, 0));
+        ok = map->original_surface != NULL;
+    }
+
+    uint64_t edge_count = header->edge_count;
+    munmap((void*)data, file_size);
+
+    if (!ok) {
+        log_error("Failed to load map export %s", filename);
+        arena_release(&map->arena);
+        if (map->regions) {
+            mem_free(map->regions);
+            map->regions = NULL;
+        }
+        mem_free(map->reg_map);
+        map->reg_map = NULL;
+        map->reg_count = 0;
+        if (with_surface) {
+            mem_free_surface(MEM_SURFACE, map->surface);
+            mem_free_surface(MEM_ORIGINAL_SURFACE, map->original_surface);
+            memset(map, 0, sizeof(Map));
+        }
+        return false;
+    }
+
+    int max_color = -1;
+    for (int i = 0; i < reg_count; i++) {
+        if (map->regions[i].is_colored && map->regions[i].color > max_color) {
+            max_color = map->regions[i].color;
+        }
+    }
+
+    if (max_color >= 0) {
+        unsigned int color_pixels[MAX_COLORS];
+        const Palette* palette = &map_options_of(map)->palette;
+        for (int c = 0; c < palette->size; c++) {
+            color_pixels[c] = SDL_MapRGB(map->surface->format, palette->colors[c].r, palette->colors[c].g, palette->colors[c].b);
+        }
+
+        size_t map_size = (size_t)width * height;
+        for (size_t i = 0; i < map_size; i++) {
+            int label = map->reg_map[i];
+            if (label >= 0 && map->regions[label].is_colored) {
+                map->pixels[i] = color_pixels[map->regions[label].color];
+            }
+        }
+    }
+    if (with_surface) {
+        map->colors_used = max_color + 1;
+    }
+
+    log_info("Loaded map export %s (%dx%d, %d regions, %llu adjacencies)", filename, width, height, reg_count, (unsigned long long)edge_count);
+    return true;
+}
+
+#define HASH_PRIME1 11400714785074694791ULL
+#define HASH_PRIME2 14029467366897019727ULL
+#define HASH_PRIME3 1609587929392839161ULL
+#define HASH_PRIME4 9650029242287828579ULL
+#define HASH_PRIME5 2870177450012600261ULL
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = data;
+    const unsigned char* end = p + len;
+    uint64_t h, k;
+
+    if (len >= 32) {
+        uint64_t v[4] = {seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1};
+        const unsigned char* limit = end - 32;
+        do {
+            for (int lane = 0; lane < 4; lane++) {
+                memcpy(&k, p, 8);
+                v[lane] += k * HASH_PRIME2;
+                v[lane] = HASH_ROTL(v[lane], 31) * HASH_PRIME1;
+                p += 8;
+            }
+        } while (p <= limit);
+
+        h = HASH_ROTL(v[0], 1) + HASH_ROTL(v[1], 7) + HASH_ROTL(v[2], 12) + HASH_ROTL(v[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            k = HASH_ROTL(v[lane] * HASH_PRIME2, 31) * HASH_PRIME1;
+            h = (h ^ k) * HASH_PRIME1 + HASH_PRIME4;
+        }
+    } else {
+        h = seed + HASH_PRIME5;
+    }
+
+    h += len;
+    while (p + 8 <= end) {
+        memcpy(&k, p, 8);
+        k = HASH_ROTL(k * HASH_PRIME2, 31) * HASH_PRIME1;
+        h = HASH_ROTL(h ^ k, 27) * HASH_PRIME1 + HASH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t k32;
+        memcpy(&k32, p, 4);
+        h = HASH_ROTL(h ^ ((uint64_t)k32 * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h = HASH_ROTL(h ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool map_cache_key(const char* filename, const MapOptions* options, char* path, size_t path_size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    bool ok = map_cache_key_data(data, (size_t)st.st_size, options, path, path_size);
+    munmap(data, (size_t)st.st_size);
+    return ok;
+}
+
+bool map_cache_key_data(const void* data, size_t size, const MapOptions* options, char* path, size_t path_size) {
+    uint64_t seed = ((uint64_t)MAP_EXPORT_VERSION << 32) | ((uint64_t)TERRITORY_RADIUS << 16) | ((uint64_t)INK_THRESHOLD << 8) |
+                    MAP_CACHE_REVISION;
+    int cleanup[3] = {options->min_region_area, options->ink_close_radius, options->color_tolerance};
+    seed = hash_bytes(cleanup, sizeof(cleanup), seed);
+    uint64_t key = hash_bytes(data, size, seed);
+
+    return snprintf(path, path_size, "%s/%016llx.cmap", cache_dir, (unsigned long long)key) < (int)path_size;
+}
+
+void map_cache_store(const Map* map, const char* path) {
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+        log_warn("Failed to create cache directory %s", cache_dir);
+        return;
+    }
+
+    char temp_path[560];
+    snprintf(temp_path, sizeof(temp_path), "%s.%lu.tmp", path, (unsigned long)SDL_ThreadID());
+    if (!export_map(map, temp_path, true)) return;
+
+    if (rename(temp_path, path) != 0) {
+        log_warn("Failed to store cache entry %s", path);
+        remove(temp_path);
+        return;
+    }
+
+    map_cache_evict();
+}
+
+int compare_cache_entries(const void* a, const void* b) {
+    const CacheEntry* x = a;
+    const CacheEntry* y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+void map_cache_evict() {
+    DIR* dir = opendir(cache_dir);
+    if (!dir) return;
+
+    CacheEntry* entries = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long total = 0;
+    char path[512];
+
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL) {
+        size_t len = strlen(item->d_name);
+        if (len < 5 || len >= sizeof(entries[0].name) || strcmp(item->d_name + len - 5, ".cmap") != 0) continue;
+
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, item->d_name);
+        if (stat(path, &st) != 0) continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheEntry* grown = realloc(entries, capacity * sizeof(CacheEntry));
+            if (!grown) break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, item->d_name);
+        entries[count].size = (unsigned long long)st.st_size;
+        entries[count].mtime = st.st_mtim;
+        total += entries[count].size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cache_limit) {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+        for (int i = 0; i < count && total > cache_limit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+            if (remove(path) == 0) {
+                total -= entries[i].size;
+                log_info("Evicted cache entry %s", path);
+            }
+        }
+    }
+
+    free(entries);
+}
+
+bool start_map_loader() {
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+        memset(&map_slots[i], 0, sizeof(MapSlot));
+        map_slots[i].index = -1;
+    }
+
+    loader_quit = false;
+    loader_mutex = SDL_CreateMutex();
+    loader_cond = SDL_CreateCond();
+    if (!loader_mutex || !loader_cond) {
+        log_error("Failed to create loader mutex: %s", SDL_GetError());
+        return false;
+    }
+
+    loader_thread = SDL_CreateThread(map_loader_thread, "map_loader", NULL);
+    if (!loader_thread) {
+        log_error("Failed to create loader thread: %s", SDL_GetError());
+        return false;
+    }
+
+    return true;
+}
+
+void stop_map_loader() {
+    if (loader_thread) {
+        SDL_LockMutex(loader_mutex);
+        loader_quit = true;
+        SDL_CondSignal(loader_cond);
+        SDL_UnlockMutex(loader_mutex);
+        SDL_WaitThread(loader_thread, NULL);
+        loader_thread = NULL;
+
+        for (int i = 0; i < PREFETCH_SLOTS; i++) {
+            free_map(&map_slots[i].map);
+            map_slots[i].index = -1;
         }
     }
+
+    if (loader_cond) {
+        SDL_DestroyCond(loader_cond);
+        loader_cond = NULL;
+    }
+    if (loader_mutex) {
+        SDL_DestroyMutex(loader_mutex);
+        loader_mutex = NULL;
+    }
 }
 
-void render_settings(){
-    if (set_bg) {
-        SDL_RenderCopy(renderer, set_bg, NULL, NULL);
+int map_loader_thread(void* data) {
+    profile_thread("loader");
+    SDL_LockMutex(loader_mutex);
+
+    while (!loader_quit) {
+        int index = next_prefetch_index();
+        MapSlot* slot = index >= 0 ? claim_map_slot() : NULL;
+        if (!slot) {
+            SDL_CondWait(loader_cond, loader_mutex);
+            continue;
+        }
+
+        slot->index = index;
+        slot->loading = true;
+        slot->ready = false;
+        slot->failed = false;
+        SDL_AtomicSet(&slot->progress, 0);
+        SDL_UnlockMutex(loader_mutex);
+
+        log_debug("Prefetching map: %s", map_files[index]);
+        bool loaded = process_map_progressive(slot, map_files[index]);
+        slot->map.progress = NULL;
+
+        SDL_LockMutex(loader_mutex);
+        if (slot->preview_ready) {
+            free_map(&slot->preview);
+            slot->preview_ready = false;
+        }
+        slot->loading = false;
+        slot->ready = true;
+        slot->failed = !loaded;
+        slot->last_used = SDL_GetTicks();
+        trim_map_slots();
     }
 
-    SDL_Color text_color = {150, 0, 0, 255};
-    render_text("Author 25", WINDOW_WIDTH/2 + 120, 15, text_color);
-    render_text("Map Coloring Game Controls:", WINDOW_WIDTH/2 + 130, 40, text_color);
-    render_text(" SPACE - Dynamic Coloring", WINDOW_WIDTH/2 + 130, 70, text_color);
-    render_text(" I - Instant Coloring", WINDOW_WIDTH/2 + 150, 100, text_color);
-    render_text(" ESC - Return to Main Menu", WINDOW_WIDTH/2 + 130, 130, text_color);
+    SDL_UnlockMutex(loader_mutex);
+    return 0;
 }
 
-void show_main_menu() {
-    if (m_m_bg) {
-        SDL_RenderCopy(renderer, m_m_bg, NULL, NULL);
+int next_prefetch_index() {
+    if (pending_map_index >= 0 && !find_map_slot(pending_map_index)) {
+        return pending_map_index;
     }
 
-    SDL_Color but_color = {70, 70, 70, 50};
-    SDL_Color hover_color = {100, 100, 100, 100};
-    SDL_Color text_color = {255, 255, 255, 255};
+    size_t resident = 0;
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+        if (map_slots[i].ready) resident += map_memory_bytes(&map_slots[i].map);
+    }
+    if (resident >= prefetch_limit) return -1;
+
+    for (int d = 1; d <= PREFETCH_RADIUS; d++) {
+        int candidates[2] = {loader_focus_index + d, loader_focus_index - d};
+        for (int c = 0; c < 2; c++) {
+            int index = candidates[c];
+            if (index < 0 || index >= total_maps || index == loaded_map_index) continue;
+            if (!find_map_slot(index)) return index;
+        }
+    }
 
-    int but_w = 200;
-    int but_h = 50;
-    int but_x = WINDOW_WIDTH / 2 - but_w / 2;
-    int but_spacing = 70;
+    return -1;
+}
 
-    render_text("MAP COLORING",  but_x + (but_w - 100) / 2, 25, (SDL_Color){64, 224, 208, 255});
-    
-    int mouse_x, mouse_y;
-    SDL_GetMouseState(&mouse_x, &mouse_y);
+MapSlot* find_map_slot(int index) {
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+        if (map_slots[i].index == index && (map_slots[i].loading || map_slots[i].ready)) {
+            return &map_slots[i];
+        }
+    }
+    return NULL;
+}
 
-    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+MapSlot* claim_map_slot() {
+    MapSlot* victim = NULL;
 
-    SDL_Rect start_but = {but_x, 220, but_w, but_h};
-    bool active_start = (mouse_x >= start_but.x && mouse_x <= start_but.x + but_w && mouse_y >= start_but.y && mouse_y <= start_but.y + but_h);
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (!slot->loading && !slot->ready) return slot;
+        if (slot->loading || abs(slot->index - loader_focus_index) <= PREFETCH_RADIUS) continue;
+        if (!victim || slot->last_used < victim->last_used) victim = slot;
+    }
 
-    SDL_SetRenderDrawColor(renderer, active_start ? hover_color.r : but_color.r, active_start ? hover_color.g : but_color.g, active_start ? hover_color.b : but_color.b, active_start ? hover_color.a : but_color.a);
+    if (victim) {
+        log_debug("Evicting prefetched map: %s", map_files[victim->index]);
+        free_map(&victim->map);
+        victim->index = -1;
+        victim->ready = false;
+    }
+    return victim;
+}
 
-    SDL_RenderFillRect(renderer, &start_but);
+void trim_map_slots() {
+    for (;;) {
+        size_t resident = 0;
+        MapSlot* victim = NULL;
+
+        for (int i = 0; i < PREFETCH_SLOTS; i++) {
+            MapSlot* slot = &map_slots[i];
+            if (!slot->ready) continue;
+            resident += map_memory_bytes(&slot->map);
+            if (abs(slot->index - loader_focus_index) <= PREFETCH_RADIUS) continue;
+            if (!victim || slot->last_used < victim->last_used) victim = slot;
+        }
 
-    render_text("START GAME", but_x + (but_w - 100) / 2, 235, text_color);
+        if (resident <= prefetch_limit || !victim) return;
 
-    SDL_Rect settings_but = {but_x, 220 + but_spacing, but_w, but_h};
-    bool active_settings = (mouse_x >= settings_but.x && mouse_x <= settings_but.x + but_w && mouse_y >= settings_but.y && mouse_y <= settings_but.y + but_h);
+        log_debug("Evicting prefetched map: %s", map_files[victim->index]);
+        free_map(&victim->map);
+        victim->index = -1;
+        victim->ready = false;
+    }
+}
 
-    SDL_SetRenderDrawColor(renderer, active_settings ? hover_color.r : but_color.r, active_settings ? hover_color.g : but_color.g, active_settings ? hover_color.b : but_color.b, active_settings ? hover_color.a : but_color.a);
+size_t map_memory_bytes(const Map* map) {
+    size_t pixels = (size_t)map->width * map->height;
+    size_t bytes = pixels * sizeof(int);
 
-    SDL_RenderFillRect(renderer, &settings_but);
+    if (map->surface) bytes += (size_t)map->surface->pitch * map->surface->h;
+    if (map->original_surface) bytes += (size_t)map->original_surface->pitch * map->original_surface->h;
+    if (map->regions) bytes += MAX_REGIONS * sizeof(Region);
+    bytes += map->arena.reserved;
+    return bytes;
+}
 
-    render_text("SETTINGS", but_x + (but_w - 80) / 2, 235 + but_spacing, text_color);
+/* Moves the current map into a slot for later reuse; keep is never chosen, so a slot about to be taken survives. */
+void stash_current_map(const MapSlot* keep) {
+    if (loaded_map_index < 0 || !current_map.surface || find_map_slot(loaded_map_index)) {
+        free_map(&current_map);
+        loaded_map_index = -1;
+        return;
+    }
 
-    SDL_Rect exit_but = {but_x, 220 + 2 * but_spacing, but_w, but_h};
-    bool active_exit = (mouse_x >= exit_but.x && mouse_x <= exit_but.x + but_w && mouse_y >= exit_but.y && mouse_y <= exit_but.y + but_h);
+    MapSlot* target = NULL;
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (slot->loading || slot == keep) continue;
+        if (!slot->ready) {
+            target = slot;
+            break;
+        }
+        if (!target || slot->last_used < target->last_used) target = slot;
+    }
 
-    SDL_SetRenderDrawColor(renderer, active_exit ? hover_color.r : but_color.r, active_exit ? hover_color.g : but_color.g, active_exit ? hover_color.b : but_color.b, active_exit ? hover_color.a : but_color.a);
+    if (!target) {
+        free_map(&current_map);
+        loaded_map_index = -1;
+        return;
+    }
 
-    SDL_RenderFillRect(renderer, &exit_but);
+    if (target->ready) {
+        free_map(&target->map);
+    }
 
-    render_text("EXIT", but_x + (but_w - 40) / 2, 235 + 2 * but_spacing, text_color);
+    current_map.colors_used = color_used_final;
+    target->map = current_map;
+    target->index = loaded_map_index;
+    target->ready = true;
+    target->failed = false;
+    target->last_used = SDL_GetTicks();
+    memset(&current_map, 0, sizeof(Map));
+    loaded_map_index = -1;
 
+    trim_map_slots();
 }
 
-void render_menu() {
-    SDL_SetRenderDrawColor(renderer, 50, 50, 50, 255);
-    SDL_Rect menu_rect = {0, 0, WINDOW_WIDTH, MENU_HEIGHT};
-    SDL_RenderFillRect(renderer, &menu_rect);
+void take_map_slot(MapSlot* slot) {
+    /* The preview was shown colored, so the full-resolution map replacing it is colored too. */
+    bool replaces_preview = current_map.preview_scale > 1 && color_used_final > 0;
+    free_map(&current_map);
 
-    SDL_Color button_color = {100, 100, 100, 255};
-    SDL_Color text_color = {255, 255, 255, 255};
+    if (slot->failed) {
+        log_warn("Failed to load map %s", map_files[slot->index]);
+        free_map(&slot->map);
+    }
 
-    SDL_SetRenderDrawColor(renderer, button_color.r, button_color.g, button_color.b, 255);
-    SDL_Rect prev_button = {20, 20, 80, 30};
-    SDL_RenderFillRect(renderer, &prev_button);
-    render_text("<- Prev", 30, 27, text_color);
+    current_map = slot->map;
+    loaded_map_index = slot->index;
+    color_used_final = current_map.colors_used;
+    reset_tile_view();
+    if (replaces_preview && color_used_final == 0 && current_map.reg_count > 0) {
+        reset_map_colors();
+        color_used_final = greedy_coloring(&current_map);
+    }
 
-    SDL_Rect next_button = {110, 20, 80, 30};
-    SDL_RenderFillRect(renderer, &next_button);
-    render_text("Next ->", 120, 27, text_color);
+    memset(&slot->map, 0, sizeof(Map));
+    slot->index = -1;
+    slot->ready = false;
+    slot->failed = false;
+}
 
-    SDL_Rect color_button = {200, 20, 140, 30};
-    SDL_RenderFillRect(renderer, &color_button);
-    render_text("SPACE: Color", 210, 27, text_color);
+void switch_map(int index) {
+    clear_color_log();
+    if (!loader_thread) {
+        load_map(map_files[index]);
+        loaded_map_index = index;
+        return;
+    }
 
-    SDL_Rect instant_button = {350, 20, 120, 30};
-    SDL_RenderFillRect(renderer, &instant_button);
-    render_text("I: Instant", 360, 27, text_color);
+    SDL_LockMutex(loader_mutex);
+    loader_focus_index = index;
 
-    SDL_Rect reset_button = {480, 20, 80, 30};
-    SDL_RenderFillRect(renderer, &reset_button);
-    render_text("R: Reset", 490, 27, text_color);
+    MapSlot* slot = find_map_slot(index);
+    stash_current_map(slot);
+    pending_map_index = -1;
 
-    SDL_Rect save_button = {570, 20, 100, 30};
-    SDL_RenderFillRect(renderer, &save_button);
-    render_text("S: Save", 580, 27, text_color);
+    if (slot && slot->ready) {
+        take_map_slot(slot);
+    } else {
+        pending_map_index = index;
+    }
 
-    if (is_coloring) {
-        SDL_Color red = {255, 0, 0, 255};
-        if (realtime_coloring) {
-            render_text("DYNAMIC COLORING", 680, 25, red);
-        } else {
-            render_text("PROCESSING...", 680, 25, red);
+    SDL_CondSignal(loader_cond);
+    SDL_UnlockMutex(loader_mutex);
+}
+
+void poll_pending_map() {
+    if (pending_map_index < 0 || !loader_thread) return;
+
+    SDL_LockMutex(loader_mutex);
+    MapSlot* slot = find_map_slot(pending_map_index);
+    if (slot && slot->ready) {
+        take_map_slot(slot);
+        pending_map_index = -1;
+        SDL_CondSignal(loader_cond);
+    } else if (slot && slot->preview_ready) {
+        clear_color_log();
+        free_map(&current_map);
+        current_map = slot->preview;
+        memset(&slot->preview, 0, sizeof(Map));
+        slot->preview_ready = false;
+        SDL_UnlockMutex(loader_mutex);
+
+        reset_tile_view();
+        reset_map_colors();
+        color_used_final = greedy_coloring(&current_map);
+        return;
+    }
+    SDL_UnlockMutex(loader_mutex);
+}
+
+int pending_map_progress() {
+    int progress = 0;
+
+    if (!loader_thread) return progress;
+
+    SDL_LockMutex(loader_mutex);
+    MapSlot* slot = find_map_slot(pending_map_index);
+    if (slot && slot->loading) {
+        progress = SDL_AtomicGet(&slot->progress);
+    }
+    SDL_UnlockMutex(loader_mutex);
+
+    return progress;
+}
+
+int preview_factor(int width, int height) {
+    if (!preview_enabled || (long long)width * height < PREVIEW_MIN_PIXELS) return 1;
+
+    int factor = 2;
+    while (factor < PREVIEW_MAX_FACTOR && (long long)(width / factor) * (height / factor) > PREVIEW_TARGET_PIXELS) {
+        factor *= 2;
+    }
+    return factor;
+}
+
+/*
+ * Keeps the darkest pixel of every factor x factor block so ink lines
+ * survive. source can be in any 8 to 32 bit format, so the preview can be
+ * taken straight from the decoder before the full-size conversion.
+ */
+SDL_Surface* downsample_surface(SDL_Surface* source, int factor) {
+    int width = (source->w + factor - 1) / factor;
+    int height = (source->h + factor - 1) / factor;
+
+    SDL_Surface* result = mem_track_surface(MEM_SURFACE, SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888));
+    if (!result) {
+        log_error("Failed to create preview surface! SDL Error: %s", SDL_GetError());
+        return NULL;
+    }
+
+    if (SDL_MUSTLOCK(source)) SDL_LockSurface(source);
+    for (int y = 0; y < height; y++) {
+        unsigned int* out = (unsigned int*)((unsigned char*)result->pixels + (size_t)y * result->pitch);
+        int y_end = SDL_min((y + 1) * factor, source->h);
+
+        for (int x = 0; x < width; x++) {
+            int x_end = SDL_min((x + 1) * factor, source->w);
+            Uint8 darkest_r = 0, darkest_g = 0, darkest_b = 0;
+            int darkest_sum = 3 * 255 + 1;
+
+            for (int sy = y * factor; sy < y_end; sy++) {
+                const Uint8* row = (const Uint8*)source->pixels + (size_t)sy * source->pitch;
+                for (int sx = x * factor; sx < x_end; sx++) {
+                    Uint8 r, g, b;
+                    SDL_GetRGB(read_surface_pixel(source, row, sx), source->format, &r, &g, &b);
+                    if (r + g + b < darkest_sum) {
+                        darkest_sum = r + g + b;
+                        darkest_r = r;
+                        darkest_g = g;
+                        darkest_b = b;
+                    }
+                }
+            }
+            out[x] = SDL_MapRGB(result->format, darkest_r, darkest_g, darkest_b);
         }
-    } else {
-        SDL_Color green = {0, 255, 0, 255};
-        render_text("READY", 680, 25, green);
+    }
+    if (SDL_MUSTLOCK(source)) SDL_UnlockSurface(source);
+
+    return result;
+}
+
+Uint32 read_surface_pixel(const SDL_Surface* surface, const Uint8* row, int x) {
+    const Uint8* pixel = row + (size_t)x * surface->format->BytesPerPixel;
+    switch (surface->format->BytesPerPixel) {
+        case 1: return pixel[0];
+        case 2: return *(const Uint16*)pixel;
+        case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            return ((Uint32)pixel[0] << 16) | ((Uint32)pixel[1] << 8) | pixel[2];
+#else
+            return pixel[0] | ((Uint32)pixel[1] << 8) | ((Uint32)pixel[2] << 16);
+#endif
+        default: return *(const Uint32*)pixel;
+    }
+}
+
+bool build_preview_map(Map* preview, SDL_Surface* source, int factor) {
+    memset(preview, 0, sizeof(Map));
+
+    preview->surface = downsample_surface(source, factor);
+    if (!preview->surface) return false;
+
+    preview->original_surface = mem_track_surface(MEM_ORIGINAL_SURFACE, SDL_ConvertSurface(preview->surface, preview->surface->format, 0));
+    if (!preview->original_surface) {
+        free_map(preview);
+        return false;
+    }
+
+    preview->width = preview->surface->w;
+    preview->height = preview->surface->h;
+    preview->pixels = (unsigned int*)preview->surface->pixels;
+    preview->preview_scale = factor;
+
+    if (!segment_map(preview, NULL)) {
+        free_map(preview);
+        return false;
+    }
+    return true;
+}
+
+bool process_map_progressive(MapSlot* slot, const char* filename) {
+    Map* map = &slot->map;
+    uint64_t start_time = now_ns();
+
+    map->progress = &slot->progress;
+
+    if (is_map_export(filename)) {
+        ProfileScope export_scope = profile_begin("load_export");
+        bool loaded = load_map_export(map, filename);
+        profile_end(&export_scope);
+        return loaded;
+    }
+
+    char cache_path[512];
+    ProfileScope key_scope = profile_begin("cache_key");
+    bool cacheable = cache_enabled && map_cache_key(filename, map_options_of(map), cache_path, sizeof(cache_path));
+    profile_end(&key_scope);
+
+    ProfileScope decode_scope = profile_begin("decode");
+    SDL_Surface* loaded_surface = decode_image(filename);
+    profile_end(&decode_scope);
+
+    /* The preview is taken from the decoder's output, ahead of the full-size conversion and copy. */
+    int factor = loaded_surface ? preview_factor(loaded_surface->w, loaded_surface->h) : 1;
+    SDL_LockMutex(loader_mutex);
+    bool wanted = pending_map_index == slot->index;
+    SDL_UnlockMutex(loader_mutex);
+
+    if (factor > 1 && wanted) {
+        Map preview;
+        ProfileScope preview_scope = profile_begin("preview");
+        bool built = build_preview_map(&preview, loaded_surface, factor);
+        profile_end(&preview_scope);
+        if (built) {
+            SDL_LockMutex(loader_mutex);
+            slot->preview = preview;
+            slot->preview_ready = true;
+            SDL_UnlockMutex(loader_mutex);
+            log_info("Preview of %s ready in %.3f ms (1:%d scale, %d regions)", filename, (now_ns() - start_time) / 1e6, factor, preview.reg_count);
+        }
+    }
+
+    ProfileScope convert_scope = profile_begin("convert");
+    bool decoded = init_map_surfaces(map, loaded_surface);
+    profile_end(&convert_scope);
+    if (!decoded) {
+        return false;
+    }
+
+    bool loaded = segment_map(map, cacheable ? cache_path : NULL);
+    log_info("Map %s processed in %.3f ms", filename, (now_ns() - start_time) / 1e6);
+    return loaded;
+}
+
+void reset_tile_view() {
+    free_tile_pyramid();
+
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        if (tile_cache[i].texture) {
+            SDL_DestroyTexture(tile_cache[i].texture);
+        }
+        memset(&tile_cache[i], 0, sizeof(TileTexture));
+    }
+
+    view_fit = true;
+    view_dragging = false;
+}
+
+void free_tile_pyramid() {
+    for (int level = 0; level < tile_pyramid.level_count; level++) {
+        if (level > 0 && tile_pyramid.levels[level]) {
+            mem_free_surface(MEM_TILES, tile_pyramid.levels[level]);
+        }
+        mem_free(tile_pyramid.versions[level]);
+        mem_free(tile_pyramid.stale[level]);
+    }
+    memset(&tile_pyramid, 0, sizeof(TilePyramid));
+}
+
+bool ensure_tile_pyramid() {
+    if (!current_map.surface) return false;
+    if (tile_pyramid.level_count > 0 && tile_pyramid.levels[0] == current_map.surface) return true;
+
+    free_tile_pyramid();
+
+    int width = current_map.surface->w;
+    int height = current_map.surface->h;
+
+    for (int level = 0; level < MAX_LOD_LEVELS; level++) {
+        int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+        tile_pyramid.levels[level] = level == 0 ? current_map.surface : mem_track_surface(MEM_TILES, SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888));
+        tile_pyramid.tiles_x[level] = tiles_x;
+        tile_pyramid.tiles_y[level] = tiles_y;
+        tile_pyramid.versions[level] = mem_calloc(MEM_TILES, tiles_x * tiles_y, sizeof(unsigned int));
+        tile_pyramid.stale[level] = mem_alloc(MEM_TILES, tiles_x * tiles_y * sizeof(bool));
+        tile_pyramid.level_count = level + 1;
+
+        if (!tile_pyramid.levels[level] || !tile_pyramid.versions[level] || !tile_pyramid.stale[level]) {
+            log_error("Failed to allocate level %d of the tile pyramid", level);
+            free_tile_pyramid();
+            return false;
+        }
+        memset(tile_pyramid.stale[level], level > 0, tiles_x * tiles_y * sizeof(bool));
+
+        if (width <= TILE_SIZE && height <= TILE_SIZE) break;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        tile_cache[i].version = (unsigned int)-1;
+    }
+
+    return true;
+}
+
+void mark_tiles_dirty(int x, int y, int w, int h) {
+    if (tile_pyramid.level_count == 0 || tile_pyramid.levels[0] != current_map.surface || w <= 0 || h <= 0) return;
+
+    for (int level = 0; level < tile_pyramid.level_count; level++) {
+        int span = TILE_SIZE << level;
+        int tx0 = x / span, tx1 = SDL_min((x + w - 1) / span, tile_pyramid.tiles_x[level] - 1);
+        int ty0 = y / span, ty1 = SDL_min((y + h - 1) / span, tile_pyramid.tiles_y[level] - 1);
+
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                int index = ty * tile_pyramid.tiles_x[level] + tx;
+                tile_pyramid.versions[level][index]++;
+                if (level > 0) tile_pyramid.stale[level][index] = true;
+            }
+        }
+    }
+}
+
+void update_tile_pixels(int level, int tx, int ty) {
+    int index = ty * tile_pyramid.tiles_x[level] + tx;
+    if (level == 0 || !tile_pyramid.stale[level][index]) return;
+
+    SDL_Surface* src = tile_pyramid.levels[level - 1];
+    SDL_Surface* dst = tile_pyramid.levels[level];
+
+    for (int cy = 2 * ty; cy <= 2 * ty + 1 && cy < tile_pyramid.tiles_y[level - 1]; cy++) {
+        for (int cx = 2 * tx; cx <= 2 * tx + 1 && cx < tile_pyramid.tiles_x[level - 1]; cx++) {
+            update_tile_pixels(level - 1, cx, cy);
+        }
+    }
+
+    int x_end = SDL_min((tx + 1) * TILE_SIZE, dst->w);
+    int y_end = SDL_min((ty + 1) * TILE_SIZE, dst->h);
+
+    for (int y = ty * TILE_SIZE; y < y_end; y++) {
+        const unsigned int* row0 = (const unsigned int*)((const unsigned char*)src->pixels + (size_t)(2 * y) * src->pitch);
+        const unsigned int* row1 = 2 * y + 1 < src->h ? (const unsigned int*)((const unsigned char*)row0 + src->pitch) : row0;
+        unsigned int* out = (unsigned int*)((unsigned char*)dst->pixels + (size_t)y * dst->pitch);
+
+        for (int x = tx * TILE_SIZE; x < x_end; x++) {
+            int x0 = 2 * x;
+            int x1 = x0 + 1 < src->w ? x0 + 1 : x0;
+            unsigned int p[4] = {row0[x0], row0[x1], row1[x0], row1[x1]};
+            unsigned int r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; k++) {
+                r += (p[k] >> 16) & 0xFF;
+                g += (p[k] >> 8) & 0xFF;
+                b += p[k] & 0xFF;
+            }
+            out[x] = 0xFF000000u | ((r / 4) << 16) | ((g / 4) << 8) | (b / 4);
+        }
+    }
+
+    tile_pyramid.stale[level][index] = false;
+}
+
+SDL_Texture* get_tile_texture(int level, int tx, int ty) {
+    unsigned int version = tile_pyramid.versions[level][ty * tile_pyramid.tiles_x[level] + tx];
+    TileTexture* entry = NULL;
+    TileTexture* victim = &tile_cache[0];
+
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        TileTexture* candidate = &tile_cache[i];
+        if (candidate->texture && candidate->level == level && candidate->tx == tx && candidate->ty == ty) {
+            entry = candidate;
+            break;
+        }
+        if (victim->texture && (!candidate->texture || candidate->last_used < victim->last_used)) {
+            victim = candidate;
+        }
+    }
+
+    if (entry && entry->version == version) {
+        entry->last_used = ++tile_clock;
+        return entry->texture;
     }
 
-    render_text("ESC: Exit  |  Left / Right: Maps  |  SPACE: Dynamic  |  I: Instant  |  R: Reset  |  S: Save", 10, 70, text_color);
+    if (!entry) {
+        entry = victim;
+        if (!entry->texture) {
+            entry->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, TILE_SIZE, TILE_SIZE);
+            if (!entry->texture) {
+                log_error("Failed to create tile texture: %s", SDL_GetError());
+                return NULL;
+            }
+        }
+        entry->level = level;
+        entry->tx = tx;
+        entry->ty = ty;
+    }
+
+    ProfileScope scope = profile_begin("tile_upload");
+    update_tile_pixels(level, tx, ty);
+
+    SDL_Surface* surface = tile_pyramid.levels[level];
+    SDL_Rect area = {0, 0, SDL_min(TILE_SIZE, surface->w - tx * TILE_SIZE), SDL_min(TILE_SIZE, surface->h - ty * TILE_SIZE)};
+    const unsigned char* pixels = (const unsigned char*)surface->pixels + (size_t)ty * TILE_SIZE * surface->pitch + (size_t)tx * TILE_SIZE * 4;
+    SDL_UpdateTexture(entry->texture, &area, pixels, surface->pitch);
+    profile_end(&scope);
+
+    entry->version = version;
+    entry->last_used = ++tile_clock;
+    return entry->texture;
+}
+
+void fit_view(const SDL_Rect* viewport) {
+    double scale_x = (double)viewport->w / current_map.width;
+    double scale_y = (double)viewport->h / current_map.height;
+    view_scale = scale_x < scale_y ? scale_x : scale_y;
+    view_x = (current_map.width - viewport->w / view_scale) / 2;
+    view_y = (current_map.height - viewport->h / view_scale) / 2;
 }
 
-void save_colored_map(const char* filename) {
-    if (current_map.surface) {
-        if (SDL_SaveBMP(current_map.surface, filename) != 0) {
-            log_format("Ошибка сохранения файла %s: %s\n", filename, SDL_GetError());
+void zoom_view(const SDL_Rect* viewport, double factor, int screen_x, int screen_y) {
+    if (!current_map.surface) return;
+    if (view_fit) fit_view(viewport);
+
+    double new_scale = view_scale * factor;
+    if (new_scale < MIN_VIEW_SCALE) new_scale = MIN_VIEW_SCALE;
+    if (new_scale > MAX_VIEW_SCALE) new_scale = MAX_VIEW_SCALE;
+
+    double map_x = view_x + (screen_x - viewport->x) / view_scale;
+    double map_y = view_y + (screen_y - viewport->y) / view_scale;
+    view_scale = new_scale;
+    view_x = map_x - (screen_x - viewport->x) / view_scale;
+    view_y = map_y - (screen_y - viewport->y) / view_scale;
+    view_fit = false;
+}
+
+void render_map_tiles(const SDL_Rect* viewport) {
+    if (!ensure_tile_pyramid()) return;
+    if (view_fit) fit_view(viewport);
+
+    int level = 0;
+    while (level + 1 < tile_pyramid.level_count && view_scale * (2 << level) <= 1.0) {
+        level++;
+    }
+
+    SDL_Surface* surface = tile_pyramid.levels[level];
+    double level_scale = view_scale * (1 << level);
+    double origin_x = view_x / (1 << level);
+    double origin_y = view_y / (1 << level);
+
+    int tx0 = SDL_max(0, (int)(origin_x / TILE_SIZE));
+    int ty0 = SDL_max(0, (int)(origin_y / TILE_SIZE));
+    int tx1 = SDL_min(tile_pyramid.tiles_x[level] - 1, (int)((origin_x + viewport->w / level_scale) / TILE_SIZE));
+    int ty1 = SDL_min(tile_pyramid.tiles_y[level] - 1, (int)((origin_y + viewport->h / level_scale) / TILE_SIZE));
+
+    SDL_RenderSetClipRect(renderer, viewport);
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            SDL_Texture* texture = get_tile_texture(level, tx, ty);
+            if (!texture) continue;
+
+            int tile_w = SDL_min(TILE_SIZE, surface->w - tx * TILE_SIZE);
+            int tile_h = SDL_min(TILE_SIZE, surface->h - ty * TILE_SIZE);
+            int x0 = viewport->x + (int)floor((tx * TILE_SIZE - origin_x) * level_scale);
+            int y0 = viewport->y + (int)floor((ty * TILE_SIZE - origin_y) * level_scale);
+            int x1 = viewport->x + (int)floor((tx * TILE_SIZE + tile_w - origin_x) * level_scale);
+            int y1 = viewport->y + (int)floor((ty * TILE_SIZE + tile_h - origin_y) * level_scale);
+
+            SDL_Rect src_rect = {0, 0, tile_w, tile_h};
+            SDL_Rect dest_rect = {x0, y0, x1 - x0, y1 - y0};
+            SDL_RenderCopy(renderer, texture, &src_rect, &dest_rect);
         }
     }
-} 
\ No newline at end of file
+
+    SDL_RenderSetClipRect(renderer, NULL);
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_BORDER 64
+#define WARP_OCTAVES 4
+#define NOISE_FLIP_RATE 0.005
+
+typedef enum {
+    KIND_VORONOI, KIND_GRID, KIND_COASTLINE, KIND_NOISY
+} MapKind;
+
+typedef struct {
+    MapKind kind;
+    int width;
+    int height;
+    long long regions;
+    int border;
+    uint64_t seed;
+    int cells_x;
+    int cells_y;
+    double cell_w;
+    double cell_h;
+} Generator;
+
+const char* kind_names[] = {"voronoi", "grid", "coastline", "noisy"};
+
+void print_usage();
+bool parse_kind(const char* name, MapKind* kind);
+void setup_generator(Generator* gen);
+uint64_t mix64(uint64_t x);
+double hash_unit(const Generator* gen, long long a, long long b, int salt);
+int voronoi_label(const Generator* gen, double x, double y);
+double value_noise(const Generator* gen, double x, double y, int salt);
+double fractal_noise(const Generator* gen, double x, double y, int salt);
+int label_at(const Generator* gen, int x, int y);
+void fill_label_row(const Generator* gen, int y, int* row);
+bool write_map(const Generator* gen, const char* filename);
+void put_u16(unsigned char* p, unsigned int v);
+void put_u32(unsigned char* p, uint32_t v);
+
+int main(int argc, char* argv[]) {
+    Generator gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.kind = KIND_VORONOI;
+    gen.width = 1000;
+    gen.height = 1000;
+    gen.regions = 100;
+    gen.border = 2;
+    gen.seed = 1;
+    const char* output = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--kind") == 0 && i + 1 < argc) {
+            if (!parse_kind(argv[++i], &gen.kind)) {
+                fprintf(stderr, "Unknown map kind: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &gen.width, &gen.height) != 2) {
+                fprintf(stderr, "Size must look like WIDTHxHEIGHT: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--regions") == 0 && i + 1 < argc) {
+            gen.regions = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            gen.border = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            gen.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!output || gen.width <= 0 || gen.height <= 0 || gen.regions < 1 || gen.border < 1 || gen.border > MAX_BORDER) {
+        print_usage();
+        return 1;
+    }
+
+    setup_generator(&gen);
+    if (!write_map(&gen, output)) {
+        return 1;
+    }
+
+    printf("%s: %s %dx%d, %d x %d cells, border %d px, seed %llu\n", output, kind_names[gen.kind],
+           gen.width, gen.height, gen.cells_x, gen.cells_y, gen.border, (unsigned long long)gen.seed);
+    return 0;
+}
+
+void print_usage() {
+    fprintf(stderr, "Usage: mapgen [--kind voronoi|grid|coastline|noisy] [--size WxH] [--regions N]\n");
+    fprintf(stderr, "              [--border PX] [--seed S] -o FILE.bmp\n");
+    fprintf(stderr, "Writes an 8-bit top-down BMP with roughly N regions separated by black borders.\n");
+}
+
+bool parse_kind(const char* name, MapKind* kind) {
+    for (int i = 0; i < (int)(sizeof(kind_names) / sizeof(kind_names[0])); i++) {
+        if (strcmp(name, kind_names[i]) == 0) {
+            *kind = (MapKind)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void setup_generator(Generator* gen) {
+    double aspect = (double)gen->width / gen->height;
+    gen->cells_x = (int)fmax(1.0, round(sqrt((double)gen->regions * aspect)));
+    gen->cells_y = (int)fmax(1.0, round((double)gen->regions / gen->cells_x));
+    if (gen->cells_x > gen->width) gen->cells_x = gen->width;
+    if (gen->cells_y > gen->height) gen->cells_y = gen->height;
+    gen->cell_w = (double)gen->width / gen->cells_x;
+    gen->cell_h = (double)gen->height / gen->cells_y;
+}
+
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+double hash_unit(const Generator* gen, long long a, long long b, int salt) {
+    uint64_t h = mix64(gen->seed ^ mix64((uint64_t)a * 0x9E3779B97F4A7C15ull ^ mix64((uint64_t)b + (uint64_t)salt * 0x632BE59BD9B4E019ull)));
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Seeds are jittered one per grid cell, so the nearest one is in the 3x3 block around the pixel. */
+int voronoi_label(const Generator* gen, double x, double y) {
+    int cx = (int)fmin(fmax(floor(x / gen->cell_w), 0), gen->cells_x - 1);
+    int cy = (int)fmin(fmax(floor(y / gen->cell_h), 0), gen->cells_y - 1);
+    double best = INFINITY;
+    int label = 0;
+
+    for (int j = cy - 1; j <= cy + 1; j++) {
+        if (j < 0 || j >= gen->cells_y) continue;
+        for (int i = cx - 1; i <= cx + 1; i++) {
+            if (i < 0 || i >= gen->cells_x) continue;
+            double sx = (i + 0.1 + 0.8 * hash_unit(gen, i, j, 1)) * gen->cell_w;
+            double sy = (j + 0.1 + 0.8 * hash_unit(gen, i, j, 2)) * gen->cell_h;
+            double d = (sx - x) * (sx - x) + (sy - y) * (sy - y);
+            if (d < best) {
+                best = d;
+                label = j * gen->cells_x + i;
+            }
+        }
+    }
+    return label;
+}
+
+double value_noise(const Generator* gen, double x, double y, int salt) {
+    long long x0 = (long long)floor(x), y0 = (long long)floor(y);
+    double fx = x - x0, fy = y - y0;
+    double sx = fx * fx * (3 - 2 * fx), sy = fy * fy * (3 - 2 * fy);
+
+    double a = hash_unit(gen, x0, y0, salt), b = hash_unit(gen, x0 + 1, y0, salt);
+    double c = hash_unit(gen, x0, y0 + 1, salt), d = hash_unit(gen, x0 + 1, y0 + 1, salt);
+    return (a + (b - a) * sx) + ((c + (d - c) * sx) - (a + (b - a) * sx)) * sy - 0.5;
+}
+
+double fractal_noise(const Generator* gen, double x, double y, int salt) {
+    double sum = 0, amplitude = 1, frequency = 1;
+    for (int octave = 0; octave < WARP_OCTAVES; octave++) {
+        sum += amplitude * value_noise(gen, x * frequency, y * frequency, salt + octave);
+        amplitude *= 0.5;
+        frequency *= 2;
+    }
+    return sum;
+}
+
+int label_at(const Generator* gen, int x, int y) {
+    switch (gen->kind) {
+    case KIND_GRID: {
+        int i = (int)(x / gen->cell_w), j = (int)(y / gen->cell_h);
+        return j * gen->cells_x + i;
+    }
+    case KIND_COASTLINE: {
+        double u = x / gen->cell_w, v = y / gen->cell_h;
+        double wx = x + 1.2 * gen->cell_w * fractal_noise(gen, u, v, 10);
+        double wy = y + 1.2 * gen->cell_h * fractal_noise(gen, u, v, 20);
+        return voronoi_label(gen, wx, wy);
+    }
+    case KIND_VORONOI:
+    case KIND_NOISY:
+    default:
+        return voronoi_label(gen, x + 0.5, y + 0.5);
+    }
+}
+
+void fill_label_row(const Generator* gen, int y, int* row) {
+    for (int x = 0; x < gen->width; x++) {
+        row[x] = label_at(gen, x, y);
+    }
+}
+
+void put_u16(unsigned char* p, unsigned int v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+void put_u32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+/*
+ * Rows are generated and written one at a time, keeping only the label rows
+ * the border test needs, so maps far larger than memory can be produced.
+ * A pixel is ink when any label in the (border + 1)^2 block starting at it
+ * differs from its own, giving lines about border pixels thick.
+ */
+bool write_map(const Generator* gen, const char* filename) {
+    uint64_t stride = ((uint64_t)gen->width + 3) & ~3ull;
+    uint64_t data_size = stride * (uint64_t)gen->height;
+    uint64_t offset = 14 + 40 + 256 * 4;
+    if (offset + data_size > UINT32_MAX) {
+        fprintf(stderr, "%dx%d is too large for a BMP file\n", gen->width, gen->height);
+        return false;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+
+    unsigned char header[14 + 40];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    put_u32(header + 2, (uint32_t)(offset + data_size));
+    put_u32(header + 10, (uint32_t)offset);
+    put_u32(header + 14, 40);
+    put_u32(header + 18, (uint32_t)gen->width);
+    put_u32(header + 22, (uint32_t)-gen->height);
+    put_u16(header + 26, 1);
+    put_u16(header + 28, 8);
+    put_u32(header + 34, (uint32_t)data_size);
+    put_u32(header + 38, 2835);
+    put_u32(header + 42, 2835);
+    put_u32(header + 46, 256);
+    fwrite(header, 1, sizeof(header), file);
+
+    for (int i = 0; i < 256; i++) {
+        unsigned char entry[4] = {(unsigned char)i, (unsigned char)i, (unsigned char)i, 0};
+        fwrite(entry, 1, sizeof(entry), file);
+    }
+
+    int window = gen->border + 1;
+    int* labels = malloc((size_t)window * gen->width * sizeof(int));
+    unsigned char* out = calloc(stride, 1);
+    if (!labels || !out) {
+        fprintf(stderr, "Out of memory\n");
+        free(labels);
+        free(out);
+        fclose(file);
+        return false;
+    }
+
+    for (int k = 0; k < window && k < gen->height; k++) {
+        fill_label_row(gen, k, labels + (size_t)k * gen->width);
+    }
+
+    bool ok = true;
+    for (int y = 0; y < gen->height && ok; y++) {
+        const int* own = labels + (size_t)(y % window) * gen->width;
+
+        for (int x = 0; x < gen->width; x++) {
+            bool ink = false;
+            for (int dy = 0; dy < window && !ink && y + dy < gen->height; dy++) {
+                const int* row = labels + (size_t)((y + dy) % window) * gen->width;
+                for (int dx = 0; dx < window && x + dx < gen->width; dx++) {
+                    if (row[x + dx] != own[x]) {
+                        ink = true;
+                        break;
+                    }
+                }
+            }
+
+            unsigned char value = ink ? 0 : 255;
+            if (gen->kind == KIND_NOISY) {
+                double r = hash_unit(gen, x, y, 99);
+                if (r < NOISE_FLIP_RATE) {
+                    value = ink ? 255 : 0;
+                } else {
+                    int jitter = (int)(hash_unit(gen, x, y, 98) * 40);
+                    value = ink ? (unsigned char)jitter : (unsigned char)(255 - jitter);
+                }
+            }
+            out[x] = value;
+        }
+
+        ok = fwrite(out, 1, (size_t)stride, file) == stride;
+
+        if (y + window < gen->height) {
+            fill_label_row(gen, y + window, labels + (size_t)(y % window) * gen->width);
+        }
+    }
+
+    free(labels);
+    free(out);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        remove(filename);
+    }
+    return ok;
+}